@@ -0,0 +1,595 @@
+///
+/// Charset detection and streaming transcoding to UTF-8.
+///
+
+#include "charset.hpp"
+#include "strings.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRAWLER_X86 1
+#endif
+
+namespace crawler::tables {
+extern const uint16_t GB18030_TWO_BYTE[126 * 191];
+extern const uint16_t BIG5_TWO_BYTE[126 * 191];
+extern const uint32_t GB18030_RANGES[206][2];
+} // namespace crawler::tables
+
+namespace {
+
+const char32_t REPLACEMENT = 0xFFFD;
+
+inline char toAsciiLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c;
+}
+
+inline bool isWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/// Position of `needle` in `haystack` ignoring ascii case, `npos` if none.
+/// `needle` is lower case.
+size_t findIgnoreCase(std::string_view haystack, std::string_view needle,
+                      size_t from = 0) {
+  auto it = std::search(haystack.begin() + std::min(from, haystack.size()),
+                        haystack.end(), needle.begin(), needle.end(),
+                        [](char a, char b) { return toAsciiLower(a) == b; });
+  return it == haystack.end() ? std::string_view::npos
+                              : static_cast<size_t>(it - haystack.begin());
+}
+
+/// Value of `charset=` at `pos`, eg `gbk` of `charset="gbk"`.
+std::string_view charsetValue(std::string_view text, size_t pos) {
+  pos += std::strlen("charset");
+  while (pos < text.size() && isWhitespace(text[pos])) {
+    pos++;
+  }
+  if (pos >= text.size() || text[pos] != '=') {
+    return std::string_view();
+  }
+  pos++;
+  while (pos < text.size() && isWhitespace(text[pos])) {
+    pos++;
+  }
+  if (pos < text.size() && (text[pos] == '"' || text[pos] == '\'')) {
+    pos++;
+  }
+  size_t end = pos;
+  while (end < text.size() && !isWhitespace(text[end]) && text[end] != '"' &&
+         text[end] != '\'' && text[end] != ';' && text[end] != '>' &&
+         text[end] != '/') {
+    end++;
+  }
+  return text.substr(pos, end - pos);
+}
+
+/// Length of the ascii prefix of `[data, data + length)`.
+size_t asciiPrefixLength(const uint8_t *data, size_t length) {
+  size_t i = 0;
+#ifdef CRAWLER_X86
+  for (; i + 16 <= length; i += 16) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    const int mask = _mm_movemask_epi8(block);
+    if (mask != 0) {
+      return i + __builtin_ctz(static_cast<unsigned>(mask));
+    }
+  }
+#else
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    if ((word & 0x8080808080808080ULL) != 0) {
+      break;
+    }
+  }
+#endif
+  while (i < length && data[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+bool isValidUtf8Scalar(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    i += asciiPrefixLength(data + i, length - i);
+    if (i == length) {
+      break;
+    }
+    const uint8_t lead = data[i];
+    size_t needed;
+    uint8_t lower = 0x80;
+    uint8_t upper = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+      needed = 1;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+      needed = 2;
+      lower = lead == 0xE0 ? 0xA0 : lower;
+      upper = lead == 0xED ? 0x9F : upper;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+      needed = 3;
+      lower = lead == 0xF0 ? 0x90 : lower;
+      upper = lead == 0xF4 ? 0x8F : upper;
+    } else {
+      return false;
+    }
+    if (i + needed >= length) {
+      return false;
+    }
+    if (data[i + 1] < lower || data[i + 1] > upper) {
+      return false;
+    }
+    for (size_t j = 2; j <= needed; j++) {
+      if (data[i + j] < 0x80 || data[i + j] > 0xBF) {
+        return false;
+      }
+    }
+    i += needed + 1;
+  }
+  return true;
+}
+
+#ifdef CRAWLER_X86
+/// Error bits of the lookup tables, a valid byte pair has none of them.
+/// See "Validating UTF-8 In Less Than One Instruction Per Byte", Keiser and
+/// Lemire, 2021.
+const uint8_t TOO_SHORT = 1 << 0;
+const uint8_t TOO_LONG = 1 << 1;
+const uint8_t OVERLONG_3 = 1 << 2;
+const uint8_t TOO_LARGE = 1 << 3;
+const uint8_t SURROGATE = 1 << 4;
+const uint8_t OVERLONG_2 = 1 << 5;
+const uint8_t TOO_LARGE_1000 = 1 << 6;
+const uint8_t OVERLONG_4 = 1 << 6;
+const uint8_t TWO_CONTS = 1 << 7;
+const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+__attribute__((target("ssse3"))) inline __m128i
+lookup(const uint8_t (&table)[16], __m128i indexes) {
+  return _mm_shuffle_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)), indexes);
+}
+
+__attribute__((target("ssse3"))) inline __m128i highNibbles(__m128i input) {
+  return _mm_and_si128(_mm_srli_epi16(input, 4), _mm_set1_epi8(0x0F));
+}
+
+/// Errors of the 16 bytes of `input`, `previous` is the block in front of it.
+__attribute__((target("ssse3"))) __m128i blockErrors(__m128i input,
+                                                     __m128i previous) {
+  static const uint8_t BYTE_1_HIGH[16] = {
+      // 0_______ ________ <ascii in byte 1>
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TOO_LONG,
+      // 10______ ________ <continuation in byte 1>
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      // 1100____ ________ <two byte lead in byte 1>
+      TOO_SHORT | OVERLONG_2,
+      // 1101____ ________ <two byte lead in byte 1>
+      TOO_SHORT,
+      // 1110____ ________ <three byte lead in byte 1>
+      TOO_SHORT | OVERLONG_3 | SURROGATE,
+      // 1111____ ________ <four+ byte lead in byte 1>
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4};
+  static const uint8_t BYTE_1_LOW[16] = {
+      // ____0000 ________
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+      // ____0001 ________
+      CARRY | OVERLONG_2,
+      // ____001_ ________
+      CARRY, CARRY,
+      // ____0100 ________
+      CARRY | TOO_LARGE,
+      // ____0101 ________
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      // ____011_ ________
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      // ____1___ ________
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      // ____1101 ________
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000};
+  static const uint8_t BYTE_2_HIGH[16] = {
+      // ________ 0_______ <ascii in byte 2>
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT,
+      // ________ 1000____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+          OVERLONG_4,
+      // ________ 1001____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      // ________ 101_____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      // ________ 11______
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT};
+
+  const __m128i previous1 = _mm_alignr_epi8(input, previous, 15);
+  const __m128i specialCases = _mm_and_si128(
+      _mm_and_si128(lookup(BYTE_1_HIGH, highNibbles(previous1)),
+                    lookup(BYTE_1_LOW,
+                           _mm_and_si128(previous1, _mm_set1_epi8(0x0F)))),
+      lookup(BYTE_2_HIGH, highNibbles(input)));
+  // the third and fourth byte of a sequence must be continuations, which the
+  // tables flag as TWO_CONTS.
+  const __m128i previous2 = _mm_alignr_epi8(input, previous, 14);
+  const __m128i previous3 = _mm_alignr_epi8(input, previous, 13);
+  const __m128i isThirdByte = _mm_subs_epu8(previous2, _mm_set1_epi8(0x60));
+  const __m128i isFourthByte = _mm_subs_epu8(previous3, _mm_set1_epi8(0x70));
+  const __m128i mustBeContinuation =
+      _mm_and_si128(_mm_or_si128(isThirdByte, isFourthByte),
+                    _mm_set1_epi8(static_cast<char>(0x80)));
+  return _mm_xor_si128(mustBeContinuation, specialCases);
+}
+
+/// Non-zero if the block ends in the middle of a sequence.
+__attribute__((target("ssse3"))) inline __m128i incomplete(__m128i input) {
+  const __m128i maxValue =
+      _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1),
+                    static_cast<char>(0xC0 - 1));
+  return _mm_subs_epu8(input, maxValue);
+}
+
+__attribute__((target("ssse3"))) bool isValidUtf8Ssse3(const uint8_t *data,
+                                                      size_t length) {
+  __m128i errors = _mm_setzero_si128();
+  __m128i previous = _mm_setzero_si128();
+  __m128i previousIncomplete = _mm_setzero_si128();
+  size_t i = 0;
+  uint8_t last[16] = {};
+  while (i < length) {
+    __m128i input;
+    if (i + 16 <= length) {
+      input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    } else {
+      // pad the last block with ascii.
+      std::memcpy(last, data + i, length - i);
+      input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(last));
+    }
+    i += 16;
+    if (_mm_movemask_epi8(input) == 0) {
+      // an ascii block is valid unless the previous one is incomplete.
+      errors = _mm_or_si128(errors, previousIncomplete);
+      continue;
+    }
+    errors = _mm_or_si128(errors, blockErrors(input, previous));
+    previousIncomplete = incomplete(input);
+    previous = input;
+  }
+  errors = _mm_or_si128(errors, previousIncomplete);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) ==
+         0xFFFF;
+}
+#endif
+
+/// Length of the sequence led by `lead`, 0 if it isn't a lead byte.
+inline size_t sequenceLength(uint8_t lead) {
+  if (lead >= 0xC0 && lead <= 0xDF) {
+    return 2;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    return 3;
+  } else if (lead >= 0xF0 && lead <= 0xF7) {
+    return 4;
+  }
+  return 0;
+}
+
+/// Number of bytes at the end of `[p, end)` which start a sequence finished
+/// by the next chunk.
+size_t incompleteTail(const uint8_t *p, const uint8_t *end) {
+  for (size_t i = 1; i <= 3 && i <= static_cast<size_t>(end - p); i++) {
+    const uint8_t byte = *(end - i);
+    if ((byte & 0xC0) == 0x80) {
+      continue;
+    }
+    return sequenceLength(byte) > i ? i : 0;
+  }
+  return 0;
+}
+
+char32_t gb18030RangesCodePoint(uint32_t pointer) {
+  if ((pointer > 39419 && pointer < 189000) || pointer > 1237575) {
+    return 0;
+  }
+  if (pointer >= 189000) {
+    return 0x10000 + pointer - 189000;
+  }
+  const auto *range = std::upper_bound(
+      std::begin(crawler::tables::GB18030_RANGES),
+      std::end(crawler::tables::GB18030_RANGES), pointer,
+      [](uint32_t value, const uint32_t(&range)[2]) {
+        return value < range[0];
+      });
+  range--;
+  return (*range)[1] + pointer - (*range)[0];
+}
+
+} // namespace
+
+crawler::Charset crawler::charsetFromLabel(std::string_view label) {
+  while (!label.empty() && isWhitespace(label.front())) {
+    label.remove_prefix(1);
+  }
+  while (!label.empty() && isWhitespace(label.back())) {
+    label.remove_suffix(1);
+  }
+  std::string name(label);
+  std::transform(name.begin(), name.end(), name.begin(), toAsciiLower);
+  if (name == "utf-8" || name == "utf8" || name == "unicode-1-1-utf-8") {
+    return Charset::Utf8;
+  }
+  if (name == "gbk" || name == "gb2312" || name == "gb_2312-80" ||
+      name == "gb18030" || name == "chinese" || name == "csgb2312" ||
+      name == "iso-ir-58" || name == "x-gbk" || name == "cp936" ||
+      name == "windows-936") {
+    return Charset::Gb18030;
+  }
+  // big5-hkscs isn't supported, the table is cp950 which lacks the HKSCS
+  // extensions.
+  if (name == "big5" || name == "cn-big5" || name == "csbig5" ||
+      name == "x-x-big5" || name == "cp950") {
+    return Charset::Big5;
+  }
+  return Charset::Unknown;
+}
+
+crawler::Charset crawler::charsetFromContentType(std::string_view contentType) {
+  const size_t pos = findIgnoreCase(contentType, "charset");
+  if (pos == std::string_view::npos) {
+    return Charset::Unknown;
+  }
+  return charsetFromLabel(charsetValue(contentType, pos));
+}
+
+crawler::Charset crawler::sniffCharset(std::string_view head) {
+  head = head.substr(0, SNIFF_LENGTH);
+  size_t pos = 0;
+  while ((pos = findIgnoreCase(head, "<meta", pos)) != std::string_view::npos) {
+    const size_t end = std::min(head.find('>', pos), head.size());
+    const std::string_view tag = head.substr(pos, end - pos);
+    const size_t charset = findIgnoreCase(tag, "charset");
+    if (charset != std::string_view::npos) {
+      const Charset result = charsetFromLabel(charsetValue(tag, charset));
+      if (result != Charset::Unknown) {
+        return result;
+      }
+    }
+    pos = end;
+  }
+  return Charset::Unknown;
+}
+
+bool crawler::isValidUtf8(const char *data, size_t length) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+#ifdef CRAWLER_X86
+  static const bool hasSsse3 = __builtin_cpu_supports("ssse3");
+  if (hasSsse3) {
+    return isValidUtf8Ssse3(bytes, length);
+  }
+#endif
+  return isValidUtf8Scalar(bytes, length);
+}
+
+crawler::CharsetDecoder::CharsetDecoder(Charset charset)
+    : charset(charset == Charset::Unknown ? Charset::Utf8 : charset) {}
+
+bool crawler::CharsetDecoder::decodeUtf8Byte(uint8_t byte) {
+  if (bytesNeeded == 0) {
+    if (byte < 0x80) {
+      buffer += static_cast<char>(byte);
+    } else if (byte >= 0xC2 && byte <= 0xDF) {
+      bytesNeeded = 1;
+      codePoint = byte & 0x1F;
+    } else if (byte >= 0xE0 && byte <= 0xEF) {
+      lowerBoundary = byte == 0xE0 ? 0xA0 : lowerBoundary;
+      upperBoundary = byte == 0xED ? 0x9F : upperBoundary;
+      bytesNeeded = 2;
+      codePoint = byte & 0x0F;
+    } else if (byte >= 0xF0 && byte <= 0xF4) {
+      lowerBoundary = byte == 0xF0 ? 0x90 : lowerBoundary;
+      upperBoundary = byte == 0xF4 ? 0x8F : upperBoundary;
+      bytesNeeded = 3;
+      codePoint = byte & 0x07;
+    } else {
+      appendUtf8(buffer, REPLACEMENT);
+    }
+    return true;
+  }
+  if (byte < lowerBoundary || byte > upperBoundary) {
+    codePoint = 0;
+    bytesNeeded = 0;
+    lowerBoundary = 0x80;
+    upperBoundary = 0xBF;
+    appendUtf8(buffer, REPLACEMENT);
+    return false;
+  }
+  lowerBoundary = 0x80;
+  upperBoundary = 0xBF;
+  codePoint = (codePoint << 6) | (byte & 0x3F);
+  if (--bytesNeeded == 0) {
+    appendUtf8(buffer, codePoint);
+    codePoint = 0;
+  }
+  return true;
+}
+
+bool crawler::CharsetDecoder::decodeGb18030Byte(uint8_t byte) {
+  if (third != 0) {
+    if (byte < 0x30 || byte > 0x39) {
+      // resume from the second byte, eg it may be ascii.
+      const uint8_t savedSecond = second;
+      const uint8_t savedThird = third;
+      first = second = third = 0;
+      appendUtf8(buffer, REPLACEMENT);
+      while (!decodeGb18030Byte(savedSecond)) {
+      }
+      while (!decodeGb18030Byte(savedThird)) {
+      }
+      return false;
+    }
+    const uint32_t pointer =
+        (((first - 0x81) * 10 + second - 0x30) * 126 + third - 0x81) * 10 +
+        byte - 0x30;
+    const char32_t result = gb18030RangesCodePoint(pointer);
+    first = second = third = 0;
+    appendUtf8(buffer, result == 0 ? REPLACEMENT : result);
+    return true;
+  }
+  if (second != 0) {
+    if (byte >= 0x81 && byte <= 0xFE) {
+      third = byte;
+      return true;
+    }
+    const uint8_t savedSecond = second;
+    first = second = 0;
+    appendUtf8(buffer, REPLACEMENT);
+    while (!decodeGb18030Byte(savedSecond)) {
+    }
+    return false;
+  }
+  if (first != 0) {
+    if (byte >= 0x30 && byte <= 0x39) {
+      second = byte;
+      return true;
+    }
+    const uint8_t lead = first;
+    first = 0;
+    char32_t result = 0;
+    if (byte >= 0x40 && byte <= 0xFE) {
+      result = tables::GB18030_TWO_BYTE[(lead - 0x81) * 191 + byte - 0x40];
+    }
+    if (result != 0) {
+      appendUtf8(buffer, result);
+      return true;
+    }
+    appendUtf8(buffer, REPLACEMENT);
+    return byte >= 0x80;
+  }
+  if (byte < 0x80) {
+    buffer += static_cast<char>(byte);
+  } else if (byte == 0x80) {
+    appendUtf8(buffer, 0x20AC);
+  } else if (byte <= 0xFE) {
+    first = byte;
+  } else {
+    appendUtf8(buffer, REPLACEMENT);
+  }
+  return true;
+}
+
+bool crawler::CharsetDecoder::decodeBig5Byte(uint8_t byte) {
+  if (first != 0) {
+    const uint8_t lead = first;
+    first = 0;
+    char32_t result = 0;
+    if (byte >= 0x40 && byte <= 0xFE) {
+      result = tables::BIG5_TWO_BYTE[(lead - 0x81) * 191 + byte - 0x40];
+    }
+    if (result != 0) {
+      appendUtf8(buffer, result);
+      return true;
+    }
+    appendUtf8(buffer, REPLACEMENT);
+    return byte >= 0x80;
+  }
+  if (byte < 0x80) {
+    buffer += static_cast<char>(byte);
+  } else if (byte >= 0x81 && byte <= 0xFE) {
+    first = byte;
+  } else {
+    appendUtf8(buffer, REPLACEMENT);
+  }
+  return true;
+}
+
+bool crawler::CharsetDecoder::decodeByte(uint8_t byte) {
+  switch (charset) {
+  case Charset::Gb18030:
+    return decodeGb18030Byte(byte);
+  case Charset::Big5:
+    return decodeBig5Byte(byte);
+  default:
+    return decodeUtf8Byte(byte);
+  }
+}
+
+void crawler::CharsetDecoder::decodeBytes(const uint8_t *p,
+                                          const uint8_t *end) {
+  while (p < end) {
+    if (bytesNeeded == 0 && first == 0) {
+      const size_t ascii = asciiPrefixLength(p, end - p);
+      buffer.append(reinterpret_cast<const char *>(p), ascii);
+      p += ascii;
+      if (p == end) {
+        break;
+      }
+    }
+    if (decodeByte(*p)) {
+      p++;
+    }
+  }
+}
+
+void crawler::CharsetDecoder::decodeUtf8(const char *data, size_t length,
+                                         const TextSink &sink) {
+  const auto *p = reinterpret_cast<const uint8_t *>(data);
+  const uint8_t *const end = p + length;
+  // finish the sequence split by the previous chunk.
+  while (bytesNeeded != 0 && p < end) {
+    if (decodeUtf8Byte(*p)) {
+      p++;
+    }
+  }
+  if (!buffer.empty()) {
+    sink(buffer);
+    buffer.clear();
+  }
+  const uint8_t *const tail = end - incompleteTail(p, end);
+  const auto size = static_cast<size_t>(tail - p);
+  if (isValidUtf8(reinterpret_cast<const char *>(p), size)) {
+    if (size > 0) {
+      sink(std::string_view(reinterpret_cast<const char *>(p), size));
+    }
+  } else {
+    decodeBytes(p, tail);
+  }
+  decodeBytes(tail, end);
+}
+
+void crawler::CharsetDecoder::decode(const char *data, size_t length,
+                                     const TextSink &sink) {
+  if (charset == Charset::Utf8) {
+    decodeUtf8(data, length, sink);
+  } else {
+    decodeBytes(reinterpret_cast<const uint8_t *>(data),
+                reinterpret_cast<const uint8_t *>(data) + length);
+  }
+  if (!buffer.empty()) {
+    sink(buffer);
+    buffer.clear();
+  }
+}
+
+void crawler::CharsetDecoder::finish(const TextSink &sink) {
+  if (bytesNeeded != 0 || first != 0) {
+    appendUtf8(buffer, REPLACEMENT);
+  }
+  codePoint = 0;
+  bytesNeeded = 0;
+  lowerBoundary = 0x80;
+  upperBoundary = 0xBF;
+  first = second = third = 0;
+  if (!buffer.empty()) {
+    sink(buffer);
+    buffer.clear();
+  }
+}
@@ -0,0 +1,90 @@
+///
+/// Charset detection and streaming transcoding to UTF-8.
+///
+
+#ifndef DOUBANCRAWLER_CHARSET_H
+#define DOUBANCRAWLER_CHARSET_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace crawler {
+
+/// Charsets understood by the decoder. GBK and GB2312 are decoded as GB18030,
+/// their superset, the same as browsers do. Big5 is decoded as cp950, without
+/// the HKSCS extensions.
+enum class Charset { Unknown, Utf8, Gb18030, Big5 };
+
+/// Receiver of decoded UTF-8, `text` is only valid during the call.
+using TextSink = std::function<void(std::string_view text)>;
+
+/// Charset named by `label`, eg "utf-8", "GBK" or "big5", case insensitive.
+Charset charsetFromLabel(std::string_view label);
+
+/// Charset of a Content-Type header value, eg "text/html; charset=gbk".
+Charset charsetFromContentType(std::string_view contentType);
+
+/// Charset declared by a <meta charset> or <meta http-equiv="Content-Type">
+/// tag in the first bytes of a document, `Unknown` if there is none.
+Charset sniffCharset(std::string_view head);
+
+/// Number of bytes looked at by `sniffCharset`.
+inline const size_t SNIFF_LENGTH = 1024;
+
+/// If `data` is valid UTF-8, checked 16 bytes at a time with SSSE3 when the
+/// cpu supports it.
+bool isValidUtf8(const char *data, size_t length);
+
+/// Streaming decoder from `charset` to UTF-8, a multi-byte sequence may be
+/// split across chunks. Invalid sequences are replaced by U+FFFD. Valid UTF-8
+/// input is passed through without copying.
+class CharsetDecoder {
+public:
+  explicit CharsetDecoder(Charset charset = Charset::Utf8);
+
+  /// Decode the next chunk, `sink` is called zero or more times.
+  void decode(const char *data, size_t length, const TextSink &sink);
+
+  /// Flush a sequence left incomplete at the end of input.
+  void finish(const TextSink &sink);
+
+  [[nodiscard]] Charset getCharset() const { return charset; }
+
+private:
+  /// Decode one byte with the state machine of `charset`. Return false if the
+  /// byte has to be decoded again, eg it ended an invalid sequence.
+  bool decodeByte(uint8_t byte);
+
+  bool decodeUtf8Byte(uint8_t byte);
+
+  bool decodeGb18030Byte(uint8_t byte);
+
+  bool decodeBig5Byte(uint8_t byte);
+
+  /// Decode `[p, end)` byte by byte into `buffer`.
+  void decodeBytes(const uint8_t *p, const uint8_t *end);
+
+  void decodeUtf8(const char *data, size_t length, const TextSink &sink);
+
+  Charset charset;
+
+  /// Decoded text not passed to the sink yet.
+  std::string buffer;
+
+  /// Utf-8 state, see https://encoding.spec.whatwg.org/#utf-8-decoder
+  char32_t codePoint = 0;
+  uint8_t bytesNeeded = 0;
+  uint8_t lowerBoundary = 0x80;
+  uint8_t upperBoundary = 0xBF;
+
+  /// GB18030 and Big5 state, the bytes of an unfinished sequence.
+  uint8_t first = 0;
+  uint8_t second = 0;
+  uint8_t third = 0;
+};
+
+} // namespace crawler
+
+#endif // DOUBANCRAWLER_CHARSET_H
@@ -3,36 +3,102 @@
 //
 
 #include "dom.hpp"
+#include "entities.hpp"
+#include "selector.hpp"
+#include "tokenizer.hpp"
 
 #include <algorithm>
+#include <climits>
+#include <functional>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <utility>
 
-crawler::Nodes crawler::Node::getElementsByTag(const std::string &tagName) {
+crawler::Nodes
+crawler::Node::getElementsByTag(const std::string &_tagName) const {
+  const std::string tagName = normalize(_tagName);
   return getElementsByPredicate([&tagName](const Node &node) -> bool {
     return node.getElementData().getTagName() == tagName;
   });
 }
 
-crawler::Node crawler::Node::getElementById(const std::string &id) {
-  Nodes elements = getElementsByPredicate([&id](const Node &node) -> bool {
-    return node.getElementData().id() == id;
-  });
-  assert(elements.size() == 1);
-  return elements[0];
+crawler::Node
+crawler::Node::getElementById(const std::string &id) const {
+  Nodes elements = getElementsByPredicate(
+      [&id](const Node &node) -> bool {
+        return node.getElementData().id() == id;
+      },
+      1);
+  if (elements.empty()) {
+    return Node(std::string());
+  }
+  return std::move(elements.front());
 }
-crawler::Nodes crawler::Node::select(Evaluator *evaluator) {
+crawler::Nodes crawler::Node::select(Evaluator *evaluator) const {
   return getElementsByPredicate([&evaluator](const Node &node) -> bool {
     return evaluator->matches(node);
   });
 }
 
-crawler::Nodes crawler::Node::select(const std::string &cssQuery) {
-  crawler::QueryParser cssParser(cssQuery);
-  return select(*cssParser.parse());
+crawler::Nodes
+crawler::Node::select(const std::string &cssQuery) const {
+  return select(*SelectorCache::shared().get(cssQuery));
+}
+
+crawler::Nodes crawler::Node::select(const std::string &cssQuery,
+                                     size_t limit) const {
+  return select(*SelectorCache::shared().get(cssQuery), limit);
+}
+
+crawler::Nodes crawler::Node::select(const Selector &selector,
+                                     size_t limit) const {
+  Nodes elementList;
+  if (limit == 0) {
+    return elementList;
+  }
+  MatchContext context;
+  walkWithAncestors(*this, context.filter, [&](const Node &node) {
+    if (selector.matches(node, context)) {
+      elementList.emplace_back(node);
+    }
+    return elementList.size() < limit;
+  });
+  return elementList;
+}
+
+const crawler::Node *crawler::Node::selectFirst(Evaluator *evaluator) const {
+  for (const Node &node : preorder()) {
+    if (node.isElement() && evaluator->matches(node)) {
+      return &node;
+    }
+  }
+  return nullptr;
+}
+
+const crawler::Node *
+crawler::Node::selectFirst(const std::string &cssQuery) const {
+  return selectFirst(*SelectorCache::shared().get(cssQuery));
+}
+
+const crawler::Node *
+crawler::Node::selectFirst(const Selector &selector) const {
+  const Node *first = nullptr;
+  MatchContext context;
+  walkWithAncestors(*this, context.filter, [&](const Node &node) {
+    if (selector.matches(node, context)) {
+      first = &node;
+    }
+    return first == nullptr;
+  });
+  return first;
+}
+
+crawler::Selection
+crawler::Node::lazySelect(const std::string &cssQuery) const {
+  return Selection(this, SelectorCache::shared().get(cssQuery));
 }
+
 bool crawler::Node::isElement() const { return nodeType == NodeType::Element; }
 
 bool crawler::Node::isText() const { return nodeType == NodeType::Text; }
@@ -41,21 +107,395 @@ const crawler::ElementData &crawler::Node::getElementData() const {
   return std::get<ElementData>(nodeData);
 }
 const std::string &crawler::Node::getText() const {
-  return std::get<std::string>(nodeData);
+  return std::get<TextData>(nodeData).getText();
+}
+
+const std::string &crawler::TextData::getText() const {
+  if (!span.view.empty()) {
+    text = std::string(span.view);
+    span = RawSpan();
+  }
+  if (encoded) {
+    text = decodeEntities(text);
+    encoded = false;
+  }
+  return text;
+}
+
+crawler::Node::Node(const Node &other)
+    : children(copyChildren(other.children)), nodeType(other.nodeType),
+      nodeData(other.nodeData), ancestors(other.ancestors) {
+  adoptChildren();
+  if (ancestors == nullptr && other.parent != nullptr) {
+    // the original tree may go away before the copy.
+    other.parent->indexChildren();
+    ancestors = snapshotOf(*other.parent);
+  }
+  parent = ancestors.get();
+  positions = other.positions;
+}
+
+crawler::Node::Node(Node &&other) noexcept
+    : children(std::move(other.children)), nodeType(other.nodeType),
+      nodeData(std::move(other.nodeData)), parent(other.parent),
+      ancestors(std::move(other.ancestors)), positions(other.positions) {
+  adoptChildren();
+}
+
+std::vector<crawler::Node>
+crawler::Node::copyChildren(const std::vector<Node> &nodes) {
+  std::vector<Node> copies;
+  copies.reserve(nodes.size());
+  for (const Node &node : nodes) {
+    Node copy(node.nodeType, node.nodeData, copyChildren(node.children));
+    copy.positions = node.positions;
+    copies.push_back(std::move(copy));
+  }
+  return copies;
+}
+
+std::shared_ptr<const crawler::Node>
+crawler::Node::snapshotOf(const Node &node) {
+  // the positions of the node among its siblings, and of its children.
+  node.indexChildren();
+  Node snapshot(node.nodeType, node.nodeData, std::vector<Node>());
+  snapshot.ancestors = node.ancestors;
+  if (snapshot.ancestors == nullptr && node.parent != nullptr) {
+    node.parent->indexChildren();
+    snapshot.ancestors = snapshotOf(*node.parent);
+  }
+  snapshot.parent = snapshot.ancestors.get();
+  snapshot.positions = node.positions;
+  return std::make_shared<const Node>(std::move(snapshot));
+}
+
+crawler::Node &crawler::Node::operator=(const Node &other) {
+  if (this != &other) {
+    *this = Node(other);
+  }
+  return *this;
+}
+
+crawler::Node &crawler::Node::operator=(Node &&other) noexcept {
+  if (this != &other) {
+    // `other` may be a descendant of this node, take its members before
+    // destroying ours.
+    std::vector<Node> otherChildren = std::move(other.children);
+    NodeData otherData = std::move(other.nodeData);
+    std::shared_ptr<const Node> otherAncestors = std::move(other.ancestors);
+    nodeType = other.nodeType;
+    parent = other.parent;
+    ancestors = std::move(otherAncestors);
+    positions = other.positions;
+    children = std::move(otherChildren);
+    nodeData = std::move(otherData);
+    adoptChildren();
+  }
+  return *this;
+}
+
+void crawler::Node::adoptChildren() {
+  for (Node &child : children) {
+    child.parent = this;
+  }
+}
+
+const crawler::Node *crawler::Node::getParent() const { return parent; }
+
+bool crawler::Node::isChildOfParent() const {
+  if (parent == nullptr) {
+    return false;
+  }
+  // pointers to different objects are only ordered by `std::less`.
+  const std::vector<Node> &siblings = parent->children;
+  const std::less<const Node *> before;
+  return !siblings.empty() && !before(this, siblings.data()) &&
+         before(this, siblings.data() + siblings.size());
+}
+
+size_t crawler::Node::siblingIndex() const {
+  if (!isChildOfParent()) {
+    return 0;
+  }
+  return static_cast<size_t>(this - parent->children.data());
+}
+
+size_t crawler::Node::elementPosition() const {
+  if (parent == nullptr) {
+    return 1;
+  }
+  parent->indexChildren();
+  // a node only given a parent isn't counted among its children.
+  return positions.element != 0 ? positions.element : 1;
+}
+
+size_t crawler::Node::elementPositionOfType() const {
+  if (parent == nullptr) {
+    return 1;
+  }
+  parent->indexChildren();
+  return positions.ofType != 0 ? positions.ofType : 1;
+}
+
+size_t crawler::Node::siblingElementCount() const {
+  if (parent == nullptr) {
+    return 1;
+  }
+  parent->indexChildren();
+  return parent->positions.elementChildren;
+}
+
+void crawler::Node::indexChildren() const {
+  if (positions.indexed) {
+    return;
+  }
+  uint32_t count = 0;
+  std::unordered_map<std::string, uint32_t> countsOfType;
+  for (const Node &child : children) {
+    if (child.isElement()) {
+      child.positions.element = ++count;
+      child.positions.ofType =
+          ++countsOfType[child.getElementData().getTagName()];
+    }
+  }
+  positions.elementChildren = count;
+  positions.indexed = true;
+}
+
+const crawler::Node *crawler::Node::previousSibling() const {
+  if (!isChildOfParent() || this == parent->children.data()) {
+    return nullptr;
+  }
+  return this - 1;
+}
+
+const crawler::Node *crawler::Node::nextSibling() const {
+  if (!isChildOfParent() || this == &parent->children.back()) {
+    return nullptr;
+  }
+  return this + 1;
+}
+
+crawler::NodeRange<std::vector<crawler::Node>::const_iterator>
+crawler::Node::followingSiblings() const {
+  if (!isChildOfParent()) {
+    return {children.cend(), children.cend()};
+  }
+  const std::vector<Node> &siblings = parent->children;
+  return {siblings.cbegin() + static_cast<std::ptrdiff_t>(siblingIndex()) + 1,
+          siblings.cend()};
+}
+
+crawler::NodeRange<crawler::PreorderIterator>
+crawler::Node::preorder() const {
+  return {PreorderIterator(this), PreorderIterator()};
+}
+
+crawler::NodeRange<crawler::BreadthFirstIterator>
+crawler::Node::breadthFirst() const {
+  return {BreadthFirstIterator(this), BreadthFirstIterator()};
+}
+
+crawler::Document::Document(Node root)
+    : root(std::make_unique<const Node>(std::move(root))) {}
+
+void crawler::Document::buildIndexes() const {
+  if (indexed) {
+    return;
+  }
+  for (const Node &node : root->preorder()) {
+    if (!node.isElement()) {
+      continue;
+    }
+    const ElementData &element = node.getElementData();
+    tags[element.getTagName()].push_back(&node);
+    const AttrMap &attributes = element.getAttributes();
+    auto id = attributes.find("id");
+    if (id != attributes.end()) {
+      ids[id->second].push_back(&node);
+    }
+    for (const std::string &token : element.getClasses()) {
+      classes[token].push_back(&node);
+    }
+  }
+  indexed = true;
+}
+
+const crawler::Node *
+crawler::Document::getElementById(const std::string &id) const {
+  buildIndexes();
+  auto result = ids.find(id);
+  return result == ids.end() ? nullptr : result->second.front();
+}
+
+const std::vector<const crawler::Node *> &
+crawler::Document::getElementsByTag(const std::string &tagName) const {
+  buildIndexes();
+  auto result = tags.find(normalize(tagName));
+  return result == tags.end() ? NO_NODES : result->second;
+}
+
+const std::vector<const crawler::Node *> &
+crawler::Document::getElementsByClass(const std::string &className) const {
+  buildIndexes();
+  auto result = classes.find(className);
+  return result == classes.end() ? NO_NODES : result->second;
+}
+
+const std::vector<const crawler::Node *> *
+crawler::Document::candidates(const Selector &selector,
+                              IndexKey *scanned) const {
+  const std::vector<const Node *> *best = nullptr;
+  for (IndexKey &key : selector.indexKeys()) {
+    const std::vector<const Node *> *elements = &NO_NODES;
+    switch (key.kind) {
+    case IndexKey::Kind::Id: {
+      buildIndexes();
+      auto result = ids.find(key.value);
+      if (result != ids.end()) {
+        elements = &result->second;
+      }
+      break;
+    }
+    case IndexKey::Kind::Class:
+      elements = &getElementsByClass(key.value);
+      break;
+    case IndexKey::Kind::Tag:
+      elements = &getElementsByTag(key.value);
+      break;
+    case IndexKey::Kind::None:
+      continue;
+    }
+    // every term has to match, the one with the fewest elements wins.
+    if (best == nullptr || elements->size() < best->size()) {
+      best = elements;
+      if (scanned != nullptr) {
+        *scanned = std::move(key);
+      }
+    }
+    if (best->empty()) {
+      break;
+    }
+  }
+  return best;
+}
+
+std::string crawler::Document::explain(const std::string &cssQuery) const {
+  const std::shared_ptr<const Selector> selector =
+      SelectorCache::shared().get(cssQuery);
+  IndexKey key;
+  const std::vector<const Node *> *elements = candidates(*selector, &key);
+  std::string text;
+  if (elements == nullptr) {
+    text = "walk the tree\n";
+  } else {
+    static const char *const KINDS[] = {"none", "id", "class", "tag"};
+    text = std::string("scan ") + KINDS[static_cast<size_t>(key.kind)] +
+           " index \"" + key.value + "\", " +
+           std::to_string(elements->size()) + " elements\n";
+  }
+  return text + selector->explain();
+}
+
+crawler::Nodes crawler::Document::select(const std::string &cssQuery) const {
+  const std::shared_ptr<const Selector> selector =
+      SelectorCache::shared().get(cssQuery);
+  const std::vector<const Node *> *elements = candidates(*selector);
+  if (elements == nullptr) {
+    return root->select(*selector);
+  }
+  Nodes result;
+  for (const Node *element : *elements) {
+    if (selector->matches(*element)) {
+      result.emplace_back(*element);
+    }
+  }
+  return result;
+}
+
+const crawler::Node *
+crawler::Document::selectFirst(const std::string &cssQuery) const {
+  const std::shared_ptr<const Selector> selector =
+      SelectorCache::shared().get(cssQuery);
+  const std::vector<const Node *> *elements = candidates(*selector);
+  if (elements == nullptr) {
+    return root->selectFirst(*selector);
+  }
+  for (const Node *element : *elements) {
+    if (selector->matches(*element)) {
+      return element;
+    }
+  }
+  return nullptr;
+}
+
+crawler::PreorderIterator &crawler::PreorderIterator::operator++() {
+  if (!node->getChildren().empty()) {
+    node = &node->getChildren().front();
+    return *this;
+  }
+  skipChildren();
+  return *this;
+}
+
+void crawler::PreorderIterator::skipChildren() {
+  // climb until a node with a next sibling, without leaving the subtree.
+  while (node != root) {
+    const Node *next = node->nextSibling();
+    if (next != nullptr) {
+      node = next;
+      return;
+    }
+    node = node->getParent();
+  }
+  node = nullptr;
 }
 
-const std::shared_ptr<crawler::Node> &crawler::Node::getParent() const {
-  return parent;
+crawler::SelectIterator::SelectIterator(const Node *root,
+                                        const Selector *selector)
+    : it(root), selector(selector) {
+  findMatch();
+}
+
+crawler::SelectIterator &crawler::SelectIterator::operator++() {
+  ++it;
+  findMatch();
+  return *this;
+}
+
+void crawler::SelectIterator::findMatch() {
+  const PreorderIterator end;
+  while (it != end && !selector->matches(*it)) {
+    ++it;
+  }
+}
+
+crawler::BreadthFirstIterator &crawler::BreadthFirstIterator::operator++() {
+  const Node *node = queue.front();
+  queue.pop_front();
+  for (const Node &child : node->getChildren()) {
+    queue.push_back(&child);
+  }
+  return *this;
+}
+
+const crawler::AttrMap &crawler::ElementData::getAttributes() const {
+  if (!rawAttributes.view.empty()) {
+    attributes = Tokenizer::parseAttributes(rawAttributes.view);
+    rawAttributes = RawSpan();
+  }
+  return attributes;
 }
 
 bool crawler::ElementData::containsAttribute(const std::string &key) const {
+  const AttrMap &attributes = getAttributes();
   if (startsWith("abs:", key)) {
     size_t length = std::string("abs:").length();
     size_t beginIndex = indexOf("abs:", key);
     std::string attributeKey = key.substr(beginIndex, length);
-    return (this->attributes.find(attributeKey)) != attributes.end();
+    return (attributes.find(attributeKey)) != attributes.end();
   } else {
-    return (this->attributes.find(key)) != attributes.end();
+    return (attributes.find(key)) != attributes.end();
   }
 }
 
@@ -63,6 +503,7 @@ std::string crawler::ElementData::clazz() const {
   return getValueByKey("class");
 }
 std::string crawler::ElementData::id() const {
+  const AttrMap &attributes = getAttributes();
   auto result = attributes.find("id");
   if (result != attributes.end()) {
     return result->second;
@@ -72,6 +513,7 @@ std::string crawler::ElementData::id() const {
 }
 const std::string
 crawler::ElementData::getValueByKey(const std::string &key) const {
+  const AttrMap &attributes = getAttributes();
   auto clazz = attributes.find(key);
   std::string classValue;
   if (clazz != attributes.end()) {
@@ -80,6 +522,60 @@ crawler::ElementData::getValueByKey(const std::string &key) const {
   return classValue;
 }
 
+bool crawler::ElementData::hasClass(std::string_view className) const {
+  return hasClass(className, classBit(className));
+}
+
+bool crawler::ElementData::hasClass(std::string_view className,
+                                    unsigned bit) const {
+  splitClasses();
+  if (className.empty()) {
+    return classes.empty();
+  }
+  if ((classSignature & (uint64_t(1) << bit)) == 0) {
+    return false;
+  }
+  return std::binary_search(classes.begin(), classes.end(), className);
+}
+
+const std::vector<std::string> &crawler::ElementData::getClasses() const {
+  splitClasses();
+  return classes;
+}
+
+void crawler::ElementData::splitClasses() const {
+  if (classesSplit) {
+    return;
+  }
+  classesSplit = true;
+  const AttrMap &attributes = getAttributes();
+  auto clazz = attributes.find("class");
+  if (clazz == attributes.end()) {
+    return;
+  }
+  // class tokens are separated by ascii whitespace.
+  const std::string &value = clazz->second;
+  size_t begin = 0;
+  while (begin < value.size()) {
+    if (isspace(static_cast<unsigned char>(value[begin]))) {
+      begin++;
+      continue;
+    }
+    size_t end = begin;
+    while (end < value.size() &&
+           !isspace(static_cast<unsigned char>(value[end]))) {
+      end++;
+    }
+    classes.push_back(value.substr(begin, end - begin));
+    begin = end;
+  }
+  std::sort(classes.begin(), classes.end());
+  classes.erase(std::unique(classes.begin(), classes.end()), classes.end());
+  for (const std::string &token : classes) {
+    classSignature |= uint64_t(1) << classBit(token);
+  }
+}
+
 crawler::TokenQueue::TokenQueue(std::string data, size_t pos)
     : data(std::move(data)), pos(pos) {}
 
@@ -190,6 +686,20 @@ std::string crawler::TokenQueue::chompBalanced(char open, char close) {
 char crawler::TokenQueue::consume() { return data.c_str()[pos++]; }
 
 std::shared_ptr<crawler::Evaluator *> crawler::QueryParser::parse() {
+  arena->root = parseEvaluator();
+  // shares the ownership of the arena, points to its root.
+  return std::shared_ptr<Evaluator *>(arena, &arena->root);
+}
+
+template <class T, class... Args>
+T *crawler::QueryParser::make(Args &&...args) {
+  auto evaluator = std::make_unique<T>(std::forward<Args>(args)...);
+  T *result = evaluator.get();
+  arena->evaluators.push_back(std::move(evaluator));
+  return result;
+}
+
+crawler::Evaluator *crawler::QueryParser::parseEvaluator() {
   // not support combinator for now.
   tokenQueue.consumeWhiteSpace();
   if (tokenQueue.matchesAny(COMBINATORS)) {
@@ -209,11 +719,9 @@ std::shared_ptr<crawler::Evaluator *> crawler::QueryParser::parse() {
     }
   }
   if (evals.size() == 1) {
-    return std::make_shared<crawler::Evaluator *>(evals.front());
-  } else {
-    auto *andEvaluator = new crawler::And(evals);
-    return std::make_shared<crawler::Evaluator *>(andEvaluator);
+    return evals.front();
   }
+  return make<And>(evals);
 }
 
 std::shared_ptr<crawler::Evaluator *>
@@ -239,37 +747,59 @@ void crawler::QueryParser::findElements() {
 }
 void crawler::QueryParser::findById() {
   const std::string id = tokenQueue.consumeCssIdentifier();
-  evals.emplace_back(new Id(id));
+  evals.emplace_back(make<Id>(id));
 }
 void crawler::QueryParser::findByClass() {
   const std::string clazz = tokenQueue.consumeCssIdentifier();
-  evals.emplace_back(new Class(clazz));
+  evals.emplace_back(make<Class>(clazz));
 }
 
 void crawler::QueryParser::findByTag() {
   std::string tagName = tokenQueue.consumeElementSelector();
-  evals.emplace_back(new Tag(tagName));
+  evals.emplace_back(make<Tag>(tagName));
 }
 
 void crawler::QueryParser::combinator(char combinator) {
   tokenQueue.consumeWhiteSpace();
+  if (combinator == ',') {
+    // a group has the lowest precedence, the rest of the query is the next
+    // alternative.
+    Evaluator *currentEval =
+        evals.size() == 1 ? evals.at(0) : make<And>(evals);
+    Evaluator *rest =
+        QueryParser(tokenQueue.remainder(), arena).parseEvaluator();
+    evals.clear();
+    evals.emplace_back(make<Or>(std::vector<Evaluator *>{currentEval, rest}));
+    return;
+  }
   std::string subQuery = tokenQueue.consumeSubQuery();
   Evaluator *currentEval;
-  std::shared_ptr<Evaluator *> newEval = crawler::QueryParser::parse(subQuery);
+  Evaluator *newEval = QueryParser(subQuery, arena).parseEvaluator();
   if (evals.size() == 1) {
     currentEval = evals.at(0);
   } else {
-    currentEval = new And(evals);
+    currentEval = make<And>(evals);
   }
   evals.clear();
   if (combinator == '>') {
-    Evaluator *immediateParent = new ImmediateParent(
+    Evaluator *immediateParent = make<ImmediateParent>(
         std::make_shared<crawler::Evaluator *>(currentEval));
-    currentEval = new And({*newEval, immediateParent});
+    currentEval =
+        make<And>(std::vector<Evaluator *>{newEval, immediateParent});
   } else if (combinator == ' ') {
     Evaluator *parent =
-        new Parent(std::make_shared<crawler::Evaluator *>(currentEval));
-    currentEval = new And({*newEval, parent});
+        make<Parent>(std::make_shared<crawler::Evaluator *>(currentEval));
+    currentEval = make<And>(std::vector<Evaluator *>{newEval, parent});
+  } else if (combinator == '+') {
+    Evaluator *previousSibling = make<ImmediatePreviousSibling>(
+        std::make_shared<crawler::Evaluator *>(currentEval));
+    currentEval =
+        make<And>(std::vector<Evaluator *>{newEval, previousSibling});
+  } else if (combinator == '~') {
+    Evaluator *previousSibling = make<PreviousSibling>(
+        std::make_shared<crawler::Evaluator *>(currentEval));
+    currentEval =
+        make<And>(std::vector<Evaluator *>{newEval, previousSibling});
   } else {
     throw std::runtime_error("Unknown combinator");
   }
@@ -298,7 +828,12 @@ std::string crawler::TokenQueue::remainder() {
 }
 
 crawler::QueryParser::QueryParser(const std::string &queryString)
-    : queryString(queryString), tokenQueue(queryString) {}
+    : QueryParser(queryString, std::make_shared<EvaluatorArena>()) {}
+
+crawler::QueryParser::QueryParser(const std::string &queryString,
+                                  std::shared_ptr<EvaluatorArena> arena)
+    : queryString(queryString), tokenQueue(queryString),
+      arena(std::move(arena)) {}
 void crawler::QueryParser::findByAttribute() {
   TokenQueue attributeQueue(tokenQueue.chompBalanced('[', ']'));
   std::string key = attributeQueue.consumeToAny(ATTRIBUTES);
@@ -306,25 +841,25 @@ void crawler::QueryParser::findByAttribute() {
   if (attributeQueue.eof()) {
     if (startsWith("^", key)) {
       evals.emplace_back(
-          new AttributeKeyStartWithPrefix(key.substr(1, key.length() - 1)));
+          make<AttributeKeyStartWithPrefix>(key.substr(1, key.length() - 1)));
     } else {
-      evals.emplace_back(new Attribute(key));
+      evals.emplace_back(make<Attribute>(key));
     }
   } else {
     if (attributeQueue.matchesChomp("=")) {
       evals.emplace_back(
-          new AttributeWithValue(key, attributeQueue.remainder()));
+          make<AttributeWithValue>(key, attributeQueue.remainder()));
     } else if (attributeQueue.matchesChomp("!=")) {
       evals.emplace_back(
-          new AttributeWithValueNot(key, attributeQueue.remainder()));
+          make<AttributeWithValueNot>(key, attributeQueue.remainder()));
     } else if (attributeQueue.matchesChomp("^=")) {
       evals.emplace_back(
-          new AttributeValueStartWithPrefix(key, attributeQueue.remainder()));
+          make<AttributeValueStartWithPrefix>(key, attributeQueue.remainder()));
     } else if (attributeQueue.matchesChomp("$=")) {
       evals.emplace_back(
-          new AttributeValueEndWithSuffix(key, attributeQueue.remainder()));
+          make<AttributeValueEndWithSuffix>(key, attributeQueue.remainder()));
     } else if (attributeQueue.matchesChomp("*=")) {
-      evals.emplace_back(new AttributeValueContainWithSubstring(
+      evals.emplace_back(make<AttributeValueContainWithSubstring>(
           key, attributeQueue.remainder()));
     }
     // TODO
@@ -335,24 +870,79 @@ crawler::Id::Id(std::string id) : id(std::move(id)) {}
 bool crawler::Id::matches(const Node &element) {
   return id == element.getElementData().id();
 }
-crawler::Class::Class(std::string clazz) : clazz(std::move(clazz)) {}
+crawler::IndexKey crawler::Id::indexKey() const {
+  return {IndexKey::Kind::Id, id};
+}
+crawler::Class::Class(std::string clazz)
+    : clazz(std::move(clazz)), bit(ElementData::classBit(this->clazz)) {}
 bool crawler::Class::matches(const Node &element) {
-  return clazz == element.getElementData().clazz();
+  return element.getElementData().hasClass(clazz, bit);
 }
-crawler::Tag::Tag(std::string tagName) : tagName(std::move(tagName)) {}
+crawler::IndexKey crawler::Class::indexKey() const {
+  return {IndexKey::Kind::Class, clazz};
+}
+crawler::Tag::Tag(const std::string &tagName) : tagName(normalize(tagName)) {}
 bool crawler::Tag::matches(const Node &element) {
   return tagName == element.getElementData().getTagName();
 }
+crawler::IndexKey crawler::Tag::indexKey() const {
+  if (tagName.find_first_of("*|") != std::string::npos) {
+    return IndexKey();
+  }
+  return {IndexKey::Kind::Tag, tagName};
+}
 crawler::CombiningEvaluator::CombiningEvaluator(
     std::vector<Evaluator *> evalutors)
     : evalutors(std::move(evalutors)) {}
 
+/// Sum of `a` and `b`, saturated so a long query doesn't wrap around.
+static unsigned addCost(unsigned a, unsigned b) {
+  return a > UINT_MAX - b ? UINT_MAX : a + b;
+}
+
+/// Cost of evaluating an operand of cost `cost` `times` times, saturated.
+static unsigned repeatCost(unsigned cost, unsigned times) {
+  return cost > UINT_MAX / times ? UINT_MAX : cost * times;
+}
+
+/// Guess of the number of ancestors or previous siblings a structural
+/// evaluator walks.
+static const unsigned WALK_LENGTH = 16;
+
+/// Cost of the operands of a combining evaluator.
+static unsigned sumCost(const std::vector<crawler::Evaluator *> &evaluators) {
+  unsigned cost = 0;
+  for (const crawler::Evaluator *eval : evaluators) {
+    cost = addCost(cost, eval->cost());
+  }
+  return cost;
+}
+
 bool crawler::And::matches(const Node &element) {
   return std::all_of(this->evalutors.cbegin(), this->evalutors.cend(),
                      [&](auto const &eval) { return eval->matches(element); });
 }
 crawler::And::And(const std::vector<Evaluator *> &_evalutors)
-    : CombiningEvaluator(_evalutors) {}
+    : CombiningEvaluator(_evalutors) {
+  // stable, so operands of the same cost keep the order of the query.
+  std::stable_sort(evalutors.begin(), evalutors.end(),
+                   [](const Evaluator *a, const Evaluator *b) {
+                     return a->cost() < b->cost();
+                   });
+}
+unsigned crawler::And::cost() const { return sumCost(evalutors); }
+crawler::IndexKey crawler::And::indexKey() const {
+  IndexKey best;
+  for (const Evaluator *eval : evalutors) {
+    IndexKey key = eval->indexKey();
+    // kinds are declared from the most to the least selective.
+    if (key.kind != IndexKey::Kind::None &&
+        (best.kind == IndexKey::Kind::None || key.kind < best.kind)) {
+      best = std::move(key);
+    }
+  }
+  return best;
+}
 
 bool crawler::Or::matches(const Node &element) {
   return std::any_of(this->evalutors.cbegin(), this->evalutors.cend(),
@@ -360,39 +950,73 @@ bool crawler::Or::matches(const Node &element) {
 }
 crawler::Or::Or(const std::vector<Evaluator *> &_evalutors)
     : CombiningEvaluator(_evalutors) {}
+unsigned crawler::Or::cost() const { return sumCost(evalutors); }
 
 crawler::Parent::Parent(std::shared_ptr<Evaluator *> _eval)
     : StructuralEvaluator(std::move(_eval)){};
 
 bool crawler::Parent::matches(const Node &element) {
   Evaluator *eval = *this->evaluator;
-  const std::shared_ptr<crawler::Node> &parentPtr = element.getParent();
-  if (parentPtr == nullptr) {
-    return false;
-  }
-  auto parent = *parentPtr;
-  while (true) {
-    if (eval->matches(parent)) {
+  for (const Node *parent = element.getParent(); parent != nullptr;
+       parent = parent->getParent()) {
+    if (eval->matches(*parent)) {
       return true;
     }
-    if (parent.getParent() == nullptr) {
-      return false;
-    }
-    parent = *parent.getParent();
   }
   return false;
 }
+unsigned crawler::Parent::cost() const {
+  return addCost(ATTRIBUTE_COST, repeatCost((*evaluator)->cost(), WALK_LENGTH));
+}
 
 crawler::ImmediateParent::ImmediateParent(std::shared_ptr<Evaluator *> _eval)
     : StructuralEvaluator(std::move(_eval)){};
 
 bool crawler::ImmediateParent::matches(const Node &element) {
-  const std::shared_ptr<crawler::Node> &parentPtr = element.getParent();
-  if (parentPtr == nullptr) {
+  const Node *parent = element.getParent();
+  if (parent == nullptr) {
+    return false;
+  }
+  Evaluator *eval = *this->evaluator;
+  return eval->matches(*parent);
+}
+unsigned crawler::ImmediateParent::cost() const {
+  return addCost(ATTRIBUTE_COST + 1, (*evaluator)->cost());
+}
+crawler::PreviousSibling::PreviousSibling(std::shared_ptr<Evaluator *> _eval)
+    : StructuralEvaluator(std::move(_eval)){};
+
+bool crawler::PreviousSibling::matches(const Node &element) {
+  Evaluator *eval = *this->evaluator;
+  for (const Node *sibling = element.previousSibling(); sibling != nullptr;
+       sibling = sibling->previousSibling()) {
+    if (sibling->isElement() && eval->matches(*sibling)) {
+      return true;
+    }
+  }
+  return false;
+}
+unsigned crawler::PreviousSibling::cost() const {
+  return addCost(ATTRIBUTE_COST, repeatCost((*evaluator)->cost(), WALK_LENGTH));
+}
+
+crawler::ImmediatePreviousSibling::ImmediatePreviousSibling(
+    std::shared_ptr<Evaluator *> _eval)
+    : StructuralEvaluator(std::move(_eval)){};
+
+bool crawler::ImmediatePreviousSibling::matches(const Node &element) {
+  const Node *sibling = element.previousSibling();
+  while (sibling != nullptr && !sibling->isElement()) {
+    sibling = sibling->previousSibling();
+  }
+  if (sibling == nullptr) {
     return false;
   }
   Evaluator *eval = *this->evaluator;
-  return eval->matches(*parentPtr);
+  return eval->matches(*sibling);
+}
+unsigned crawler::ImmediatePreviousSibling::cost() const {
+  return addCost(ATTRIBUTE_COST + 1, (*evaluator)->cost());
 }
 crawler::Attribute::Attribute(std::string key) : key(std::move(key)) {}
 bool crawler::Attribute::matches(const Node &element) {
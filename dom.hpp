@@ -5,25 +5,50 @@
 #include "strings.hpp"
 #include <array>
 #include <cassert>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
 #include <queue>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
 namespace crawler {
 class Evaluator;
+struct IndexKey;
 class Node;
-using AttrMap = std::map<std::string, std::string>;
+class Selector;
+/// Ordered by name, looked up without a copy of the name, eg by a
+/// `std::string_view`.
+using AttrMap = std::map<std::string, std::string, std::less<>>;
 using Nodes = std::vector<Node>;
 
+/// A view into the parser input, together with the owner which keeps the input
+/// alive.
+struct RawSpan {
+  std::shared_ptr<const void> owner;
+  std::string_view view;
+};
+
 class ElementData {
 public:
   ElementData() = default;
   ElementData(std::string tagName, AttrMap attributes)
       : tagName(std::move(tagName)), attributes(std::move(attributes)) {}
+
+  /// Keep the raw attribute region, eg ` id="main" class="test"`, and parse it
+  /// on first access. Reading the attributes of the same element from several
+  /// threads needs external locking.
+  ElementData(std::string tagName, RawSpan rawAttributes)
+      : tagName(std::move(tagName)), rawAttributes(std::move(rawAttributes)) {}
+
   /// Get id of element
   [[nodiscard]] std::string id() const;
 
@@ -32,59 +57,332 @@ public:
 
   [[nodiscard]] const std::string &getTagName() const { return tagName; }
 
-  [[nodiscard]] const AttrMap &getAttributes() const { return attributes; }
+  [[nodiscard]] const AttrMap &getAttributes() const;
 
   [[nodiscard]] bool containsAttribute(const std::string &key) const;
 
   [[nodiscard]] const std::string getValueByKey(const std::string &key) const;
 
+  /// If `className` is one of the whitespace separated tokens of the class
+  /// attribute, eg "item" of `class="item active"`. An empty `className`
+  /// matches an element without any class. The tokens are split once, on
+  /// first access, into a sorted list and a 64 bits signature with a bit per
+  /// token, which rejects most elements without comparing a string.
+  [[nodiscard]] bool hasClass(std::string_view className) const;
+
+  /// Same as `hasClass(className)`, with `bit` the `classBit` of `className`
+  /// computed once by the caller.
+  [[nodiscard]] bool hasClass(std::string_view className, unsigned bit) const;
+
+  /// Tokens of the class attribute, sorted and without duplicates.
+  [[nodiscard]] const std::vector<std::string> &getClasses() const;
+
+  /// Bit of `className` in the class signature of an element, below 64.
+  static constexpr unsigned classBit(std::string_view className) {
+    // 32 bits FNV-1a, folded so the high bits count too.
+    uint32_t hash = 2166136261u;
+    for (char c : className) {
+      hash ^= static_cast<uint8_t>(c);
+      hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 6) ^ (hash >> 12) ^ (hash >> 24)) & 63;
+  }
+
 private:
+  /// Split the class attribute into `classes` and `classSignature`.
+  void splitClasses() const;
+
   /// The tag name of current node; eg <div class="test">, tagName = "div"
 
   std::string tagName;
   /// The attributes of current node; eg <div class="test">, attribute = { class
   /// = "div" }
-  AttrMap attributes;
+  mutable AttrMap attributes;
+
+  /// Attributes which are not parsed yet, empty once parsed.
+  mutable RawSpan rawAttributes;
+
+  /// Tokens of the class attribute, see `getClasses`.
+  mutable std::vector<std::string> classes;
+
+  /// Union of the `classBit` of `classes`.
+  mutable uint64_t classSignature = 0;
+
+  mutable bool classesSplit = false;
 };
 
-using NodeData = std::variant<ElementData, std::string>;
+class TextData {
+public:
+  TextData() = default;
+
+  /// Text with character references, eg `a &amp; b`, is decoded on first
+  /// access if `encoded` is true.
+  explicit TextData(std::string text, bool encoded = false)
+      : text(std::move(text)), encoded(encoded) {}
+
+  /// Text inside the parser input, copied out on first access.
+  explicit TextData(RawSpan span, bool encoded = false)
+      : span(std::move(span)), encoded(encoded) {}
+
+  [[nodiscard]] const std::string &getText() const;
+
+private:
+  mutable std::string text;
+
+  /// Text which is not copied out yet, empty once copied.
+  mutable RawSpan span;
+
+  /// `text` isn't decoded yet.
+  mutable bool encoded = false;
+};
+
+using NodeData = std::variant<ElementData, TextData>;
 
 enum class NodeType { Element, Text };
 
+/// What `Node::visit` does after visiting a node.
+enum class VisitResult {
+  /// Go on with the children of the node.
+  Continue,
+  /// Go on with the next sibling of the node, skip its children.
+  SkipChildren,
+  /// End the traversal.
+  Stop
+};
+
+/// A pair of iterators, usable in range-based for loops.
+template <class Iterator> class NodeRange {
+public:
+  NodeRange(Iterator first, Iterator last)
+      : first(std::move(first)), last(std::move(last)) {}
+
+  [[nodiscard]] Iterator begin() const { return first; }
+
+  [[nodiscard]] Iterator end() const { return last; }
+
+private:
+  Iterator first;
+  Iterator last;
+};
+
+/// Iterator over a subtree in document order (pre-order), borrowed from the
+/// tree. It walks parent and sibling links, so it needs no stack.
+class PreorderIterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = Node;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const Node *;
+  using reference = const Node &;
+
+  PreorderIterator() = default;
+
+  /// Start at `root`, the iterator never leaves the subtree of `root`.
+  explicit PreorderIterator(const Node *root) : node(root), root(root) {}
+
+  reference operator*() const { return *node; }
+
+  pointer operator->() const { return node; }
+
+  PreorderIterator &operator++();
+
+  PreorderIterator operator++(int) {
+    PreorderIterator previous = *this;
+    ++*this;
+    return previous;
+  }
+
+  /// Go on with the next sibling of current node instead of its first child.
+  void skipChildren();
+
+  bool operator==(const PreorderIterator &other) const {
+    return node == other.node;
+  }
+
+  bool operator!=(const PreorderIterator &other) const {
+    return node != other.node;
+  }
+
+private:
+  const Node *node = nullptr;
+  const Node *root = nullptr;
+};
+
+/// Iterator over a subtree level by level (breadth first), borrowed from the
+/// tree.
+class BreadthFirstIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Node;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const Node *;
+  using reference = const Node &;
+
+  BreadthFirstIterator() = default;
+
+  explicit BreadthFirstIterator(const Node *root) { queue.push_back(root); }
+
+  reference operator*() const { return *queue.front(); }
+
+  pointer operator->() const { return queue.front(); }
+
+  BreadthFirstIterator &operator++();
+
+  bool operator==(const BreadthFirstIterator &other) const {
+    return queue.empty() == other.queue.empty() &&
+           (queue.empty() || queue.front() == other.queue.front());
+  }
+
+  bool operator!=(const BreadthFirstIterator &other) const {
+    return !(*this == other);
+  }
+
+private:
+  std::deque<const Node *> queue;
+};
+
+/// Iterator over the elements of a subtree matched by a selector, in document
+/// order. Each increment only walks the tree up to the next match.
+class SelectIterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = Node;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const Node *;
+  using reference = const Node &;
+
+  SelectIterator() = default;
+
+  /// Start at the first match under `root`, including `root`.
+  SelectIterator(const Node *root, const Selector *selector);
+
+  reference operator*() const { return *it; }
+
+  pointer operator->() const { return &*it; }
+
+  SelectIterator &operator++();
+
+  bool operator==(const SelectIterator &other) const { return it == other.it; }
+
+  bool operator!=(const SelectIterator &other) const { return it != other.it; }
+
+private:
+  /// Move `it` to the first match at or after it.
+  void findMatch();
+
+  PreorderIterator it;
+  const Selector *selector = nullptr;
+};
+
+/// Lazy result of a css query, matches are looked up as the range is iterated
+/// and the walk stops as soon as the loop stops, eg:
+///   for (const crawler::Node &link : root.lazySelect("a[href]")) {
+///     if (...) break;
+///   }
+/// The range borrows the tree and keeps the compiled query alive.
+class Selection {
+public:
+  Selection(const Node *root, std::shared_ptr<const Selector> selector)
+      : root(root), selector(std::move(selector)) {}
+
+  [[nodiscard]] SelectIterator begin() const {
+    return SelectIterator(root, selector.get());
+  }
+
+  [[nodiscard]] SelectIterator end() const { return SelectIterator(); }
+
+  /// If nothing matches.
+  [[nodiscard]] bool empty() const { return begin() == end(); }
+
+private:
+  const Node *root;
+  std::shared_ptr<const Selector> selector;
+};
+
+/// Node of the DOM tree. A node owns its children and points to its parent.
+/// A copy, eg a node returned by `select`, owns its subtree and a snapshot of
+/// its ancestors without their children, so it stays valid once the original
+/// tree is gone. Its parent and positions are the ones of the original, it has
+/// no siblings.
 class Node {
 public:
   // data common to all nodes;
-  explicit Node(const std::string &str)
-      : nodeType(NodeType::Text), nodeData(str), parent(nullptr) {}
+  explicit Node(const std::string &str, const Node *_parent = nullptr)
+      : nodeType(NodeType::Text), nodeData(TextData(str)), parent(_parent) {}
+
+  explicit Node(TextData _textData, const Node *_parent = nullptr)
+      : nodeType(NodeType::Text), nodeData(std::move(_textData)),
+        parent(_parent) {}
+
+  explicit Node(std::string _name, AttrMap _attrMap,
+                std::vector<Node> _children, const Node *_parent = nullptr)
+      : children(std::move(_children)), nodeType(NodeType::Element),
+        nodeData(ElementData(std::move(_name), std::move(_attrMap))),
+        parent(_parent) {
+    adoptChildren();
+  }
 
-  // data common to all nodes;
-  explicit Node(const std::string &str, std::shared_ptr<Node> _parent)
-      : nodeType(NodeType::Text), nodeData(str), parent(std::move(_parent)) {}
-
-  explicit Node(const std::string &_name, const AttrMap &_attrMap,
-                std::vector<Node> _children,
-                const std::shared_ptr<Node> &_parent) {
-    children = std::move(_children);
-    parent = _parent;
-    ElementData elementData(_name, _attrMap);
-    nodeType = NodeType::Element;
-    nodeData = elementData;
+  explicit Node(ElementData _elementData, std::vector<Node> _children,
+                const Node *_parent = nullptr)
+      : children(std::move(_children)), nodeType(NodeType::Element),
+        nodeData(std::move(_elementData)), parent(_parent) {
+    adoptChildren();
   }
 
+  /// Deep copy, the children of the copy point to the copy and the parent to
+  /// a snapshot of the ancestors of `other`.
+  Node(const Node &other);
+
+  Node(Node &&other) noexcept;
+
+  Node &operator=(const Node &other);
+
+  Node &operator=(Node &&other) noexcept;
+
+  ~Node() = default;
+
   /// get children elements
-  [[nodiscard]] std::vector<Node> getChildren() const { return children; }
+  [[nodiscard]] const std::vector<Node> &getChildren() const {
+    return children;
+  }
 
-  /// Search element list by tag name by bfs(breadth first search)
-  Nodes getElementsByTag(const std::string &tagName);
+  /// Search element list by tag name in document order, tag names are case
+  /// insensitive.
+  Nodes getElementsByTag(const std::string &tagName) const;
 
-  /// Get element list by element id.
-  Node getElementById(const std::string &id);
+  /// Get the first element with id `id` in document order. Return an empty
+  /// text node if there is no such element.
+  Node getElementById(const std::string &id) const;
 
   /// Query note by css query syntax.
-  Nodes select(Evaluator *evaluator);
+  Nodes select(Evaluator *evaluator) const;
 
-  /// Query note by css query syntax.
-  Nodes select(const std::string &cssQuery);
+  /// Query note by css query syntax, compiled queries are cached by
+  /// `SelectorCache::shared()`.
+  Nodes select(const std::string &cssQuery) const;
+
+  /// Query at most `limit` nodes by css query syntax, the walk stops at the
+  /// `limit`th match.
+  Nodes select(const std::string &cssQuery, size_t limit) const;
+
+  /// Query at most `limit` nodes matched by a compiled query.
+  Nodes select(const Selector &selector,
+               size_t limit = std::numeric_limits<size_t>::max()) const;
+
+  /// First node matched by `evaluator` in document order, null if there is
+  /// none. The walk stops at the first match.
+  [[nodiscard]] const Node *selectFirst(Evaluator *evaluator) const;
+
+  /// First node matched by css query in document order, null if there is
+  /// none. The walk stops at the first match.
+  [[nodiscard]] const Node *selectFirst(const std::string &cssQuery) const;
+
+  /// First node matched by a compiled query in document order, null if there
+  /// is none.
+  [[nodiscard]] const Node *selectFirst(const Selector &selector) const;
+
+  /// Query nodes by css query syntax lazily, see `Selection`.
+  [[nodiscard]] Selection lazySelect(const std::string &cssQuery) const;
 
   /// Get element data of current node, throw exception if it's not a element
   /// type.
@@ -93,7 +391,65 @@ public:
   /// Get text of current node, throw exception if it's not a text type.
   [[nodiscard]] const std::string &getText() const;
 
-  [[nodiscard]] const std::shared_ptr<Node> &getParent() const;
+  /// Parent of current node, null for the root.
+  [[nodiscard]] const Node *getParent() const;
+
+  /// If current node is one of the children of its parent. False for the
+  /// root, for a copy, and for a node only given a parent, eg by
+  /// `Parser::parseNodes(parent)`.
+  [[nodiscard]] bool isChildOfParent() const;
+
+  /// Index of current node among the children of its parent, 0 if it isn't
+  /// one of them.
+  [[nodiscard]] size_t siblingIndex() const;
+
+  /// Position of current element among the elements of its parent, from 1.
+  /// The positions of all the children of a parent are computed on first use
+  /// and cached in the tree, so later lookups are O(1).
+  [[nodiscard]] size_t elementPosition() const;
+
+  /// Position of current element among the elements of its parent with the
+  /// same tag name, from 1.
+  [[nodiscard]] size_t elementPositionOfType() const;
+
+  /// Number of elements among the children of the parent of current node,
+  /// itself included.
+  [[nodiscard]] size_t siblingElementCount() const;
+
+  /// Sibling in front of current node, null if there is none.
+  [[nodiscard]] const Node *previousSibling() const;
+
+  /// Sibling after current node, null if there is none.
+  [[nodiscard]] const Node *nextSibling() const;
+
+  /// Siblings after current node, in document order.
+  [[nodiscard]] NodeRange<std::vector<Node>::const_iterator>
+  followingSiblings() const;
+
+  /// Current node and its descendants in document order.
+  [[nodiscard]] NodeRange<PreorderIterator> preorder() const;
+
+  /// Current node and its descendants level by level.
+  [[nodiscard]] NodeRange<BreadthFirstIterator> breadthFirst() const;
+
+  /// Call `visitor(node)` for current node and its descendants in document
+  /// order, `visitor` returns a `VisitResult` to skip a subtree or stop.
+  template <class Visitor> void visit(Visitor visitor) const {
+    PreorderIterator it(this);
+    const PreorderIterator end;
+    while (it != end) {
+      switch (visitor(*it)) {
+      case VisitResult::Continue:
+        ++it;
+        break;
+      case VisitResult::SkipChildren:
+        it.skipChildren();
+        break;
+      case VisitResult::Stop:
+        return;
+      }
+    }
+  }
 
   /// If current node is a element type.
   [[nodiscard]] bool isElement() const;
@@ -102,6 +458,22 @@ public:
   [[nodiscard]] bool isText() const;
 
 private:
+  Node(NodeType _nodeType, NodeData _nodeData, std::vector<Node> _children)
+      : children(std::move(_children)), nodeType(_nodeType),
+        nodeData(std::move(_nodeData)) {
+    adoptChildren();
+  }
+
+  /// Point the parent of every child to this node.
+  void adoptChildren();
+
+  /// Copies of `nodes` and their subtrees, without snapshots of ancestors.
+  static std::vector<Node> copyChildren(const std::vector<Node> &nodes);
+
+  /// Copy of `node` and its ancestors, without children, with the positions
+  /// they have in their tree.
+  static std::shared_ptr<const Node> snapshotOf(const Node &node);
+
   /// data common to all nodes;
   std::vector<Node> children;
 
@@ -111,23 +483,42 @@ private:
   /// Node data, element or text
   NodeData nodeData;
 
-  std::shared_ptr<Node> parent;
-
-  /// Get elements by call `predicate(node)` using BFS
-  template <class Predicate> Nodes getElementsByPredicate(Predicate predicate) {
+  /// Not owned, the parent owns this node, or `ancestors` for a copy.
+  const Node *parent = nullptr;
+
+  /// Snapshot of the parent of a copy, see `snapshotOf`.
+  std::shared_ptr<const Node> ancestors;
+
+  /// Cached positions among the siblings, see `elementPosition`.
+  struct Positions {
+    uint32_t element = 0;
+    uint32_t ofType = 0;
+    /// Number of element children, valid once `indexed`.
+    uint32_t elementChildren = 0;
+    /// The positions of the children are computed.
+    bool indexed = false;
+  };
+
+  mutable Positions positions;
+
+  /// Compute the positions of the children, if not computed yet.
+  void indexChildren() const;
+
+  /// Get at most `limit` elements by call `predicate(node)` in document
+  /// order.
+  template <class Predicate>
+  Nodes getElementsByPredicate(
+      Predicate predicate,
+      size_t limit = std::numeric_limits<size_t>::max()) const {
     Nodes elementList;
-    std::queue<Node> queue;
-    Node root = *this;
-    queue.push(root);
-    while (!queue.empty()) {
-      Node tempNode = queue.front();
-      queue.pop();
-      if (tempNode.isElement() && predicate(tempNode)) {
-        elementList.emplace_back(tempNode);
-      }
-      if (!tempNode.getChildren().empty()) {
-        for (auto const &childrenNode : tempNode.getChildren()) {
-          queue.push(childrenNode);
+    if (limit == 0) {
+      return elementList;
+    }
+    for (const Node &node : preorder()) {
+      if (node.isElement() && predicate(node)) {
+        elementList.emplace_back(node);
+        if (elementList.size() == limit) {
+          break;
         }
       }
     }
@@ -135,6 +526,72 @@ private:
   }
 };
 
+/// Parsed document with indexes of its elements by id, tag name and class
+/// token. The indexes are built in one walk, on the first lookup or by
+/// `buildIndexes`, so a page queried many times is walked only once:
+///   crawler::Document document(crawler::parse(html));
+///   const crawler::Node *main = document.getElementById("main");
+///   crawler::Nodes items = document.select("ul.items > li");
+/// Lookups build the indexes lazily, a document shared between threads must
+/// call `buildIndexes` first.
+class Document {
+public:
+  explicit Document(Node root);
+
+  [[nodiscard]] const Node &getRoot() const { return *root; }
+
+  /// Walk the tree and build the indexes, if not built yet.
+  void buildIndexes() const;
+
+  /// First element with id `id` in document order, null if there is none.
+  [[nodiscard]] const Node *getElementById(const std::string &id) const;
+
+  /// Elements with tag name `tagName` in document order, tag names are case
+  /// insensitive.
+  [[nodiscard]] const std::vector<const Node *> &
+  getElementsByTag(const std::string &tagName) const;
+
+  /// Elements with `className` among the tokens of their class attribute, in
+  /// document order.
+  [[nodiscard]] const std::vector<const Node *> &
+  getElementsByClass(const std::string &className) const;
+
+  /// Query nodes by css query syntax. Only the elements found by the index
+  /// of an id, class or tag of the query are evaluated, the one with the
+  /// fewest elements, eg the rarest class of "li.item.new".
+  [[nodiscard]] Nodes select(const std::string &cssQuery) const;
+
+  /// First node matched by css query in document order, null if there is
+  /// none.
+  [[nodiscard]] const Node *selectFirst(const std::string &cssQuery) const;
+
+  /// Plan of `select` for `cssQuery` in a readable form: the index scanned
+  /// and its number of elements, or a walk of the tree, followed by
+  /// `Selector::explain`. Throw `std::runtime_error` if it is malformed.
+  [[nodiscard]] std::string explain(const std::string &cssQuery) const;
+
+private:
+  /// Elements which may match `selector`, null if the index can't narrow
+  /// them down and the whole tree has to be walked. The index scanned is
+  /// stored in `scanned` if it isn't null.
+  [[nodiscard]] const std::vector<const Node *> *
+  candidates(const Selector &selector, IndexKey *scanned = nullptr) const;
+
+  /// Heap allocated so nodes keep their address when the document is moved.
+  std::unique_ptr<const Node> root;
+
+  mutable bool indexed = false;
+
+  /// Ids are meant to be unique, duplicated ones are kept in document order.
+  mutable std::unordered_map<std::string, std::vector<const Node *>> ids;
+
+  mutable std::unordered_map<std::string, std::vector<const Node *>> tags;
+
+  mutable std::unordered_map<std::string, std::vector<const Node *>> classes;
+
+  inline static const std::vector<const Node *> NO_NODES;
+};
+
 class TokenQueue {
 public:
   explicit TokenQueue(std::string data);
@@ -227,6 +684,15 @@ private:
   inline const static char ESC = '\\';
 };
 
+/// Index lookup which finds every element an evaluator may match, see
+/// `Document`.
+struct IndexKey {
+  enum class Kind { None, Id, Class, Tag };
+
+  Kind kind = Kind::None;
+  std::string value;
+};
+
 /// Evaluator that an element need to match the selector
 /// Such as, Id Evaluator means the selector will compare the id of an element
 /// with the given id.
@@ -234,7 +700,20 @@ class Evaluator {
 public:
   /// Derived class need to implement this function to show how to match.
   virtual bool matches(const Node &element) = 0;
+
+  /// Index which narrows down the elements to evaluate, `Kind::None` if all
+  /// of them have to be.
+  [[nodiscard]] virtual IndexKey indexKey() const { return IndexKey(); }
+
+  /// Estimated cost of `matches`, where cheap and selective tests are lower,
+  /// eg a tag before an attribute value. `And` evaluates its cheapest
+  /// operands first.
+  [[nodiscard]] virtual unsigned cost() const { return ATTRIBUTE_COST; }
+
   virtual ~Evaluator() = 0;
+
+  /// Cost of looking up an attribute of the element.
+  inline static const unsigned ATTRIBUTE_COST = 3;
 };
 
 /// Combining Evaluator.
@@ -260,24 +739,51 @@ class Parent : public StructuralEvaluator {
 public:
   explicit Parent(std::shared_ptr<Evaluator *> _evaluator);
   bool matches(const Node &element) override;
+  /// The operand may be evaluated against every ancestor.
+  [[nodiscard]] unsigned cost() const override;
 };
 
 class ImmediateParent : public StructuralEvaluator {
 public:
   explicit ImmediateParent(std::shared_ptr<Evaluator *> _evaluator);
   bool matches(const Node &element) override;
+  [[nodiscard]] unsigned cost() const override;
+};
+
+/// Evaluator for the general sibling combinator, eg `a ~ b`.
+class PreviousSibling : public StructuralEvaluator {
+public:
+  explicit PreviousSibling(std::shared_ptr<Evaluator *> _evaluator);
+  bool matches(const Node &element) override;
+  /// The operand may be evaluated against every previous sibling.
+  [[nodiscard]] unsigned cost() const override;
 };
 
+/// Evaluator for the adjacent sibling combinator, eg `a + b`.
+class ImmediatePreviousSibling : public StructuralEvaluator {
+public:
+  explicit ImmediatePreviousSibling(std::shared_ptr<Evaluator *> _evaluator);
+  bool matches(const Node &element) override;
+  [[nodiscard]] unsigned cost() const override;
+};
+
+/// Operands are sorted by `cost` once, so the cheap tests reject most
+/// elements before a structural one walks the tree, whatever the order of
+/// the query.
 class And final : public CombiningEvaluator {
 public:
   explicit And(const std::vector<Evaluator *> &evalutors);
   bool matches(const Node &element) override;
+  /// The most selective index of the operands, eg an id before a class.
+  [[nodiscard]] IndexKey indexKey() const override;
+  [[nodiscard]] unsigned cost() const override;
 };
 
 class Or final : public CombiningEvaluator {
 public:
   explicit Or(const std::vector<Evaluator *> &evalutors);
   bool matches(const Node &element) override;
+  [[nodiscard]] unsigned cost() const override;
 };
 
 /// AttributeKeyValuePair Evaluator, select by attribute key or/and value.
@@ -336,28 +842,37 @@ class Id : public Evaluator {
 public:
   explicit Id(std::string id);
   bool matches(const Node &element) override;
+  [[nodiscard]] IndexKey indexKey() const override;
+  [[nodiscard]] unsigned cost() const override { return 1; }
 
 private:
   std::string id;
 };
 
-/// Class Evaluator, means that selector will compare the class name of an
-/// element with the given one.
+/// Class Evaluator, means that selector will look for the class name among the
+/// class tokens of an element.
 class Class : public Evaluator {
 public:
   explicit Class(std::string clazz);
   bool matches(const Node &element) override;
+  [[nodiscard]] IndexKey indexKey() const override;
+  [[nodiscard]] unsigned cost() const override { return 2; }
 
 private:
   std::string clazz;
+  /// `ElementData::classBit` of `clazz`.
+  unsigned bit;
 };
 
 /// Tag Evaluator, means that selector will compare the tag name of an element
 /// with the given one.
 class Tag : public Evaluator {
 public:
-  explicit Tag(std::string tagName);
+  explicit Tag(const std::string &tagName);
   bool matches(const Node &element) override;
+  [[nodiscard]] IndexKey indexKey() const override;
+  /// The tag name is compared without parsing the attributes.
+  [[nodiscard]] unsigned cost() const override { return 1; }
 
 private:
   std::string tagName;
@@ -383,6 +898,18 @@ private:
   std::string keyPrefix;
 };
 
+/// Evaluators of a parsed query, freed together with the last copy of the
+/// result of `QueryParser::parse`.
+struct EvaluatorArena {
+  std::vector<std::unique_ptr<Evaluator>> evaluators;
+
+  /// Evaluator of the whole query.
+  Evaluator *root = nullptr;
+};
+
+/// Parse a css query into a tree of evaluators. The evaluators are owned by
+/// an arena shared by the returned pointer, so a parsed query doesn't leak.
+/// `Node::select(const std::string &)` runs the compiled `Selector` instead.
 class QueryParser {
 public:
   explicit QueryParser(const std::string &queryString);
@@ -397,6 +924,16 @@ public:
       "=", "!=", "^=", "$=", "*=", "~="};
 
 private:
+  /// Parser of a sub query, whose evaluators go to `arena`.
+  QueryParser(const std::string &queryString,
+              std::shared_ptr<EvaluatorArena> arena);
+
+  /// Parse the query, return the evaluator of the whole query.
+  Evaluator *parseEvaluator();
+
+  /// Create an evaluator owned by the arena.
+  template <class T, class... Args> T *make(Args &&...args);
+
   /// find elements.
   void findElements();
 
@@ -422,6 +959,8 @@ private:
   TokenQueue tokenQueue;
 
   std::vector<Evaluator *> evals;
+
+  std::shared_ptr<EvaluatorArena> arena;
 };
 
 } // namespace crawler
@@ -0,0 +1,200 @@
+///
+/// Html character references, eg `&amp;`, `&#38;` and `&#x26;`.
+///
+
+#include "entities.hpp"
+#include "strings.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+
+namespace {
+
+struct Entity {
+  std::string_view name;
+  char32_t first;
+  char32_t second;
+};
+
+/// Html5 named character references sorted by name, both `amp;` and the
+/// legacy `amp` are listed.
+constexpr Entity ENTITIES[] = {
+#include "entity_table.inc"
+};
+
+/// Node of the entity trie, children of a node are linked through `sibling`
+/// in ascending order. 0 is the root, so it doubles as "none".
+struct TrieNode {
+  char c = 0;
+  uint16_t child = 0;
+  uint16_t sibling = 0;
+  /// Index + 1 of the entity ending at this node, 0 if none.
+  uint16_t entity = 0;
+};
+
+template <size_t N> struct Trie {
+  std::array<TrieNode, N> nodes{};
+  size_t size = 1;
+};
+
+/// Number of trie nodes if no prefix is shared.
+constexpr size_t maxTrieSize() {
+  size_t size = 1;
+  for (const Entity &entity : ENTITIES) {
+    size += entity.name.size();
+  }
+  return size;
+}
+
+template <size_t N> constexpr Trie<N> buildTrie() {
+  Trie<N> trie;
+  for (size_t i = 0; i < std::size(ENTITIES); i++) {
+    size_t node = 0;
+    for (char c : ENTITIES[i].name) {
+      size_t child = trie.nodes[node].child;
+      size_t last = 0;
+      while (child != 0 && trie.nodes[child].c != c) {
+        last = child;
+        child = trie.nodes[child].sibling;
+      }
+      if (child == 0) {
+        child = trie.size++;
+        trie.nodes[child].c = c;
+        if (last == 0) {
+          trie.nodes[node].child = static_cast<uint16_t>(child);
+        } else {
+          trie.nodes[last].sibling = static_cast<uint16_t>(child);
+        }
+      }
+      node = child;
+    }
+    trie.nodes[node].entity = static_cast<uint16_t>(i + 1);
+  }
+  return trie;
+}
+
+constexpr size_t TRIE_SIZE = buildTrie<maxTrieSize()>().size;
+static_assert(TRIE_SIZE <= UINT16_MAX, "trie index overflows uint16_t");
+
+/// Built at compile time, lives in read-only data.
+constexpr Trie<TRIE_SIZE> TRIE = buildTrie<TRIE_SIZE>();
+
+/// Code points of 0x80 - 0x9F references, which are windows-1252 bytes in
+/// practice.
+constexpr char32_t WINDOWS_1252[32] = {
+    0x20AC, 0x81,   0x201A, 0x192,  0x201E, 0x2026, 0x2020, 0x2021,
+    0x2C6,  0x2030, 0x160,  0x2039, 0x152,  0x8D,   0x17D,  0x8F,
+    0x90,   0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x2DC,  0x2122, 0x161,  0x203A, 0x153,  0x9D,   0x17E,  0x178};
+
+inline bool isAsciiDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline int hexValue(char c) {
+  if (isAsciiDigit(c)) {
+    return c - '0';
+  }
+  const char lower = static_cast<char>(c | 0x20);
+  return (lower >= 'a' && lower <= 'f') ? lower - 'a' + 10 : -1;
+}
+
+inline bool isAsciiAlphanumeric(char c) {
+  const char lower = static_cast<char>(c | 0x20);
+  return isAsciiDigit(c) || (lower >= 'a' && lower <= 'z');
+}
+
+/// Decode the numeric reference starting with `&#` at `amp`. Return the
+/// position after the reference, or `amp` if it isn't one.
+size_t decodeNumeric(std::string_view text, size_t amp, std::string &output) {
+  const size_t pos = amp + 2;
+  const bool hex = pos < text.size() && (text[pos] | 0x20) == 'x';
+  size_t end = hex ? pos + 1 : pos;
+  char32_t codePoint = 0;
+  const size_t digitsBegin = end;
+  for (; end < text.size(); end++) {
+    const int digit = hex ? hexValue(text[end])
+                          : (isAsciiDigit(text[end]) ? text[end] - '0' : -1);
+    if (digit < 0) {
+      break;
+    }
+    // saturate, anything above 0x10FFFF is invalid anyway.
+    codePoint = std::min<char32_t>(codePoint * (hex ? 16 : 10) + digit,
+                                   0x110000);
+  }
+  if (end == digitsBegin) {
+    return amp;
+  }
+  if (end < text.size() && text[end] == ';') {
+    end++;
+  }
+  if (codePoint >= 0x80 && codePoint <= 0x9F) {
+    codePoint = WINDOWS_1252[codePoint - 0x80];
+  } else if (codePoint == 0 || codePoint > 0x10FFFF ||
+             (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+    codePoint = 0xFFFD;
+  }
+  crawler::appendUtf8(output, codePoint);
+  return end;
+}
+
+/// Decode the longest named reference starting at `amp`. Return the position
+/// after the reference, or `amp` if it isn't one.
+size_t decodeNamed(std::string_view text, size_t amp, bool inAttribute,
+                   std::string &output) {
+  size_t node = 0;
+  size_t matchedEntity = 0;
+  size_t matchedEnd = amp;
+  for (size_t i = amp + 1; i < text.size(); i++) {
+    size_t child = TRIE.nodes[node].child;
+    while (child != 0 && TRIE.nodes[child].c < text[i]) {
+      child = TRIE.nodes[child].sibling;
+    }
+    if (child == 0 || TRIE.nodes[child].c != text[i]) {
+      break;
+    }
+    node = child;
+    if (TRIE.nodes[node].entity != 0) {
+      matchedEntity = TRIE.nodes[node].entity;
+      matchedEnd = i + 1;
+    }
+  }
+  if (matchedEntity == 0) {
+    return amp;
+  }
+  if (text[matchedEnd - 1] != ';' && inAttribute && matchedEnd < text.size() &&
+      (text[matchedEnd] == '=' || isAsciiAlphanumeric(text[matchedEnd]))) {
+    return amp;
+  }
+  const Entity &entity = ENTITIES[matchedEntity - 1];
+  crawler::appendUtf8(output, entity.first);
+  if (entity.second != 0) {
+    crawler::appendUtf8(output, entity.second);
+  }
+  return matchedEnd;
+}
+
+} // namespace
+
+std::string crawler::decodeEntities(std::string_view text, bool inAttribute) {
+  std::string output;
+  output.reserve(text.size());
+  size_t pos = 0;
+  while (pos < text.size()) {
+    const size_t amp = text.find('&', pos);
+    if (amp == std::string_view::npos) {
+      output.append(text.substr(pos));
+      break;
+    }
+    output.append(text.substr(pos, amp - pos));
+    size_t end = amp + 1 < text.size() && text[amp + 1] == '#'
+                     ? decodeNumeric(text, amp, output)
+                     : decodeNamed(text, amp, inAttribute, output);
+    if (end == amp) {
+      output += '&';
+      end = amp + 1;
+    }
+    pos = end;
+  }
+  return output;
+}
@@ -0,0 +1,25 @@
+///
+/// Html character references, eg `&amp;`, `&#38;` and `&#x26;`.
+///
+
+#ifndef DOUBANCRAWLER_ENTITIES_H
+#define DOUBANCRAWLER_ENTITIES_H
+
+#include <string>
+#include <string_view>
+
+namespace crawler {
+
+/// Decode the named and numeric character references in `text`, eg
+/// `a &lt; b` -> `a < b`. In attribute values a named reference without `;`
+/// followed by `=` or an alphanumeric is kept, so `?a=1&copy=2` survives.
+std::string decodeEntities(std::string_view text, bool inAttribute = false);
+
+/// If `text` may contain a character reference.
+inline bool hasEntities(std::string_view text) {
+  return text.find('&') != std::string_view::npos;
+}
+
+} // namespace crawler
+
+#endif // DOUBANCRAWLER_ENTITIES_H
@@ -4,183 +4,419 @@
 
 #include "html.hpp"
 #include "dom.hpp"
-#include <cassert>
+#include "entities.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
 #include <memory>
-#include <regex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 namespace crawler {
 
-bool crawler::Parser::startsWith(const std::string &prefix) {
-  return crawler::startsWith(prefix, input, pos, input.size());
+std::vector<crawler::Node> crawler::Parser::parseNodes() {
+  return parseNodes(nullptr);
 }
 
-bool crawler::Parser::eof() { return pos >= input.size(); }
-
-bool crawler::Parser::isSelfClosingTag(
-    const std::string &currentTagName) const {
-  return SELF_CLOSING_TAGS.find(currentTagName) != SELF_CLOSING_TAGS.end();
+std::vector<crawler::Node>
+crawler::Parser::parseNodes(const crawler::Node *parent) {
+  crawler::TreeBuilder builder(parent, TreeBuilder::MAX_DEPTH, options);
+  crawler::Tokenizer tokenizer(builder, options);
+  if (pos < input->size()) {
+    tokenizer.feed(input->data() + pos, input->size() - pos, input);
+  }
+  tokenizer.finish();
+  pos = input->size();
+  return builder.finish();
 }
 
-char crawler::Parser::nextChar() { return input.c_str()[pos]; }
+crawler::Node crawler::Parser::parseNode() { return parseNode(nullptr); }
 
-char crawler::Parser::consumeChar() {
-  char currentChar = input.c_str()[pos];
-  pos += 1;
-  return currentChar;
+crawler::Node
+crawler::Parser::parseNode(const crawler::Node *parent) {
+  std::vector<crawler::Node> nodes = parseNodes(parent);
+  if (nodes.empty()) {
+    return crawler::Node(std::string(), parent);
+  }
+  return std::move(nodes.front());
 }
 
-template <class Predicate>
-std::string crawler::Parser::consumeWhile(Predicate predicate) {
-  std::string result;
-  while (!eof() && predicate(nextChar())) {
-    result += consumeChar();
+crawler::Node crawler::Parser::parseElement() { return parseElement(nullptr); }
+
+crawler::Node
+crawler::Parser::parseElement(const crawler::Node *parent) {
+  std::vector<crawler::Node> nodes = parseNodes(parent);
+  for (auto &node : nodes) {
+    if (node.isElement()) {
+      return std::move(node);
+    }
   }
-  return result;
+  return crawler::Node(std::string(), parent);
 }
 
-void crawler::Parser::consumeWhitespace() {
-  crawler::Parser::consumeWhile([](char c) -> bool { return isspace(c); });
+crawler::Parser::Parser(size_t _pos, std::string _input,
+                        ParseOptions _options) {
+  pos = _pos;
+  input = std::make_shared<const std::string>(std::move(_input));
+  options = _options;
 }
 
-// delete all comment tag
-void crawler::Parser::consumeComment() {
-  std::string commentDescriptor("<!--");
-  if (!crawler::contains(commentDescriptor, input)) {
-    return;
+/// If the document contains a root element, just return it, Otherwise, create
+/// one.
+static crawler::Node documentRoot(std::vector<crawler::Node> nodes) {
+  if (nodes.size() == 1) {
+    return std::move(nodes.front());
+  } else {
+    const std::string html("html");
+    const crawler::AttrMap attributes;
+    return crawler::Node(html, attributes, std::move(nodes), nullptr);
   }
-  std::string emptyString;
-  std::regex pattern(R"(<!--.*?-->)");
-  std::regex_replace(input, pattern, emptyString);
 }
 
-void Parser::consumeDoctype() {
-  std::string doctypeIdentifier("<!doctype");
-  if (!crawler::containsIgnoreCase(doctypeIdentifier, input)) {
-    return;
+crawler::TreeBuilder::TreeBuilder(const crawler::Node *root, size_t maxDepth,
+                                  const ParseOptions &options)
+    : root(root), maxDepth(maxDepth), allowTags(options.allowTags) {
+  if (!options.rootSelector.empty()) {
+    rootSelector = SelectorCache::shared().get(options.rootSelector);
+    // matched against start tags, before the element is in the tree.
+    if (!rootSelector->isCompound()) {
+      throw std::runtime_error("rootSelector is not a compound selector: " +
+                               options.rootSelector);
+    }
   }
-  std::string emptyString;
-  std::regex pattern(R"(<!.*?>)");
-  input = std::regex_replace(input, pattern, emptyString);
 }
 
-crawler::Node
-crawler::Parser::parseText(const std::shared_ptr<crawler::Node> &parent) {
-  return crawler::Node(consumeWhile([](char c) -> bool { return c != '<'; }),
-                       parent);
+bool crawler::TreeBuilder::filters() const {
+  return !allowTags.empty() || rootSelector != nullptr;
 }
 
-std::string crawler::Parser::parseAttributeValue() {
-  const char openQuote = consumeChar();
-  assert(openQuote == '"' || openQuote == '\'');
-  auto value =
-      consumeWhile([&openQuote](char c) -> bool { return c != openQuote; });
-  assert(openQuote == consumeChar());
-  return value;
+bool crawler::TreeBuilder::keeps(const StartTag &tag) const {
+  if (allowTags.count(tag.tagName) > 0) {
+    return true;
+  }
+  if (rootSelector == nullptr) {
+    return false;
+  }
+  if (!rootSelector->mightMatchTag(tag.tagName)) {
+    return false;
+  }
+  if (tag.rawAttributes.view.empty()) {
+    return rootSelector->matchesStartTag(tag.tagName, tag.attributes);
+  }
+  return rootSelector->matchesStartTag(
+      tag.tagName, Tokenizer::parseAttributes(tag.rawAttributes.view));
 }
 
-std::pair<std::string, std::string> crawler::Parser::parseAttribute() {
-  const std::string name = parseTagName();
-  assert(consumeChar() == '=');
-  const std::string value = parseAttributeValue();
-  return std::make_pair(name, value);
+void crawler::TreeBuilder::appendNode(crawler::Node node) {
+  if (openElements.empty()) {
+    nodes.emplace_back(std::move(node));
+  } else {
+    openElements.back().children.emplace_back(std::move(node));
+  }
+}
+
+crawler::ElementData crawler::TreeBuilder::elementOf(StartTag &tag) {
+  if (!tag.rawAttributes.view.empty()) {
+    return ElementData(std::move(tag.tagName), std::move(tag.rawAttributes));
+  }
+  return ElementData(std::move(tag.tagName), std::move(tag.attributes));
 }
 
-std::string crawler::Parser::parseTagName() {
-  return consumeWhile([](char c) -> bool { return isalnum(c); });
+void crawler::TreeBuilder::popElement() {
+  OpenElement element = std::move(openElements.back());
+  openElements.pop_back();
+  openCounts[element.element.getTagName()]--;
+  appendNode(crawler::Node(std::move(element.element),
+                           std::move(element.children), root));
+}
+
+void crawler::TreeBuilder::popTo(size_t index) {
+  while (openElements.size() >= index && index > 0) {
+    popElement();
+  }
 }
-crawler::AttrMap crawler::Parser::parseAttributes() {
-  std::map<std::string, std::string> attributes;
-  while (true) {
-    consumeWhitespace();
-    if (nextChar() == '>') {
-      break;
+
+size_t crawler::TreeBuilder::findInScope(
+    std::initializer_list<const char *> tagNames,
+    const std::set<std::string> &boundaries) const {
+  if (std::none_of(tagNames.begin(), tagNames.end(),
+                   [this](const char *tagName) {
+                     auto count = openCounts.find(tagName);
+                     return count != openCounts.end() && count->second > 0;
+                   })) {
+    return 0;
+  }
+  for (size_t i = openElements.size(); i > 0; i--) {
+    const std::string &tagName = openElements[i - 1].element.getTagName();
+    if (std::any_of(tagNames.begin(), tagNames.end(),
+                    [&tagName](const char *name) { return tagName == name; })) {
+      return i;
+    }
+    if (boundaries.count(tagName) > 0) {
+      return 0;
     }
-    std::pair<std::string, std::string> attribute = parseAttribute();
-    attributes.insert(attribute);
   }
-  return attributes;
+  return 0;
 }
-crawler::Node crawler::Parser::parseElement() { return parseElement(nullptr); }
-crawler::Node
-crawler::Parser::parseElement(const std::shared_ptr<crawler::Node> parent) {
-  // Opening tag.
-  assert(consumeChar() == '<');
-  const std::string tagName = parseTagName();
-  const std::map<std::string, std::string> attributes = parseAttributes();
-  const std::vector<crawler::Node> emptyChild;
-  if (isSelfClosingTag(tagName)) {
-    // self-closing has various format, such as <img> or <img/>
-    if (nextChar() == '>') {
-      assert(consumeChar() == '>');
-    } else {
-      assert(consumeChar() == '/');
-      assert(consumeChar() == '>');
+
+const std::set<std::string> &
+crawler::TreeBuilder::scopeOf(const std::string &tagName) {
+  if (tagName == "li") {
+    return LIST_ITEM_SCOPE;
+  } else if (tagName == "p") {
+    return BUTTON_SCOPE;
+  } else if (TABLE_TAGS.count(tagName) > 0) {
+    return TABLE_SCOPE;
+  }
+  return SCOPE_BOUNDARIES;
+}
+
+void crawler::TreeBuilder::closeImpliedElements(const std::string &tagName) {
+  if (tagName == "li" || tagName == "dd" || tagName == "dt") {
+    // close the previous list item, unless it's outside of a nested list.
+    const std::set<std::string> items =
+        tagName == "li" ? std::set<std::string>{"li"}
+                        : std::set<std::string>{"dd", "dt"};
+    for (size_t i = openElements.size(); i > 0; i--) {
+      const std::string &openTag = openElements[i - 1].element.getTagName();
+      if (items.count(openTag) > 0) {
+        popTo(i);
+        break;
+      }
+      if (SPECIAL_TAGS.count(openTag) > 0 && openTag != "address" &&
+          openTag != "div" && openTag != "p") {
+        break;
+      }
     }
-    return crawler::Node(tagName, attributes, emptyChild, parent);
-  } else {
-    assert(consumeChar() == '>');
   }
-  crawler::Node currentNode(tagName, attributes, emptyChild, parent);
-  auto ptr = std::make_shared<crawler::Node>(currentNode);
-  // Contents.
-  const std::vector<crawler::Node> children = parseNodes(ptr);
-  // Closing tag.
-  assert(consumeChar() == '<');
-  assert(consumeChar() == '/');
-  assert(parseTagName() == tagName);
-  assert(consumeChar() == '>');
-  crawler::Node node(tagName, attributes, children, parent);
-  return node;
+  if (CLOSE_P_TAGS.count(tagName) > 0) {
+    popTo(findInScope({"p"}, BUTTON_SCOPE));
+  }
+  if (HEADINGS.count(tagName) > 0 && !openElements.empty() &&
+      HEADINGS.count(openElements.back().element.getTagName()) > 0) {
+    popElement();
+  }
+  if (tagName == "a") {
+    // links can't be nested, close the open one.
+    popTo(findInScope({"a"}));
+  } else if (tagName == "option" || tagName == "optgroup") {
+    if (!openElements.empty() &&
+        openElements.back().element.getTagName() == "option") {
+      popElement();
+    }
+    if (tagName == "optgroup" && !openElements.empty() &&
+        openElements.back().element.getTagName() == "optgroup") {
+      popElement();
+    }
+  } else if (tagName == "td" || tagName == "th") {
+    popTo(findInScope({"td", "th"}, TABLE_SCOPE));
+  } else if (tagName == "tr") {
+    popTo(findInScope({"tr"}, TABLE_SCOPE));
+  } else if (tagName == "thead" || tagName == "tbody" || tagName == "tfoot") {
+    popTo(findInScope({"thead", "tbody", "tfoot"}, TABLE_SCOPE));
+  }
 }
 
-std::vector<crawler::Node> crawler::Parser::parseNodes() {
-  return parseNodes(nullptr);
+void crawler::TreeBuilder::startElement(StartTag &tag) {
+  if (openElements.empty() && filters() && !keeps(tag)) {
+    return;
+  }
+  closeImpliedElements(tag.tagName);
+  if (tag.selfClosing || SELF_CLOSING_TAGS.count(tag.tagName) > 0) {
+    appendNode(crawler::Node(elementOf(tag), std::vector<crawler::Node>(),
+                             root));
+    return;
+  }
+  if (openElements.size() >= maxDepth) {
+    popElement();
+  }
+  openCounts[tag.tagName]++;
+  openElements.push_back({elementOf(tag), std::vector<crawler::Node>()});
 }
 
-std::vector<crawler::Node>
-crawler::Parser::parseNodes(const std::shared_ptr<crawler::Node> &parent) {
-  consumeComment();
-  consumeDoctype();
-  std::vector<crawler::Node> nodes;
-  while (true) {
-    consumeWhitespace();
-    if (eof() || startsWith("</")) {
-      break;
+void crawler::TreeBuilder::endElement(const std::string &tagName) {
+  if (openElements.empty() && filters()) {
+    return;
+  }
+  if (tagName == "br") {
+    // </br> is treated as <br>.
+    StartTag br{tagName, AttrMap(), true, RawSpan()};
+    startElement(br);
+    return;
+  }
+  if (tagName == "p" && findInScope({"p"}, BUTTON_SCOPE) == 0) {
+    // </p> without <p> is treated as <p></p>.
+    appendNode(crawler::Node(tagName, AttrMap(), std::vector<crawler::Node>(),
+                             root));
+    return;
+  }
+  if (SPECIAL_TAGS.count(tagName) > 0) {
+    // close the element and everything opened after it, ignore the end tag
+    // if the element isn't open.
+    popTo(findInScope({tagName.c_str()}, scopeOf(tagName)));
+    return;
+  }
+  // the end tag of an inline element closes it, unless a special element is
+  // opened after it, eg </span> is ignored in <span><div></span>
+  for (size_t i = openElements.size(); i > 0; i--) {
+    const std::string &openTag = openElements[i - 1].element.getTagName();
+    if (openTag == tagName) {
+      popTo(i);
+      return;
+    }
+    if (SPECIAL_TAGS.count(openTag) > 0) {
+      return;
     }
-    nodes.emplace_back(parseNode(parent));
   }
-  return nodes;
 }
 
-crawler::Node crawler::Parser::parseNode() { return parseNode(nullptr); }
+void crawler::TreeBuilder::text(std::string_view text) {
+  sharedText(text, nullptr);
+}
 
-crawler::Node
-crawler::Parser::parseNode(const std::shared_ptr<crawler::Node> &parent) {
-  if (nextChar() == '<') {
-    return parseElement(parent);
-  } else {
-    return parseText(parent);
+void crawler::TreeBuilder::sharedText(
+    std::string_view text, const std::shared_ptr<const void> &owner) {
+  if (openElements.empty() && filters()) {
+    return;
   }
+  // the content of <script> and <style> is never decoded.
+  const bool rawText =
+      !openElements.empty() &&
+      RAW_TEXT_TAGS.count(openElements.back().element.getTagName()) > 0;
+  const bool encoded = !rawText && hasEntities(text);
+  appendNode(crawler::Node(owner == nullptr
+                               ? TextData(std::string(text), encoded)
+                               : TextData(RawSpan{owner, text}, encoded),
+                           root));
 }
 
-crawler::Parser::Parser(size_t _pos, std::string _input) {
-  pos = _pos;
-  input = std::move(_input);
+std::vector<crawler::Node> crawler::TreeBuilder::finish() {
+  while (!openElements.empty()) {
+    popElement();
+  }
+  return std::move(nodes);
 }
 
-crawler::Node parse(const std::string &source) {
-  const std::vector<crawler::Node> nodes =
-      crawler::Parser(0, source).parseNodes(nullptr);
+crawler::StreamParser::StreamParser(const ParseOptions &options)
+    : builder(nullptr, TreeBuilder::MAX_DEPTH, options),
+      tokenizer(builder, options), decoder(options.charset),
+      decoding(options.charset != Charset::Unknown),
+      sink([this](std::string_view text) { tokenizer.feed(text); }) {}
 
-  // If the document contains a root element, just return it, Otherwise, create
-  // one.
-  if (nodes.size() == 1) {
-    return nodes.at(0);
+void crawler::StreamParser::startDecoding() {
+  decoder = CharsetDecoder(sniffCharset(head));
+  decoding = true;
+  decoder.decode(head.data(), head.size(), sink);
+  head = std::string();
+}
+
+void crawler::StreamParser::feed(const char *data, size_t length) {
+  if (decoding) {
+    decoder.decode(data, length, sink);
+    return;
+  }
+  head.append(data, length);
+  if (head.size() >= SNIFF_LENGTH) {
+    startDecoding();
+  }
+}
+
+void crawler::StreamParser::feed(std::string_view chunk) {
+  feed(chunk.data(), chunk.size());
+}
+
+crawler::Node crawler::StreamParser::finish() {
+  if (!decoding) {
+    startDecoding();
+  }
+  decoder.finish(sink);
+  tokenizer.finish();
+  return documentRoot(builder.finish());
+}
+
+/// Parse a whole document kept alive by `owner`. UTF-8 input is parsed in
+/// place, anything else is transcoded into a new buffer first.
+static crawler::Node parseBuffer(const char *data, size_t length,
+                                 const std::shared_ptr<const void> &owner,
+                                 const ParseOptions &options) {
+  Charset charset = options.charset;
+  if (charset == Charset::Unknown) {
+    charset = sniffCharset(std::string_view(data, length));
+  }
+  crawler::TreeBuilder builder(nullptr, TreeBuilder::MAX_DEPTH, options);
+  crawler::Tokenizer tokenizer(builder, options);
+  if (charset != Charset::Big5 && charset != Charset::Gb18030 &&
+      isValidUtf8(data, length)) {
+    tokenizer.feed(data, length, owner);
   } else {
-    const std::string html("html");
-    const crawler::AttrMap attributes;
-    return crawler::Node(html, attributes, nodes, nullptr);
+    auto decoded = std::make_shared<std::string>();
+    const TextSink append = [&decoded](std::string_view text) {
+      decoded->append(text);
+    };
+    CharsetDecoder decoder(charset);
+    decoder.decode(data, length, append);
+    decoder.finish(append);
+    tokenizer.feed(decoded->data(), decoded->size(), decoded);
   }
+  tokenizer.finish();
+  return documentRoot(builder.finish());
+}
+
+crawler::Node parse(const std::string &source, ParseOptions options) {
+  auto input = std::make_shared<const std::string>(source);
+  return parseBuffer(input->data(), input->size(), input, options);
+}
+
+namespace {
+/// Read-only mapping of a whole file.
+struct FileMapping {
+  const char *data = nullptr;
+  size_t size = 0;
+
+  FileMapping(const FileMapping &) = delete;
+  FileMapping &operator=(const FileMapping &) = delete;
+
+  explicit FileMapping(const std::string &path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat status {};
+    if (fstat(fd, &status) < 0) {
+      const int savedErrno = errno;
+      close(fd);
+      throw std::system_error(savedErrno, std::generic_category(), path);
+    }
+    size = static_cast<size_t>(status.st_size);
+    if (size > 0) {
+      void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED) {
+        const int savedErrno = errno;
+        close(fd);
+        throw std::system_error(savedErrno, std::generic_category(), path);
+      }
+      // the parser reads the file front to back exactly once.
+      madvise(address, size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(address);
+    }
+    // the mapping stays valid after the descriptor is closed.
+    close(fd);
+  }
+
+  ~FileMapping() {
+    if (data != nullptr) {
+      munmap(const_cast<char *>(data), size);
+    }
+  }
+};
+} // namespace
+
+crawler::Node parseFile(const std::string &path, const ParseOptions &options) {
+  auto mapping = std::make_shared<const FileMapping>(path);
+  return parseBuffer(mapping->data, mapping->size, mapping, options);
 }
 } // namespace crawler
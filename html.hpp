@@ -6,18 +6,25 @@
 #define DOUBANCRAWLER_HTML_H
 
 #include "dom.hpp"
+#include "selector.hpp"
+#include "tokenizer.hpp"
+#include <initializer_list>
 #include <memory>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace crawler {
 
 class Parser {
 public:
-  Parser(size_t pos, std::string input);
+  Parser(size_t pos, std::string input,
+         ParseOptions options = ParseOptions());
   /// Parse a sequence of sibling nodes.
   std::vector<crawler::Node>
-  parseNodes(const std::shared_ptr<crawler::Node> &parent);
+  parseNodes(const crawler::Node *parent);
 
   /// Parse a sequence of sibling nodes.
   std::vector<crawler::Node> parseNodes();
@@ -26,65 +33,216 @@ public:
   crawler::Node parseNode();
 
   /// Parse a single node.
-  crawler::Node parseNode(const std::shared_ptr<crawler::Node> &parent);
+  crawler::Node parseNode(const crawler::Node *parent);
 
   /// Parse a single element, including its open tag, content, and closing tag.
+  /// Return an empty text node if there is no element in the input.
   crawler::Node parseElement();
 
   /// Parse a single element, including its open tag, content, and closing tag.
-  crawler::Node parseElement(std::shared_ptr<crawler::Node> parent);
+  /// Return an empty text node if there is no element in the input.
+  crawler::Node parseElement(const crawler::Node *parent);
 
 private:
   size_t pos;
-  std::string input;
-  inline static const std::set<std::string> SELF_CLOSING_TAGS = {
-      "area",   "base", "br",       "col",  "embed", "hr",     "img",   "input",
-      "keygen", "link", "menuitem", "meta", "param", "source", "track", "wbr"};
-
-  /// Parse a tag or attribute name.
-  std::string parseTagName();
+  /// Shared with the raw attributes of the parsed elements.
+  std::shared_ptr<const std::string> input;
+  ParseOptions options;
+};
 
-  /// Parse a list of name="values" pairs, separated by whitespace.
-  crawler::AttrMap parseAttributes();
+/// Build DOM nodes from tokenizer events with a stack of open elements, in a
+/// single pass without recursion. Malformed markup never fails the parse, it
+/// is recovered following the html5 tree construction rules:
+/// 1. implied end tags, eg <li> closes the previous <li>, a block start tag
+///    closes an open <p>.
+/// 2. end tag of an element which is not open (in scope) is ignored.
+/// 3. end tag of an open element closes every element opened after it.
+/// 4. nesting deeper than `maxDepth` is flattened, eg a new element becomes a
+///    sibling of the deepest one.
+/// With `allowTags` or `rootSelector` of `options`, only the subtrees of the
+/// matching elements are built. `rootSelector` is matched against each start
+/// tag, so it must be compound, otherwise `std::runtime_error` is thrown.
+class TreeBuilder : public TokenHandler {
+public:
+  explicit TreeBuilder(const crawler::Node *root = nullptr,
+                       size_t maxDepth = MAX_DEPTH,
+                       const ParseOptions &options = ParseOptions());
 
-  /// Parse a single name="value" pair.
-  std::pair<std::string, std::string> parseAttribute();
+  void startElement(StartTag &tag) override;
 
-  /// Parse a quoted value.
-  std::string parseAttributeValue();
+  void endElement(const std::string &tagName) override;
 
-  /// Parse a text node
-  crawler::Node parseText(const std::shared_ptr<crawler::Node> &parent);
+  void text(std::string_view text) override;
 
-  /// Consume and discard zero or more whitespace characters
-  void consumeWhitespace();
+  void sharedText(std::string_view text,
+                  const std::shared_ptr<const void> &owner) override;
 
-  /// Consume and discard zero or more comment
-  void consumeComment();
+  /// Close all elements left open and return the top-level nodes.
+  std::vector<crawler::Node> finish();
 
-  /// Consume and discard doctype.
-  void consumeDoctype();
+  /// Default limit of open elements, same as the one of blink.
+  inline static const size_t MAX_DEPTH = 512;
 
-  /// Consume character until `test` return false.
-  template <class Predicate> std::string consumeWhile(Predicate predicate);
+private:
+  struct OpenElement {
+    ElementData element;
+    std::vector<crawler::Node> children;
+  };
+
+  /// Append `node` to the element on top of the stack.
+  void appendNode(crawler::Node node);
+
+  /// Element data of a start tag, raw attributes are kept unparsed.
+  static ElementData elementOf(StartTag &tag);
+
+  /// Pop the element on top of the stack and append it to its parent.
+  void popElement();
+
+  /// Pop elements until the open element at `index` - 1 has been popped.
+  void popTo(size_t index);
+
+  /// Index + 1 of the nearest open element named one of `tagNames`, 0 if
+  /// there is none before the first element of `boundaries`.
+  [[nodiscard]] size_t
+  findInScope(std::initializer_list<const char *> tagNames,
+              const std::set<std::string> &boundaries = SCOPE_BOUNDARIES) const;
+
+  /// Scope boundaries used to look up the open element closed by `tagName`.
+  [[nodiscard]] static const std::set<std::string> &
+  scopeOf(const std::string &tagName);
+
+  /// Close the elements implied by the start tag `tagName`.
+  void closeImpliedElements(const std::string &tagName);
+
+  /// Only the subtrees of allowed or root elements are built.
+  [[nodiscard]] bool filters() const;
+
+  /// `tag` starts a subtree to build, with `filters()` on.
+  [[nodiscard]] bool keeps(const StartTag &tag) const;
+
+  /// Top-level parent, eg the parent of nodes outside any element. Nodes
+  /// inside an element are pointed to it once the element is closed.
+  const crawler::Node *root;
+
+  size_t maxDepth;
+
+  std::set<std::string> allowTags;
+
+  /// Compiled `rootSelector` of the options, null if there is none.
+  std::shared_ptr<const Selector> rootSelector;
+
+  std::vector<OpenElement> openElements;
+
+  /// Number of open elements by tag name, so looking for an element which
+  /// isn't open doesn't walk the stack.
+  std::unordered_map<std::string, size_t> openCounts;
+
+  std::vector<crawler::Node> nodes;
+
+  /// Elements which stop the search of an open element.
+  inline static const std::set<std::string> SCOPE_BOUNDARIES = {
+      "applet",  "caption", "html",    "table",   "td",      "th",
+      "marquee", "object",  "template"};
+
+  inline static const std::set<std::string> BUTTON_SCOPE = {
+      "applet",  "caption", "html",     "table",  "td",     "th",
+      "marquee", "object",  "template", "button"};
+
+  inline static const std::set<std::string> LIST_ITEM_SCOPE = {
+      "applet",  "caption", "html",     "table", "td", "th",
+      "marquee", "object",  "template", "ol",    "ul"};
+
+  inline static const std::set<std::string> TABLE_SCOPE = {"html", "table",
+                                                           "template"};
+
+  /// Table elements, looked up in table scope.
+  inline static const std::set<std::string> TABLE_TAGS = {
+      "caption", "table", "tbody", "td", "tfoot", "th", "thead", "tr"};
+
+  /// Start tags which close an open <p>.
+  inline static const std::set<std::string> CLOSE_P_TAGS = {
+      "address",    "article",    "aside",      "blockquote", "details",
+      "dialog",     "div",        "dl",         "fieldset",   "figcaption",
+      "figure",     "footer",     "form",       "h1",         "h2",
+      "h3",         "h4",         "h5",         "h6",         "header",
+      "hgroup",     "hr",         "main",       "menu",       "nav",
+      "ol",         "p",          "pre",        "section",    "table",
+      "ul",         "li",         "dd",         "dt"};
+
+  /// Elements whose text is kept as is.
+  inline static const std::set<std::string> RAW_TEXT_TAGS = {"script",
+                                                             "style"};
+
+  /// A heading start tag closes an open heading.
+  inline static const std::set<std::string> HEADINGS = {"h1", "h2", "h3",
+                                                        "h4", "h5", "h6"};
+
+  /// Elements with special parsing rules, the end tag of an inline element
+  /// never closes them.
+  inline static const std::set<std::string> SPECIAL_TAGS = {
+      "address",    "applet",     "area",       "article",    "aside",
+      "base",       "body",       "blockquote", "br",         "button",
+      "caption",    "center",     "col",        "colgroup",   "dd",
+      "details",    "dir",        "div",        "dl",         "dt",
+      "embed",      "fieldset",   "figcaption", "figure",     "footer",
+      "form",       "frame",      "frameset",   "h1",         "h2",
+      "h3",         "h4",         "h5",         "h6",         "head",
+      "header",     "hgroup",     "hr",         "html",       "iframe",
+      "img",        "input",      "li",         "link",       "main",
+      "marquee",    "menu",       "meta",       "nav",        "noscript",
+      "object",     "ol",         "p",          "param",      "pre",
+      "script",     "section",    "select",     "source",     "style",
+      "summary",    "table",      "tbody",      "td",         "template",
+      "textarea",   "tfoot",      "th",         "thead",      "title",
+      "tr",         "track",      "ul",         "wbr"};
+};
 
-  /// Return the current character and advance `pos` to the next character
-  char consumeChar();
+/// Incremental parser, feed it chunks of the document as they are downloaded.
+/// Without a known charset, the first `SNIFF_LENGTH` bytes are buffered to
+/// look for <meta charset>, eg:
+///   crawler::StreamParser parser;
+///   crawler::http_get(host, [&](const char *data, size_t length) {
+///     parser.feed(data, length);
+///   });
+///   crawler::Node root = parser.finish();
+/// Use `Tokenizer` with your own `TokenHandler` for SAX-style events instead
+/// of a DOM.
+class StreamParser {
+public:
+  explicit StreamParser(const ParseOptions &options = ParseOptions());
 
-  /// Read the current character without consuming it.
-  char nextChar();
+  /// Parse next chunk of the document.
+  void feed(const char *data, size_t length);
 
-  /// Does the current input start with the given string
-  bool startsWith(const std::string &prefix);
+  /// Parse next chunk of the document.
+  void feed(std::string_view chunk);
 
-  /// Return true if all input is consumed.
-  bool eof();
+  /// Finish parsing and return the root of the document.
+  crawler::Node finish();
 
-  /// Check if `currentTagName` is a self-closing tag or not.
-  [[nodiscard]] bool isSelfClosingTag(const std::string &currentTagName) const;
+private:
+  /// Pick the charset and decode the buffered head of the document.
+  void startDecoding();
+
+  TreeBuilder builder;
+  Tokenizer tokenizer;
+  CharsetDecoder decoder;
+  /// The charset is known, `decoder` is in use.
+  bool decoding;
+  /// Beginning of the document, buffered to sniff its charset.
+  std::string head;
+  /// Feed decoded text to `tokenizer`.
+  TextSink sink;
 };
 
-crawler::Node parse(const std::string &source);
+crawler::Node parse(const std::string &source,
+                    ParseOptions options = ParseOptions());
+
+/// Parse a stored page straight from a read-only memory mapping of the file,
+/// text and raw attributes point into the mapping, which is unmapped once no
+/// node refers to it. Throw `std::system_error` if the file can't be mapped.
+crawler::Node parseFile(const std::string &path,
+                        const ParseOptions &options = ParseOptions());
 
 } // namespace crawler
 
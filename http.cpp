@@ -1,5 +1,7 @@
 #include "http.hpp"
+#include "strings.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>  /* printf, sprintf */
 #include <cstdlib> /* exit, atoi, malloc, free */
@@ -7,6 +9,8 @@
 #include <map>
 #include <netdb.h>      /* struct hostent, gethostbyname */
 #include <netinet/in.h> /* struct sockaddr_in, struct sockaddr */
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <sys/socket.h> /* socket, connect */
 #include <syslog.h>
@@ -53,16 +57,20 @@ int crawler::tcp_connect(const char *host, const char *serv) {
 }
 
 std::string crawler::handle_response(int sockfd) {
-  int n = 0;
-  char recvline[MAXLINE + 1];
   /* process response */
   std::string buffer;
+  crawler::handle_response(sockfd, [&buffer](const char *data, size_t length) {
+    buffer.append(data, length);
+  });
+  return buffer;
+}
 
+void crawler::handle_response(int sockfd, const BodyHandler &onChunk) {
+  ssize_t n = 0;
+  char recvline[MAXLINE];
   while ((n = read(sockfd, recvline, MAXLINE)) > 0) {
-    recvline[n] = 0; /* null terminate */
-    buffer += recvline;
+    onChunk(recvline, static_cast<size_t>(n));
   }
-  return std::string(buffer);
 }
 
 void crawler::send_request(int sockfd, const char *message) {
@@ -79,11 +87,10 @@ void crawler::send_request(int sockfd, const char *message) {
   } while (sent < total);
 }
 
-std::string crawler::http_get(const std::string &host) {
-  const std::string protocol = "http";
+/// Build a GET request of `host`.
+static std::string build_request(const std::string &host) {
   const std::string method = crawler::method::GET;
   const std::string path = "/";
-  int sockfd;
   const char *httpRequestFormat = "%s %s HTTP/1.1\r\n";
   char buffer[1024];
 
@@ -107,9 +114,15 @@ std::string crawler::http_get(const std::string &host) {
 
   /* What are we going to send? */
   TRACE(("Request:%s\n", requestBody.c_str()));
+  return requestBody;
+}
+
+std::string crawler::http_get(const std::string &host) {
+  const std::string protocol = "http";
+  const std::string requestBody = build_request(host);
 
   /* create the socket */
-  sockfd = crawler::tcp_connect(host.c_str(), protocol.c_str());
+  int sockfd = crawler::tcp_connect(host.c_str(), protocol.c_str());
 
   /* send request*/
   crawler::send_request(sockfd, requestBody.c_str());
@@ -121,4 +134,138 @@ std::string crawler::http_get(const std::string &host) {
   close(sockfd);
 
   return std::string(response);
+}
+
+void crawler::http_get(const std::string &host, const BodyHandler &onBody) {
+  http_get(host, nullptr, onBody);
+}
+
+void crawler::http_get(const std::string &host,
+                       const HeadersHandler &onHeaders,
+                       const BodyHandler &onBody) {
+  const std::string protocol = "http";
+  const std::string requestBody = build_request(host);
+  int sockfd = crawler::tcp_connect(host.c_str(), protocol.c_str());
+  crawler::send_request(sockfd, requestBody.c_str());
+
+  /* hand the body over as soon as it arrives */
+  crawler::ResponseReader reader(onBody, onHeaders);
+  try {
+    crawler::handle_response(sockfd,
+                             [&reader](const char *data, size_t length) {
+                               reader.feed(data, length);
+                             });
+  } catch (...) {
+    /* eg a head too large, don't leak the socket */
+    close(sockfd);
+    throw;
+  }
+  close(sockfd);
+}
+
+crawler::ResponseReader::ResponseReader(BodyHandler onBody,
+                                        HeadersHandler onHeaders)
+    : onBody(std::move(onBody)), onHeaders(std::move(onHeaders)) {}
+
+int crawler::ResponseReader::getStatus() const { return status; }
+
+const std::map<std::string, std::string> &
+crawler::ResponseReader::getHeaders() const {
+  return headers;
+}
+
+void crawler::ResponseReader::parseHead() {
+  std::istringstream stream(line);
+  std::string current;
+  /* status line, eg HTTP/1.1 200 OK */
+  if (std::getline(stream, current)) {
+    size_t space = current.find(' ');
+    if (space != std::string::npos) {
+      status = atoi(current.c_str() + space + 1);
+    }
+  }
+  while (std::getline(stream, current)) {
+    size_t colon = current.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    size_t valueBegin = current.find_first_not_of(' ', colon + 1);
+    size_t valueEnd = current.find_last_not_of("\r ");
+    std::string value;
+    if (valueBegin != std::string::npos && valueEnd >= valueBegin) {
+      value = current.substr(valueBegin, valueEnd - valueBegin + 1);
+    }
+    headers[crawler::normalize(current.substr(0, colon))] = value;
+  }
+  line.clear();
+  auto encoding = headers.find("transfer-encoding");
+  if (encoding != headers.end() &&
+      crawler::containsIgnoreCase("chunked", encoding->second)) {
+    state = State::ChunkSize;
+  } else {
+    state = State::Body;
+  }
+  if (onHeaders) {
+    onHeaders(status, headers);
+  }
+}
+
+void crawler::ResponseReader::feed(const char *data, size_t length) {
+  const char *p = data;
+  const char *const end = data + length;
+  while (p < end) {
+    switch (state) {
+    case State::Head: {
+      /* headers end with an empty line, CRLF or bare LF */
+      const auto *newline =
+          static_cast<const char *>(memchr(p, '\n', end - p));
+      const char *const lineEnd = newline == nullptr ? end : newline + 1;
+      line.append(p, lineEnd);
+      p = lineEnd;
+      if (line.size() > MAX_HEAD_SIZE) {
+        throw std::runtime_error("HTTP_HEAD_TOO_LARGE");
+      }
+      if (newline != nullptr && (crawler::endsWith("\n\n", line) ||
+                                 crawler::endsWith("\n\r\n", line))) {
+        parseHead();
+      }
+      break;
+    }
+    case State::Body:
+      onBody(p, end - p);
+      p = end;
+      break;
+    case State::ChunkSize: {
+      const char c = *p++;
+      if (c != '\n') {
+        line += c;
+        break;
+      }
+      /* chunk size in hex, followed by optional extensions */
+      chunkRemaining = strtoul(line.c_str(), nullptr, 16);
+      line.clear();
+      state = chunkRemaining == 0 ? State::Done : State::ChunkData;
+      break;
+    }
+    case State::ChunkData: {
+      size_t available = std::min(chunkRemaining, static_cast<size_t>(end - p));
+      onBody(p, available);
+      p += available;
+      chunkRemaining -= available;
+      if (chunkRemaining == 0) {
+        state = State::ChunkDataEnd;
+      }
+      break;
+    }
+    case State::ChunkDataEnd:
+      /* CRLF after chunk data */
+      if (*p++ == '\n') {
+        state = State::ChunkSize;
+      }
+      break;
+    case State::Done:
+      p = end;
+      break;
+    }
+  }
 }
\ No newline at end of file
@@ -5,18 +5,79 @@
 #ifndef DOUBANCRAWLER_HTTP_H
 #define DOUBANCRAWLER_HTTP_H
 
+#include <cstddef>
+#include <functional>
+#include <map>
 #include <string>
 namespace crawler {
 
+/// Receive body bytes as they arrive.
+using BodyHandler = std::function<void(const char *data, size_t length)>;
+
+/// Receive status code and response headers, keyed by lower case header
+/// name, before the first body bytes.
+using HeadersHandler = std::function<void(
+    int status, const std::map<std::string, std::string> &headers)>;
+
+/// Incremental http response reader: splits status line and headers from the
+/// body and undoes chunked transfer encoding, so the body can be handed over
+/// to `onBody` chunk by chunk. `onHeaders`, if any, is called once the headers
+/// are received, eg to pick the charset of the body from Content-Type.
+class ResponseReader {
+public:
+  /// Longest status line and headers, `feed` throws `std::runtime_error`
+  /// beyond it rather than buffering without bound.
+  inline static const size_t MAX_HEAD_SIZE = 64 << 10;
+
+  explicit ResponseReader(BodyHandler onBody,
+                          HeadersHandler onHeaders = nullptr);
+
+  /// Consume next chunk of the raw response. Throw `std::runtime_error` if the
+  /// head is longer than `MAX_HEAD_SIZE`.
+  void feed(const char *data, size_t length);
+
+  /// Status code, eg 200, 0 if headers are not received yet.
+  [[nodiscard]] int getStatus() const;
+
+  /// Response headers, keyed by lower case header name.
+  [[nodiscard]] const std::map<std::string, std::string> &getHeaders() const;
+
+private:
+  enum class State { Head, Body, ChunkSize, ChunkData, ChunkDataEnd, Done };
+
+  /// Parse status line and headers collected in `line`.
+  void parseHead();
+
+  BodyHandler onBody;
+  HeadersHandler onHeaders;
+  State state = State::Head;
+  /// Pending head or chunk size line.
+  std::string line;
+  size_t chunkRemaining = 0;
+  int status = 0;
+  std::map<std::string, std::string> headers;
+};
+
 int tcp_connect(const char *host, const char *serv);
 
 std::string handle_response(int sockfd);
 
+/// Read response and pass each received chunk to `onChunk`.
+void handle_response(int sockfd, const BodyHandler &onChunk);
+
 void send_request(int sockfd, const char *message);
 
 void error(const char *msg);
 
 std::string http_get(const std::string &host);
 
+/// Send GET request, and pass response body to `onBody` as it is downloaded.
+void http_get(const std::string &host, const BodyHandler &onBody);
+
+/// Send GET request, pass response headers to `onHeaders` once received, then
+/// response body to `onBody` as it is downloaded.
+void http_get(const std::string &host, const HeadersHandler &onHeaders,
+              const BodyHandler &onBody);
+
 } // namespace crawler
 #endif // DOUBANCRAWLER_HTTP_H
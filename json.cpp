@@ -1,19 +1,416 @@
 #include "json.hpp"
 
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <unistd.h>
 #include <utility>
 
-crawler::JsonValue crawler::JsonParser::parse() {
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRAWLER_X86 1
+#endif
+
+namespace {
+
+const size_t BLOCK_SIZE = 64;
+
+/// Classes of the bytes of a block, bit i stands for byte i.
+struct BlockMasks {
+  uint64_t quote = 0;
+  uint64_t backslash = 0;
+  /// One of `{}[]:,`.
+  uint64_t op = 0;
+  uint64_t whitespace = 0;
+  /// Below 0x20, not allowed in strings.
+  uint64_t control = 0;
+};
+
+/// What a block carries over to the next one.
+struct IndexState {
+  /// The first byte of the next block is escaped.
+  uint64_t escaped = 0;
+  /// All ones if the block ends inside a string.
+  uint64_t inString = 0;
+  /// The last byte of the block may be followed by a number or a literal.
+  uint64_t scalarCarry = 1;
+  /// Control characters inside strings.
+  uint64_t errors = 0;
+};
+
+BlockMasks classifyScalar(const uint8_t *block) {
+  BlockMasks masks;
+  for (size_t i = 0; i < BLOCK_SIZE; i++) {
+    const uint64_t bit = uint64_t(1) << i;
+    switch (block[i]) {
+    case '"':
+      masks.quote |= bit;
+      break;
+    case '\\':
+      masks.backslash |= bit;
+      break;
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+      masks.op |= bit;
+      break;
+    case ' ':
+      masks.whitespace |= bit;
+      break;
+    case '\t':
+    case '\n':
+    case '\r':
+      masks.whitespace |= bit;
+      masks.control |= bit;
+      break;
+    default:
+      if (block[i] < 0x20) {
+        masks.control |= bit;
+      }
+    }
+  }
+  return masks;
+}
+
+#ifdef CRAWLER_X86
+__attribute__((target("avx2"))) inline uint64_t bitsOf(__m256i low,
+                                                       __m256i high) {
+  return static_cast<uint32_t>(_mm256_movemask_epi8(low)) |
+         static_cast<uint64_t>(static_cast<uint32_t>(
+             _mm256_movemask_epi8(high)))
+             << 32;
+}
+
+__attribute__((target("avx2"))) inline uint64_t
+equalBits(__m256i low, __m256i high, char ch) {
+  const __m256i target = _mm256_set1_epi8(ch);
+  return bitsOf(_mm256_cmpeq_epi8(low, target),
+                _mm256_cmpeq_epi8(high, target));
+}
+
+__attribute__((target("avx2"))) BlockMasks classifyAvx2(const uint8_t *block) {
+  const __m256i low =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+  const __m256i high =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+  // '[' and ']' are '{' and '}' without 0x20.
+  const __m256i lowerCase = _mm256_set1_epi8(0x20);
+  const __m256i lowLower = _mm256_or_si256(low, lowerCase);
+  const __m256i highLower = _mm256_or_si256(high, lowerCase);
+  const __m256i maxControl = _mm256_set1_epi8(0x1F);
+  BlockMasks masks;
+  masks.quote = equalBits(low, high, '"');
+  masks.backslash = equalBits(low, high, '\\');
+  masks.op = equalBits(lowLower, highLower, '{') |
+             equalBits(lowLower, highLower, '}') |
+             equalBits(low, high, ':') | equalBits(low, high, ',');
+  masks.whitespace = equalBits(low, high, ' ') | equalBits(low, high, '\t') |
+                     equalBits(low, high, '\n') | equalBits(low, high, '\r');
+  masks.control = bitsOf(
+      _mm256_cmpeq_epi8(_mm256_min_epu8(low, maxControl), low),
+      _mm256_cmpeq_epi8(_mm256_min_epu8(high, maxControl), high));
+  return masks;
+}
+#endif
+
+/// Bit i is the xor of the bits 0 to i of `bits`.
+inline uint64_t prefixXor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+/// Append the structural positions of the block at `offset`.
+inline void indexBlock(const BlockMasks &masks, IndexState &state,
+                       uint32_t offset, std::vector<uint32_t> &positions) {
+  // a byte is escaped by an odd run of backslashes, runs are rare enough to
+  // walk them bit by bit.
+  uint64_t escaped = state.escaped;
+  state.escaped = 0;
+  for (uint64_t backslash = masks.backslash; backslash != 0;
+       backslash &= backslash - 1) {
+    const uint64_t bit = backslash & -backslash;
+    if ((escaped & bit) == 0) {
+      if (bit == uint64_t(1) << 63) {
+        state.escaped = 1;
+      } else {
+        escaped |= bit << 1;
+      }
+    }
+  }
+  const uint64_t quote = masks.quote & ~escaped;
+  // opening quotes and string contents, without closing quotes.
+  const uint64_t inString = prefixXor(quote) ^ state.inString;
+  state.inString = static_cast<uint64_t>(static_cast<int64_t>(inString) >> 63);
+  state.errors |= masks.control & inString;
+
+  const uint64_t op = masks.op & ~inString;
+  const uint64_t ends = op | quote | (masks.whitespace & ~inString);
+  const uint64_t scalar =
+      ~(ends | inString) & ((ends << 1) | state.scalarCarry);
+  state.scalarCarry = ends >> 63;
+
+  for (uint64_t bits = op | quote | scalar; bits != 0; bits &= bits - 1) {
+    positions.push_back(offset + __builtin_ctzll(bits));
+  }
+}
+
+template <typename Classify>
+inline bool indexBlocks(std::string_view json, std::vector<uint32_t> &positions,
+                        Classify classify) {
+  const auto *data = reinterpret_cast<const uint8_t *>(json.data());
+  IndexState state;
+  size_t i = 0;
+  for (; i + BLOCK_SIZE <= json.size(); i += BLOCK_SIZE) {
+    indexBlock(classify(data + i), state, i, positions);
+  }
+  if (i < json.size()) {
+    // pad the last block with whitespace.
+    uint8_t last[BLOCK_SIZE];
+    std::memset(last, ' ', BLOCK_SIZE);
+    std::memcpy(last, data + i, json.size() - i);
+    indexBlock(classify(last), state, i, positions);
+  }
+  return state.inString == 0 && state.errors == 0;
+}
+
+bool indexScalar(std::string_view json, std::vector<uint32_t> &positions) {
+  return indexBlocks(json, positions, classifyScalar);
+}
+
+#ifdef CRAWLER_X86
+__attribute__((target("avx2"))) bool
+indexAvx2(std::string_view json, std::vector<uint32_t> &positions) {
+  return indexBlocks(json, positions, classifyAvx2);
+}
+#endif
+
+/// Length of the prefix of `text` which is written as is in a json string,
+/// checked 8 bytes at a time.
+size_t plainPrefixLength(std::string_view text) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    uint64_t word;
+    std::memcpy(&word, text.data() + i, 8);
+    // bytes below 0x20, equal to '"' or equal to '\\'.
+    const uint64_t quote = word ^ (ones * '"');
+    const uint64_t backslash = word ^ (ones * '\\');
+    const uint64_t special = ((word - ones * 0x20) | (quote - ones) |
+                              (backslash - ones)) &
+                             ~(word & highs) & highs;
+    if (special != 0) {
+      break;
+    }
+  }
+  for (; i < text.size(); i++) {
+    const auto ch = static_cast<unsigned char>(text[i]);
+    if (ch < 0x20 || ch == '"' || ch == '\\') {
+      return i;
+    }
+  }
+  return i;
+}
+
+/// Value of the valid json number `text`.
+double toNumber(std::string_view text) {
+  double number = 0;
+  std::from_chars_result result =
+      std::from_chars(text.data(), text.data() + text.size(), number);
+  if (result.ec == std::errc::result_out_of_range) {
+    // tiny numbers round to zero, huge ones fail.
+    number = std::strtod(std::string(text).c_str(), nullptr);
+    if (std::isinf(number)) {
+      throw std::runtime_error("PARSE_NUMBER_TOO_BIG");
+    }
+  }
+  return number;
+}
+
+inline bool isJsonWhitespace(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+} // namespace
+
+bool crawler::indexStructurals(std::string_view json,
+                               std::vector<uint32_t> &positions) {
+  positions.clear();
+  if (json.size() > UINT32_MAX) {
+    return false;
+  }
+#ifdef CRAWLER_X86
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  if (hasAvx2) {
+    return indexAvx2(json, positions);
+  }
+#endif
+  return indexScalar(json, positions);
+}
+
+const crawler::JsonValue &crawler::JsonParser::parse() {
+  input = json;
+  jsonValue = parseIndexed();
+  return jsonValue;
+}
+
+crawler::JsonValue
+crawler::JsonParser::parse(std::string_view json,
+                           std::pmr::memory_resource *resource) {
+  JsonParser parser(std::string(), resource);
+  parser.input = json;
+  return parser.parseIndexed();
+}
+
+crawler::JsonValue
+crawler::JsonParser::parseWithoutIndex(std::string_view json) {
+  JsonParser parser{std::string()};
+  parser.input = json;
+  return parser.parseDocument();
+}
+
+crawler::JsonValue crawler::JsonParser::parseIndexed() {
+  indexBase = pos;
+  if (indexStructurals(input.substr(pos), structurals)) {
+    try {
+      next = 0;
+      depth = 0;
+      JsonValue value = parseIndexedValue();
+      if (next == structurals.size()) {
+        pos = input.size();
+        return value;
+      }
+    } catch (const std::runtime_error &) {
+    }
+    pos = indexBase;
+  }
+  // invalid text, report its error the way the cursor parser does.
+  return parseDocument();
+}
+
+char crawler::JsonParser::nextStructural() {
+  return next < structurals.size() ? input[indexBase + structurals[next]]
+                                   : '\0';
+}
+
+crawler::JsonValue crawler::JsonParser::parseIndexedValue() {
+  if (next == structurals.size()) {
+    throw std::runtime_error("PARSE_EXPECT_VALUE");
+  }
+  pos = indexBase + structurals[next++];
+  switch (currentChar()) {
+  case '[':
+    return parseIndexedArray();
+  case '{':
+    return parseIndexedObject();
+  case '\"':
+    return JsonValue(JsonType::STRING, parseIndexedString());
+  default: {
+    JsonValue value = parseValue();
+    // numbers and literals end where the next token or whitespace starts.
+    const char ch = currentChar();
+    if (!eof() && !isJsonWhitespace(ch) && ch != ',' && ch != ']' &&
+        ch != '}' && ch != ':' && ch != '[' && ch != '{' && ch != '\"') {
+      throw std::runtime_error("PARSE_INVALID_VALUE");
+    }
+    return value;
+  }
+  }
+}
+
+crawler::JsonString crawler::JsonParser::parseIndexedString() {
+  // stage 1 has checked the closing quote is there.
+  const size_t end = indexBase + structurals[next++];
+  const std::string_view content = input.substr(pos + 1, end - pos - 1);
+  if (content.find('\\') == std::string_view::npos) {
+    pos = end + 1;
+    return JsonString(content, resource);
+  }
+  return parseString();
+}
+
+crawler::JsonValue crawler::JsonParser::parseIndexedArray() {
+  if (++depth > MAX_DEPTH) {
+    throw std::runtime_error("PARSE_TOO_DEEP");
+  }
+  JsonArray array(resource);
+  if (nextStructural() == ']') {
+    next++;
+    depth--;
+    return JsonValue(JsonType::ARRAY, std::move(array));
+  }
+  while (true) {
+    array.push_back(parseIndexedValue());
+    const char ch = nextStructural();
+    next++;
+    if (ch == ']') {
+      depth--;
+      return JsonValue(JsonType::ARRAY, std::move(array));
+    }
+    if (ch != ',') {
+      throw std::runtime_error("PARSE_MISS_COMMA_OR_SQUARE_BRACKET");
+    }
+  }
+}
+
+crawler::JsonValue crawler::JsonParser::parseIndexedObject() {
+  if (++depth > MAX_DEPTH) {
+    throw std::runtime_error("PARSE_TOO_DEEP");
+  }
+  JsonObject object(resource);
+  if (nextStructural() == '}') {
+    next++;
+    depth--;
+    return JsonValue(JsonType::OBJECT, std::move(object));
+  }
+  while (true) {
+    if (nextStructural() != '\"') {
+      throw std::runtime_error("PARSE_OBJECT_MISS_KEY");
+    }
+    pos = indexBase + structurals[next++];
+    JsonString key = parseIndexedString();
+    if (nextStructural() != ':') {
+      throw std::runtime_error("PARSE_OBJECT_MISS_COLON");
+    }
+    next++;
+    object.try_emplace(std::move(key), parseIndexedValue());
+    const char ch = nextStructural();
+    next++;
+    if (ch == '}') {
+      depth--;
+      return JsonValue(JsonType::OBJECT, std::move(object));
+    }
+    if (ch != ',') {
+      throw std::runtime_error("PARSE_MISS_COMMA_OR_CURLY_BRACKET");
+    }
+  }
+}
+
+crawler::JsonValue crawler::JsonParser::parseDocument() {
+  depth = 0;
   parseWhitespace();
-  parseValue();
+  JsonValue value = parseValue();
   parseWhitespace();
   if (!eof()) {
     throw std::runtime_error("PARSE_ROOT_NOT_SINGULAR");
   }
-  return this->jsonValue;
+  return value;
 }
 
 void crawler::JsonParser::parseWhitespace() {
@@ -23,8 +420,10 @@ void crawler::JsonParser::parseWhitespace() {
   }
 }
 
-crawler::JsonParser::JsonParser(std::string json)
-    : jsonValue(JsonType::_NULL), json(std::move(json)), pos(0) {}
+crawler::JsonParser::JsonParser(std::string json,
+                                std::pmr::memory_resource *resource)
+    : json(std::move(json)), pos(0), depth(0), jsonValue(JsonType::_NULL),
+      resource(resource) {}
 
 const std::string &crawler::JsonParser::getJson() const { return json; }
 
@@ -34,55 +433,33 @@ void crawler::JsonParser::setJson(const std::string &_json) {
 
 void crawler::JsonParser::setPos(const size_t _pos) { JsonParser::pos = _pos; }
 
-void crawler::JsonParser::parseTrue() {
-  parseLiteralness(TRUE, JsonType::BOOLEAN);
-  this->jsonValue.setData(true);
-}
-
-void crawler::JsonParser::parseFalse() {
-  parseLiteralness(FALSE, JsonType::BOOLEAN);
-  this->jsonValue.setData(false);
-}
-
-void crawler::JsonParser::parseNull() {
-  parseLiteralness(_NULL, JsonType::_NULL);
-  this->jsonValue.setData(nullptr);
-}
-
-void crawler::JsonParser::parseLiteralness(const std::string &literal,
-                                           crawler::JsonType jsonType) {
-  size_t literalSize = literal.size();
-  std::string compareData = json.substr(pos, literalSize);
-  if (literal != compareData) {
+void crawler::JsonParser::parseLiteralness(std::string_view literal) {
+  if (input.compare(pos, literal.size(), literal) != 0) {
     throw std::runtime_error("PARSE_INVALID_VALUE");
   }
   // move `pos` steps forward
-  pos += literalSize;
-  this->jsonValue.setType(jsonType);
+  pos += literal.size();
 }
 
-void crawler::JsonParser::parseObject() {
-  jsonValue.setType(crawler::JsonType::OBJECT);
-  assert(consumeChar() == '{');
+crawler::JsonValue crawler::JsonParser::parseObject() {
+  assert(currentChar() == '{');
+  pos++;
+  if (++depth > MAX_DEPTH) {
+    throw std::runtime_error("PARSE_TOO_DEEP");
+  }
+  JsonObject object(resource);
   parseWhitespace();
   if (currentChar() == '}') {
     pos++;
-    JsonObject emptyValue;
-    jsonValue.setData(emptyValue);
-    return;
+    depth--;
+    return JsonValue(JsonType::OBJECT, std::move(object));
   }
   while (true) {
-
     // 1. parse key
     if (currentChar() != '\"') {
       throw std::runtime_error("PARSE_OBJECT_MISS_KEY");
     }
-
-    std::string copyData = json.substr(pos, json.length() - pos);
-    JsonParser copyDataParser(copyData);
-    copyDataParser.parseString();
-    std::string key = copyDataParser.getJsonValue().getString();
-    pos = copyDataParser.getPos() + pos;
+    JsonString key = parseString();
 
     // 2. parse whitespace colon whitespace
     parseWhitespace();
@@ -91,20 +468,8 @@ void crawler::JsonParser::parseObject() {
     }
     parseWhitespace();
 
-    // 3. parse jsonvalue.
-    copyData = json.substr(pos, json.length() - pos);
-    copyDataParser.setJson(copyData);
-    copyDataParser.setPos(0);
-    copyDataParser.parseValue();
-    copyDataParser.parseWhitespace();
-    if (getJsonValue().isEmptyValue()) {
-      JsonObject emptyValue;
-      jsonValue.setData(emptyValue);
-    }
-    JsonObject object = getJsonValue().getObject();
-    object.insert(
-        std::pair<std::string, JsonValue>(key, copyDataParser.getJsonValue()));
-    pos = copyDataParser.getPos() + pos;
+    // 3. parse jsonvalue, the first of duplicate keys is kept.
+    object.try_emplace(std::move(key), parseValue());
 
     // 4. parse whitespace [comma | right-curly-brace] whitespace
     parseWhitespace();
@@ -113,63 +478,162 @@ void crawler::JsonParser::parseObject() {
       parseWhitespace();
     } else if (currentChar() == '}') {
       pos++;
-      jsonValue.setData(object);
-      break;
+      depth--;
+      return JsonValue(JsonType::OBJECT, std::move(object));
     } else {
       throw std::runtime_error("PARSE_MISS_COMMA_OR_CURLY_BRACKET");
     }
   }
 }
-void crawler::JsonParser::parseArray() {
-  jsonValue.setType(crawler::JsonType::ARRAY);
-  assert(consumeChar() == '[');
+
+crawler::JsonValue crawler::JsonParser::parseArray() {
+  assert(currentChar() == '[');
+  pos++;
+  if (++depth > MAX_DEPTH) {
+    throw std::runtime_error("PARSE_TOO_DEEP");
+  }
+  JsonArray array(resource);
   parseWhitespace();
 
   // empty array
   if (currentChar() == ']') {
     pos++;
-    JsonArray emptyValue;
-    jsonValue.setData(emptyValue);
-    return;
+    depth--;
+    return JsonValue(JsonType::ARRAY, std::move(array));
   }
 
   // parse value.
   while (true) {
-    std::string copyData = json.substr(pos, json.length() - pos);
-    JsonParser copyDataParser(copyData);
-    copyDataParser.parseWhitespace();
-    copyDataParser.parseValue();
-    copyDataParser.parseWhitespace();
-    if (getJsonValue().isEmptyValue()) {
-      JsonArray emptyValue;
-      jsonValue.setData(emptyValue);
-    }
-    JsonArray array = getJsonValue().getArray();
-    array.emplace_back(copyDataParser.getJsonValue());
-    jsonValue.setData(array);
-    pos = copyDataParser.getPos() + pos;
+    array.push_back(parseValue());
+    parseWhitespace();
     if (currentChar() == ',') {
       pos++;
       parseWhitespace();
     } else if (currentChar() == ']') {
       pos++;
-      break;
+      depth--;
+      return JsonValue(JsonType::ARRAY, std::move(array));
+    } else {
+      throw std::runtime_error("PARSE_MISS_COMMA_OR_SQUARE_BRACKET");
     }
   }
 }
 
-void crawler::JsonParser::parseString() {
+void crawler::JsonParser::parseTapeValue(std::vector<TapeEntry> &tape) {
+  if (next == structurals.size()) {
+    throw std::runtime_error("PARSE_EXPECT_VALUE");
+  }
+  pos = indexBase + structurals[next++];
+  const auto offset = static_cast<uint32_t>(pos);
+  const char ch = currentChar();
+  if (ch == '\"') {
+    return parseTapeString(tape);
+  }
+  if (ch != '[' && ch != '{') {
+    // only checked, numbers are converted when they are read.
+    JsonType type = JsonType::NUMBER;
+    if (ch == '-' || isDigit(ch)) {
+      skipNumber();
+      // only a number with an exponent or hundreds of digits can overflow.
+      const std::string_view number = input.substr(offset, pos - offset);
+      if (number.size() > 308 ||
+          number.find_first_of("eE") != std::string_view::npos) {
+        (void)toNumber(number);
+      }
+    } else {
+      type = parseValue().getType();
+    }
+    // numbers and literals end where the next token or whitespace starts.
+    if (!eof() && !isJsonWhitespace(currentChar()) &&
+        std::string_view(",]}:[{\"").find(currentChar()) ==
+            std::string_view::npos) {
+      throw std::runtime_error("PARSE_INVALID_VALUE");
+    }
+    const auto length = static_cast<uint32_t>(pos - offset);
+    const auto after = static_cast<uint32_t>(tape.size() + 1);
+    tape.push_back(TapeEntry{type, false, offset, length, after});
+    return;
+  }
+
+  if (++depth > MAX_DEPTH) {
+    throw std::runtime_error("PARSE_TOO_DEEP");
+  }
+  const bool object = ch == '{';
+  const char close = object ? '}' : ']';
+  const size_t index = tape.size();
+  tape.push_back(TapeEntry{object ? JsonType::OBJECT : JsonType::ARRAY, false,
+                           offset, 0, 0});
+  uint32_t count = 0;
+  if (nextStructural() == close) {
+    next++;
+  } else {
+    while (true) {
+      if (object) {
+        if (nextStructural() != '\"') {
+          throw std::runtime_error("PARSE_OBJECT_MISS_KEY");
+        }
+        pos = indexBase + structurals[next++];
+        parseTapeString(tape);
+        if (nextStructural() != ':') {
+          throw std::runtime_error("PARSE_OBJECT_MISS_COLON");
+        }
+        next++;
+      }
+      parseTapeValue(tape);
+      count++;
+      const char separator = nextStructural();
+      next++;
+      if (separator == close) {
+        break;
+      }
+      if (separator != ',') {
+        throw std::runtime_error(object ? "PARSE_MISS_COMMA_OR_CURLY_BRACKET"
+                                        : "PARSE_MISS_COMMA_OR_SQUARE_BRACKET");
+      }
+    }
+  }
+  depth--;
+  tape[index].length = count;
+  tape[index].next = static_cast<uint32_t>(tape.size());
+}
+
+void crawler::JsonParser::parseTapeString(std::vector<TapeEntry> &tape) {
+  const size_t begin = pos + 1;
+  const size_t end = indexBase + structurals[next++];
+  const bool escaped =
+      input.substr(begin, end - begin).find('\\') != std::string_view::npos;
+  if (escaped) {
+    // check the escape sequences, they are undone when the string is read.
+    parseString();
+  }
+  tape.push_back(TapeEntry{JsonType::STRING, escaped,
+                           static_cast<uint32_t>(begin),
+                           static_cast<uint32_t>(end - begin),
+                           static_cast<uint32_t>(tape.size() + 1)});
+  pos = end + 1;
+}
+
+crawler::JsonString crawler::JsonParser::parseString() {
   // beginning quotation mark.
-  assert(consumeChar() == '\"');
-  std::string buffer;
+  assert(currentChar() == '\"');
+  pos++;
+  JsonString buffer(resource);
   while (true) {
+    // copy the run of unescaped chars at once.
+    size_t begin = pos;
+    while (pos < input.size() && input[pos] != '\"' && input[pos] != '\\' &&
+           static_cast<unsigned char>(input[pos]) >= 0x20) {
+      pos++;
+    }
+    buffer.append(input, begin, pos - begin);
+    if (eof()) {
+      throw std::runtime_error("PARSE_MISS_QUOTATION_MARK");
+    }
     char ch = consumeChar();
     switch (ch) {
       // ending quotation mark
     case '\"':
-      jsonValue.setData(buffer);
-      jsonValue.setType(crawler::JsonType::STRING);
-      return;
+      return buffer;
       /* handle escape char */
     case '\\':
       switch (consumeChar()) {
@@ -197,85 +661,118 @@ void crawler::JsonParser::parseString() {
       case 't':
         buffer += '\t';
         break;
+      case 'u': {
+        char32_t codePoint = parseHex4();
+        // a high surrogate has to be followed by a low one.
+        if (codePoint >= 0xD800 && codePoint <= 0xDBFF) {
+          if (consumeChar() != '\\' || consumeChar() != 'u') {
+            throw std::runtime_error("PARSE_INVALID_UNICODE_SURROGATE");
+          }
+          char32_t low = parseHex4();
+          if (low < 0xDC00 || low > 0xDFFF) {
+            throw std::runtime_error("PARSE_INVALID_UNICODE_SURROGATE");
+          }
+          codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+        } else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF) {
+          throw std::runtime_error("PARSE_INVALID_UNICODE_SURROGATE");
+        }
+        appendUtf8(buffer, codePoint);
+        break;
+      }
       default:
         throw std::runtime_error("PARSE_INVALID_STRING_ESCAPE");
       }
       break;
-    case '\0':
-      throw std::runtime_error("PARSE_MISS_QUOTATION_MARK");
     default:
       // handle illegal unescaped char
-      if ((unsigned char)ch < 0x20) {
-        throw std::runtime_error("PARSE_INVALID_STRING_CHAR");
-      }
-      buffer += ch;
+      throw std::runtime_error("PARSE_INVALID_STRING_CHAR");
     }
   }
 }
 
-void crawler::JsonParser::parseNumber() {
-  const char *data = json.c_str();
-  size_t copyPos = pos;
+char32_t crawler::JsonParser::parseHex4() {
+  char32_t codePoint = 0;
+  for (int i = 0; i < 4; i++) {
+    char ch = consumeChar();
+    codePoint <<= 4;
+    if (ch >= '0' && ch <= '9') {
+      codePoint |= ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+      codePoint |= ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+      codePoint |= ch - 'A' + 10;
+    } else {
+      throw std::runtime_error("PARSE_INVALID_UNICODE_HEX");
+    }
+  }
+  return codePoint;
+}
+
+crawler::JsonValue crawler::JsonParser::parseNumber() {
+  const size_t begin = pos;
+  skipNumber();
+  return JsonValue(JsonType::NUMBER,
+                   toNumber(input.substr(begin, pos - begin)));
+}
+
+void crawler::JsonParser::skipNumber() {
   // negative: -
-  if (data[copyPos] == '-') {
-    copyPos++;
+  if (currentChar() == '-') {
+    pos++;
   }
   // int: "0" / digit1-9 *digit
-  if (data[copyPos] == '0') {
-    copyPos++;
+  if (currentChar() == '0') {
+    pos++;
   } else {
-    if (!isDigit1To9(data[copyPos])) {
+    if (!isDigit1To9(currentChar())) {
       throw std::runtime_error("PARSE_INVALID_VALUE");
     }
-    for (copyPos++; isdigit(data[copyPos]); copyPos++)
+    for (pos++; isDigit(currentChar()); pos++)
       ;
   }
 
   // frac: "." 1*digit
-  if (data[copyPos] == '.') {
-    copyPos++;
-    if (!isdigit(data[copyPos])) {
+  if (currentChar() == '.') {
+    pos++;
+    if (!isDigit(currentChar())) {
       throw std::runtime_error("PARSE_INVALID_VALUE");
     }
-    for (copyPos++; isdigit(data[copyPos]); copyPos++)
+    for (pos++; isDigit(currentChar()); pos++)
       ;
   }
 
   // exp
-  if (data[copyPos] == 'e' || data[copyPos] == 'E') {
-    copyPos++;
-    if (data[copyPos] == '+' || data[copyPos] == '-') {
-      copyPos++;
+  if (currentChar() == 'e' || currentChar() == 'E') {
+    pos++;
+    if (currentChar() == '+' || currentChar() == '-') {
+      pos++;
     }
-    if (!isdigit(data[copyPos])) {
+    if (!isDigit(currentChar())) {
       throw std::runtime_error("PARSE_INVALID_VALUE");
     }
-    for (copyPos++; isdigit(data[copyPos]); copyPos++)
+    for (pos++; isDigit(currentChar()); pos++)
       ;
   }
 
-  const char *numberStr = json.substr(pos, copyPos - pos).c_str();
-  double number = strtod(numberStr, NULL);
-  // if endPtr points end of the string.
-  pos += copyPos;
-  this->jsonValue.setData(number);
-  this->jsonValue.setType(JsonType::NUMBER);
 }
 
-void crawler::JsonParser::parseValue() {
+crawler::JsonValue crawler::JsonParser::parseValue() {
   switch (currentChar()) {
   case 'n':
-    return parseNull();
+    parseLiteralness(_NULL);
+    return JsonValue(JsonType::_NULL);
   case 't':
-    return parseTrue();
+    parseLiteralness(TRUE);
+    return JsonValue(JsonType::BOOLEAN, true);
   case 'f':
-    return parseFalse();
+    parseLiteralness(FALSE);
+    return JsonValue(JsonType::BOOLEAN, false);
   case '0' ... '9':
     return parseNumber();
   case '-':
     return parseNumber();
   case '\"':
-    return parseString();
+    return JsonValue(JsonType::STRING, parseString());
   case '[':
     return parseArray();
   case '{':
@@ -287,24 +784,38 @@ void crawler::JsonParser::parseValue() {
   }
 }
 
-char crawler::JsonParser::currentChar() { return json.c_str()[pos]; }
+char crawler::JsonParser::currentChar() {
+  return pos < input.size() ? input[pos] : '\0';
+}
 
-char crawler::JsonParser::consumeChar() { return json.c_str()[pos++]; }
+char crawler::JsonParser::consumeChar() {
+  char ch = currentChar();
+  pos++;
+  return ch;
+}
 
 size_t crawler::JsonParser::getPos() const { return pos; }
 
-crawler::JsonValue crawler::JsonParser::getJsonValue() const {
+const crawler::JsonValue &crawler::JsonParser::getJsonValue() const {
   return jsonValue;
 }
 
-bool crawler::JsonParser::eof() { return pos >= json.size(); }
-std::string crawler::JsonParser::remainingData() {
-  return json.substr(pos, json.size() - pos);
+crawler::JsonValue crawler::JsonParser::takeJsonValue() {
+  JsonValue value = std::move(jsonValue);
+  jsonValue = JsonValue(JsonType::_NULL);
+  return value;
 }
+
+bool crawler::JsonParser::eof() { return pos >= input.size(); }
+
 bool crawler::JsonParser::isDigit1To9(char digit) {
   return digit >= '1' && digit <= '9';
 }
 
+bool crawler::JsonParser::isDigit(char digit) {
+  return digit >= '0' && digit <= '9';
+}
+
 crawler::JsonType crawler::JsonValue::getType() const { return type; }
 
 crawler::JsonValue::JsonValue(crawler::JsonType type)
@@ -313,51 +824,499 @@ void crawler::JsonValue::setType(crawler::JsonType _type) {
   JsonValue::type = _type;
 }
 crawler::JsonValue::JsonValue(crawler::JsonType _jsonType,
-                              crawler::JsonData _jsonData) {
-  JsonValue::data = _jsonData;
-  JsonValue::type = _jsonType;
-}
+                              crawler::JsonData _jsonData)
+    : data(std::move(_jsonData)), type(_jsonType) {}
 
-double crawler::JsonValue::getNumber() {
+double crawler::JsonValue::getNumber() const {
   assert(type == JsonType::NUMBER);
   return std::get<double>(data);
 }
 
-std::string crawler::JsonValue::getString() {
+const crawler::JsonString &crawler::JsonValue::getString() const {
+  assert(type == JsonType::STRING);
+  return std::get<crawler::JsonString>(data);
+}
+
+crawler::JsonString &crawler::JsonValue::getString() {
   assert(type == JsonType::STRING);
-  return std::get<std::string>(data);
+  return std::get<crawler::JsonString>(data);
 }
 
-bool crawler::JsonValue::getBoolean() {
+bool crawler::JsonValue::getBoolean() const {
   assert(type == JsonType::BOOLEAN);
   return std::get<bool>(data);
 }
 
-std::nullptr_t crawler::JsonValue::getNull() {
+std::nullptr_t crawler::JsonValue::getNull() const {
   assert(type == JsonType::_NULL);
   return std::get<std::nullptr_t>(data);
 }
 
-crawler::JsonArray crawler::JsonValue::getArray() {
+const crawler::JsonArray &crawler::JsonValue::getArray() const {
+  assert(type == JsonType::ARRAY);
+  return std::get<crawler::JsonArray>(data);
+}
+
+crawler::JsonArray &crawler::JsonValue::getArray() {
   assert(type == JsonType::ARRAY);
   return std::get<crawler::JsonArray>(data);
 }
 
-crawler::JsonObject crawler::JsonValue::getObject() {
+const crawler::JsonObject &crawler::JsonValue::getObject() const {
   assert(type == JsonType::OBJECT);
   return std::get<crawler::JsonObject>(data);
 }
 
-bool crawler::JsonValue::isEmptyValue() {
-  try {
-    std::get<std::nullptr_t>(data);
-    // if doesn't throw exception, return true.
-    return true;
-  } catch (const std::bad_variant_access &) {
-    return false;
-  }
+crawler::JsonObject &crawler::JsonValue::getObject() {
+  assert(type == JsonType::OBJECT);
+  return std::get<crawler::JsonObject>(data);
+}
+
+bool crawler::JsonValue::isEmptyValue() const {
+  return std::holds_alternative<std::nullptr_t>(data);
 }
 
 void crawler::JsonValue::setData(const crawler::JsonData &_data) {
   JsonValue::data = _data;
 }
+
+void crawler::JsonValue::setData(crawler::JsonData &&_data) {
+  JsonValue::data = std::move(_data);
+}
+
+crawler::JsonWriter::JsonWriter(int fd, size_t flushSize)
+    : fd(fd), flushSize(flushSize) {}
+
+crawler::JsonWriter::~JsonWriter() {
+  try {
+    flush();
+  } catch (const std::system_error &) {
+  }
+}
+
+void crawler::JsonWriter::beginValue() {
+  if (containers.empty()) {
+    if (topLevelWritten) {
+      buffer += '\n';
+    }
+    topLevelWritten = true;
+    return;
+  }
+  Container &container = containers.back();
+  if (container.object) {
+    if (!afterKey) {
+      throw std::runtime_error("JsonWriter: value without a key");
+    }
+    afterKey = false;
+    return;
+  }
+  if (!container.empty) {
+    buffer += ',';
+  }
+  container.empty = false;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::beginObject() {
+  beginValue();
+  buffer += '{';
+  containers.push_back(Container{true, true});
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::endObject() {
+  if (containers.empty() || !containers.back().object || afterKey) {
+    throw std::runtime_error("JsonWriter: no object to end");
+  }
+  containers.pop_back();
+  buffer += '}';
+  flushIfFull();
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::beginArray() {
+  beginValue();
+  buffer += '[';
+  containers.push_back(Container{false, true});
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::endArray() {
+  if (containers.empty() || containers.back().object) {
+    throw std::runtime_error("JsonWriter: no array to end");
+  }
+  containers.pop_back();
+  buffer += ']';
+  flushIfFull();
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::key(std::string_view name) {
+  if (containers.empty() || !containers.back().object || afterKey) {
+    throw std::runtime_error("JsonWriter: key outside of an object");
+  }
+  Container &container = containers.back();
+  if (!container.empty) {
+    buffer += ',';
+  }
+  container.empty = false;
+  writeString(name);
+  buffer += ':';
+  afterKey = true;
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(std::string_view text) {
+  beginValue();
+  writeString(text);
+  flushIfFull();
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(const char *text) {
+  return value(std::string_view(text));
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(double number) {
+  if (std::isnan(number) || std::isinf(number)) {
+    return value(nullptr);
+  }
+  char digits[32];
+  std::to_chars_result result =
+      std::to_chars(digits, digits + sizeof(digits), number);
+  return writeScalar(std::string_view(digits, result.ptr - digits));
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(bool boolean) {
+  return writeScalar(boolean ? "true" : "false");
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(std::nullptr_t) {
+  return writeScalar("null");
+}
+
+crawler::JsonWriter &crawler::JsonWriter::value(const JsonValue &json) {
+  switch (json.getType()) {
+  case JsonType::_NULL:
+    return value(nullptr);
+  case JsonType::BOOLEAN:
+    return value(json.getBoolean());
+  case JsonType::NUMBER:
+    return value(json.getNumber());
+  case JsonType::STRING:
+    return value(std::string_view(json.getString()));
+  case JsonType::ARRAY:
+    beginArray();
+    for (const JsonValue &element : json.getArray()) {
+      value(element);
+    }
+    return endArray();
+  case JsonType::OBJECT:
+    beginObject();
+    for (const auto &[name, member] : json.getObject()) {
+      key(name);
+      value(member);
+    }
+    return endObject();
+  }
+  return *this;
+}
+
+crawler::JsonWriter &crawler::JsonWriter::writeScalar(std::string_view text) {
+  beginValue();
+  buffer += text;
+  flushIfFull();
+  return *this;
+}
+
+void crawler::JsonWriter::writeString(std::string_view text) {
+  static const char HEX[] = "0123456789abcdef";
+  buffer += '"';
+  while (!text.empty()) {
+    // copy the run which needs no escaping at once.
+    const size_t length = plainPrefixLength(text);
+    buffer.append(text.data(), length);
+    if (length == text.size()) {
+      break;
+    }
+    const auto ch = static_cast<unsigned char>(text[length]);
+    switch (ch) {
+    case '"':
+      buffer += "\\\"";
+      break;
+    case '\\':
+      buffer += "\\\\";
+      break;
+    case '\b':
+      buffer += "\\b";
+      break;
+    case '\f':
+      buffer += "\\f";
+      break;
+    case '\n':
+      buffer += "\\n";
+      break;
+    case '\r':
+      buffer += "\\r";
+      break;
+    case '\t':
+      buffer += "\\t";
+      break;
+    default:
+      buffer += "\\u00";
+      buffer += HEX[ch >> 4];
+      buffer += HEX[ch & 0xF];
+    }
+    text.remove_prefix(length + 1);
+  }
+  buffer += '"';
+}
+
+void crawler::JsonWriter::flushIfFull() {
+  if (buffer.size() >= flushSize && fd >= 0) {
+    flush();
+  }
+}
+
+void crawler::JsonWriter::flush() {
+  if (fd < 0) {
+    return;
+  }
+  size_t written = 0;
+  while (written < buffer.size()) {
+    const ssize_t result =
+        ::write(fd, buffer.data() + written, buffer.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // keep what is left, so a retry doesn't lose it.
+      buffer.erase(0, written);
+      throw std::system_error(errno, std::generic_category(), "write");
+    }
+    written += static_cast<size_t>(result);
+  }
+  buffer.clear();
+}
+
+std::string_view crawler::JsonWriter::getBuffer() const { return buffer; }
+
+void crawler::JsonWriter::clearBuffer() { buffer.clear(); }
+
+std::string crawler::JsonWriter::stringify(const JsonValue &json) {
+  JsonWriter writer;
+  writer.value(json);
+  return std::move(writer.buffer);
+}
+
+crawler::JsonElement::JsonElement(const JsonTape *tape, uint32_t index)
+    : tape(tape), index(index) {}
+
+const crawler::TapeEntry &crawler::JsonElement::entry() const {
+  return tape->entries[index];
+}
+
+crawler::JsonType crawler::JsonElement::getType() const {
+  return entry().type;
+}
+
+double crawler::JsonElement::getNumber() const {
+  assert(entry().type == JsonType::NUMBER);
+  return toNumber(tape->text.substr(entry().offset, entry().length));
+}
+
+bool crawler::JsonElement::getBoolean() const {
+  assert(entry().type == JsonType::BOOLEAN);
+  // "true" or "false".
+  return entry().length == 4;
+}
+
+bool crawler::JsonElement::isNull() const {
+  return entry().type == JsonType::_NULL;
+}
+
+std::string crawler::JsonElement::getString() const {
+  assert(entry().type == JsonType::STRING);
+  if (!entry().escaped) {
+    return std::string(getRawString());
+  }
+  return std::string(readString(std::pmr::get_default_resource()));
+}
+
+crawler::JsonString
+crawler::JsonElement::readString(std::pmr::memory_resource *resource) const {
+  assert(entry().type == JsonType::STRING);
+  if (!entry().escaped) {
+    return JsonString(getRawString(), resource);
+  }
+  JsonParser parser(std::string(), resource);
+  parser.input = tape->text;
+  parser.pos = entry().offset - 1;
+  return parser.parseString();
+}
+
+std::string_view crawler::JsonElement::getRawString() const {
+  assert(entry().type == JsonType::STRING);
+  return tape->text.substr(entry().offset, entry().length);
+}
+
+size_t crawler::JsonElement::size() const {
+  assert(entry().type == JsonType::ARRAY || entry().type == JsonType::OBJECT);
+  return entry().length;
+}
+
+crawler::JsonElement crawler::JsonElement::operator[](size_t position) const {
+  assert(entry().type == JsonType::ARRAY);
+  if (position >= entry().length) {
+    throw std::out_of_range("No such element: " + std::to_string(position));
+  }
+  uint32_t element = index + 1;
+  for (; position > 0; position--) {
+    element = tape->entries[element].next;
+  }
+  return JsonElement(tape, element);
+}
+
+crawler::JsonElement
+crawler::JsonElement::operator[](std::string_view key) const {
+  std::optional<JsonElement> value = find(key);
+  if (!value) {
+    throw std::out_of_range("No such key: " + std::string(key));
+  }
+  return *value;
+}
+
+std::optional<crawler::JsonElement>
+crawler::JsonElement::find(std::string_view key) const {
+  assert(entry().type == JsonType::OBJECT);
+  for (Iterator member = begin(); member != end(); ++member) {
+    const JsonElement name(tape, member.keyIndex());
+    // keys are compared as written, unless they hold an escape sequence.
+    if (name.entry().escaped ? name.getString() == key
+                             : name.getRawString() == key) {
+      return *member;
+    }
+  }
+  return std::nullopt;
+}
+
+crawler::JsonElement::Iterator crawler::JsonElement::begin() const {
+  return Iterator(tape, index + 1, entry().type == JsonType::OBJECT);
+}
+
+crawler::JsonElement::Iterator crawler::JsonElement::end() const {
+  return Iterator(tape, entry().next, entry().type == JsonType::OBJECT);
+}
+
+crawler::JsonValue
+crawler::JsonElement::materialize(std::pmr::memory_resource *resource) const {
+  switch (entry().type) {
+  case JsonType::_NULL:
+    return JsonValue(JsonType::_NULL);
+  case JsonType::BOOLEAN:
+    return JsonValue(JsonType::BOOLEAN, getBoolean());
+  case JsonType::NUMBER:
+    return JsonValue(JsonType::NUMBER, getNumber());
+  case JsonType::STRING:
+    return JsonValue(JsonType::STRING, readString(resource));
+  case JsonType::ARRAY: {
+    JsonArray array(resource);
+    array.reserve(entry().length);
+    for (Iterator element = begin(); element != end(); ++element) {
+      array.push_back((*element).materialize(resource));
+    }
+    return JsonValue(JsonType::ARRAY, std::move(array));
+  }
+  case JsonType::OBJECT: {
+    JsonObject object(resource);
+    for (Iterator member = begin(); member != end(); ++member) {
+      const JsonElement name(tape, member.keyIndex());
+      object.try_emplace(name.readString(resource),
+                         (*member).materialize(resource));
+    }
+    return JsonValue(JsonType::OBJECT, std::move(object));
+  }
+  }
+  return JsonValue(JsonType::_NULL);
+}
+
+crawler::JsonElement::Iterator::Iterator(const JsonTape *tape, uint32_t index,
+                                         bool object)
+    : tape(tape), index(index), object(object) {}
+
+uint32_t crawler::JsonElement::Iterator::keyIndex() const {
+  assert(object);
+  return index;
+}
+
+crawler::JsonElement crawler::JsonElement::Iterator::operator*() const {
+  // the value of a member follows its key.
+  return JsonElement(tape, object ? index + 1 : index);
+}
+
+std::string crawler::JsonElement::Iterator::key() const {
+  return JsonElement(tape, keyIndex()).getString();
+}
+
+crawler::JsonElement::Iterator &crawler::JsonElement::Iterator::operator++() {
+  index = tape->entries[object ? index + 1 : index].next;
+  return *this;
+}
+
+bool crawler::JsonElement::Iterator::operator!=(const Iterator &other) const {
+  return index != other.index;
+}
+
+crawler::JsonDocument::JsonDocument(std::string json)
+    : tape(std::make_unique<JsonTape>()) {
+  tape->owned = std::move(json);
+  tape->text = tape->owned;
+  parse();
+}
+
+crawler::JsonDocument crawler::JsonDocument::view(std::string_view json) {
+  JsonDocument document;
+  document.tape = std::make_unique<JsonTape>();
+  document.tape->text = json;
+  document.parse();
+  return document;
+}
+
+void crawler::JsonDocument::parse() {
+  // tape entries hold 32 bit offsets.
+  if (tape->text.size() > UINT32_MAX) {
+    throw std::runtime_error("PARSE_TOO_LARGE");
+  }
+  JsonParser parser{std::string()};
+  parser.input = tape->text;
+  parser.indexBase = 0;
+  std::exception_ptr error;
+  if (indexStructurals(tape->text, parser.structurals)) {
+    try {
+      parser.next = 0;
+      parser.depth = 0;
+      // a value has at least one structural position.
+      tape->entries.reserve(parser.structurals.size());
+      parser.parseTapeValue(tape->entries);
+      if (parser.next == parser.structurals.size()) {
+        return;
+      }
+      error = std::make_exception_ptr(
+          std::runtime_error("PARSE_ROOT_NOT_SINGULAR"));
+    } catch (const std::runtime_error &) {
+      error = std::current_exception();
+    }
+  } else {
+    error = std::make_exception_ptr(
+        std::runtime_error("PARSE_MISS_QUOTATION_MARK"));
+  }
+  // invalid text, report its error the way the cursor parser does.
+  parser.pos = 0;
+  parser.parseDocument();
+  std::rethrow_exception(error);
+}
+
+crawler::JsonElement crawler::JsonDocument::root() const {
+  return JsonElement(tape.get(), 0);
+}
+
+size_t crawler::JsonDocument::tapeSize() const { return tape->entries.size(); }
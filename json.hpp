@@ -2,15 +2,23 @@
 #define JOSN_HPP_H__
 #include "strings.hpp"
 #include <cassert>
+#include <charconv>
 #include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
 namespace crawler {
 class JsonValue;
+struct TapeEntry;
 enum class JsonType { _NULL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
 enum class ParseResult {
   PARSE_OK,
@@ -23,9 +31,13 @@ private:
   std::string jsonStr;
 };
 
-using JsonArray = std::vector<JsonValue>;
-using JsonObject = std::map<std::string, JsonValue>;
-using JsonData = std::variant<double, bool, std::nullptr_t, std::string,
+/// Strings and containers of json values take a `std::pmr::memory_resource`,
+/// so a whole document can be allocated from one arena, eg a
+/// `std::pmr::monotonic_buffer_resource` given to `JsonParser`.
+using JsonString = std::pmr::string;
+using JsonArray = std::pmr::vector<JsonValue>;
+using JsonObject = std::pmr::map<JsonString, JsonValue, std::less<>>;
+using JsonData = std::variant<double, bool, std::nullptr_t, JsonString,
                               JsonArray, JsonObject>;
 
 class JsonValue {
@@ -38,19 +50,25 @@ public:
 
   void setType(JsonType _type);
 
-  double getNumber();
+  [[nodiscard]] double getNumber() const;
 
-  std::string getString();
+  [[nodiscard]] const JsonString &getString() const;
 
-  bool getBoolean();
+  JsonString &getString();
 
-  std::nullptr_t getNull();
+  [[nodiscard]] bool getBoolean() const;
 
-  JsonArray getArray();
+  [[nodiscard]] std::nullptr_t getNull() const;
 
-  JsonObject getObject();
+  [[nodiscard]] const JsonArray &getArray() const;
 
-  bool isEmptyValue();
+  JsonArray &getArray();
+
+  [[nodiscard]] const JsonObject &getObject() const;
+
+  JsonObject &getObject();
+
+  [[nodiscard]] bool isEmptyValue() const;
 
 private:
   JsonData data;
@@ -58,16 +76,42 @@ private:
 public:
   void setData(const JsonData &_data);
 
+  /// Move `_data` in, eg a container built by the caller.
+  void setData(JsonData &&_data);
+
 private:
   JsonType type;
 };
 
+/// Stage 1 of the parser: the positions of the structural characters of
+/// `json`, eg `{}[]:,`, the quotes around strings and the first character of
+/// numbers and literals, classified 64 bytes at a time with AVX2 when the cpu
+/// supports it. Return false if a string isn't closed or holds a control
+/// character.
+bool indexStructurals(std::string_view json, std::vector<uint32_t> &positions);
+
+/// Recursive descent parser, values are built in place and moved into their
+/// containers, so parsing is linear in the length of the text. `parse` jumps
+/// over the structural index of the text, invalid text is parsed again with
+/// a single cursor to report the error.
 class JsonParser {
 public:
-  explicit JsonParser(std::string json);
+  /// Strings and containers of the parsed value are allocated from
+  /// `resource`.
+  explicit JsonParser(
+      std::string json,
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
-  // Parse string to JsonValue
-  JsonValue parse();
+  // Parse string to JsonValue, kept by the parser as `getJsonValue()`.
+  const JsonValue &parse();
+
+  /// Parse `json` without copying it, `json` has to outlive the call only.
+  static JsonValue
+  parse(std::string_view json,
+        std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+  /// Parse `json` with a single cursor, without the structural index.
+  static JsonValue parseWithoutIndex(std::string_view json);
 
   void setJson(const std::string &_json);
 
@@ -77,26 +121,53 @@ public:
 
   [[nodiscard]] size_t getPos() const;
 
-  [[nodiscard]] JsonValue getJsonValue() const;
+  [[nodiscard]] const JsonValue &getJsonValue() const;
+
+  /// Move the parsed value out of the parser.
+  JsonValue takeJsonValue();
+
+  /// Limit of nested arrays and objects, deeper text fails the parse with
+  /// "PARSE_TOO_DEEP" instead of overflowing the stack.
+  inline static const size_t MAX_DEPTH = 512;
 
 private:
+  /// Parse the whole `input` from `pos`, it must hold a single value.
+  JsonValue parseDocument();
+
+  /// Parse the whole `input` from `pos` over its structural index.
+  JsonValue parseIndexed();
+
+  /// Parse the value at the next structural position.
+  JsonValue parseIndexedValue();
+
+  /// Parse the string starting at `pos`, which ends at the next structural
+  /// position.
+  JsonString parseIndexedString();
+
+  JsonValue parseIndexedArray();
+
+  JsonValue parseIndexedObject();
+
+  /// Character at the next structural position, '\0' past the last one.
+  char nextStructural();
+
+  /// Append the entries of the value at the next structural position.
+  void parseTapeValue(std::vector<TapeEntry> &tape);
+
+  /// Append the entry of the string starting at `pos`.
+  void parseTapeString(std::vector<TapeEntry> &tape);
+
+  friend class JsonDocument;
+  friend class JsonElement;
+
   /// Parse value
-  void parseValue();
+  JsonValue parseValue();
 
   /// Whitespace ws = *(%x20 / %x09 / %x0A / %x0D)
   void parseWhitespace();
 
-  /// null = "null"
-  void parseNull();
-
-  /// Parse "true"
-  void parseTrue();
-
   /// parse literalness, such as `true`, `false`, `null`.
-  void parseLiteralness(const std::string &literal, JsonType jsonType);
-
-  /// Parse "false"
-  void parseFalse();
+  void parseLiteralness(std::string_view literal);
 
   /// Parse number
   /// number format:
@@ -104,7 +175,10 @@ private:
   /// int = "0" / digit1-9 *digit
   /// frac = "." 1*digit
   /// exp = ("e" / "E") ["-" / "+"] 1*digit
-  void parseNumber();
+  JsonValue parseNumber();
+
+  /// Check the number at `pos` and move past it.
+  void skipNumber();
 
   /// Parse string
   // string format:
@@ -123,18 +197,21 @@ private:
   // escape = %x5C          ; \
 // quotation-mark = %x22  ; "
   // unescaped = %x20-21 / %x23-5B / %x5D-10FFFF
-  void parseString();
+  JsonString parseString();
+
+  /// Parse the 4 hex digits of an \uXXXX escape.
+  char32_t parseHex4();
 
   /// Parse Array, the array format:
   /// array = %x5B ws [ value *( ws %x2C ws value ) ] ws %x5D
-  void parseArray();
+  JsonValue parseArray();
 
   /// Paser object, the object format:
   /// member = string ws %x3A ws value
   /// object = %x7B ws [ member *( ws %x2C ws member ) ] ws %x7D
-  void parseObject();
+  JsonValue parseObject();
 
-  /// Return current Char
+  /// Return current Char, '\0' at the end of the input.
   char currentChar();
 
   /// Return current char, and then move one step forward.
@@ -146,19 +223,266 @@ private:
   /// num >=1 and num <= 9
   bool isDigit1To9(char digit);
 
-  std::string remainingData();
+  /// num >=0 and num <= 9
+  bool isDigit(char digit);
 
   std::string json;
 
+  /// Text being parsed, either `json` or the argument of the static `parse`.
+  std::string_view input;
+
   std::size_t pos;
 
+  /// Number of arrays and objects open at `pos`.
+  std::size_t depth;
+
+  /// Structural positions of `input`, from `indexBase`.
+  std::vector<uint32_t> structurals;
+
+  std::size_t indexBase;
+
+  /// Next structural position to parse.
+  std::size_t next;
+
   JsonValue jsonValue;
 
-  inline static std::string TRUE = "true";
+  /// Allocates the strings and containers of parsed values.
+  std::pmr::memory_resource *resource;
+
+  inline static constexpr std::string_view TRUE = "true";
+
+  inline static constexpr std::string_view FALSE = "false";
+
+  inline static constexpr std::string_view _NULL = "null";
+};
+
+/// Entry of the tape of a `JsonDocument`, one per value in document order.
+/// A container is followed by the entries of its elements, a member of an
+/// object by its key and its value.
+struct TapeEntry {
+  JsonType type;
+  /// The string holds an escape sequence, undone when it is read.
+  bool escaped;
+  /// Position in the text, of strings after the opening quote.
+  uint32_t offset;
+  /// Length of strings, numbers and literals in the text, number of elements
+  /// of arrays, of members of objects.
+  uint32_t length;
+  /// Index of the entry after the value, containers are skipped in a step.
+  uint32_t next;
+};
+
+/// Text of a `JsonDocument` and its tape.
+struct JsonTape {
+  std::string owned;
+  std::string_view text;
+  std::vector<TapeEntry> entries;
+};
+
+/// Value of a `JsonDocument`, a cheap handle to its tape entry. Nothing is
+/// materialized while navigating, numbers are converted and strings
+/// unescaped when read. Valid as long as its document.
+class JsonElement {
+public:
+  JsonElement(const JsonTape *tape, uint32_t index);
+
+  [[nodiscard]] JsonType getType() const;
+
+  [[nodiscard]] double getNumber() const;
+
+  [[nodiscard]] bool getBoolean() const;
+
+  [[nodiscard]] bool isNull() const;
+
+  /// The string with its escape sequences undone.
+  [[nodiscard]] std::string getString() const;
+
+  /// The string as written in the text, escape sequences are kept.
+  [[nodiscard]] std::string_view getRawString() const;
+
+  /// Number of elements of an array, of members of an object.
+  [[nodiscard]] size_t size() const;
+
+  /// Element `index` of an array, throw `std::out_of_range` if there is none.
+  JsonElement operator[](size_t index) const;
+
+  /// Value of member `key` of an object, throw `std::out_of_range` if there is
+  /// none.
+  JsonElement operator[](std::string_view key) const;
 
-  inline static std::string FALSE = "false";
+  /// Value of member `key` of an object.
+  [[nodiscard]] std::optional<JsonElement> find(std::string_view key) const;
 
-  inline static std::string _NULL = "null";
+  /// Elements of an array or members of an object, in document order.
+  class Iterator {
+  public:
+    Iterator(const JsonTape *tape, uint32_t index, bool object);
+
+    /// The element, or the value of the member.
+    JsonElement operator*() const;
+
+    /// Key of the member.
+    [[nodiscard]] std::string key() const;
+
+    /// Tape index of the key of the member.
+    [[nodiscard]] uint32_t keyIndex() const;
+
+    Iterator &operator++();
+
+    bool operator!=(const Iterator &other) const;
+
+  private:
+    const JsonTape *tape;
+    uint32_t index;
+    bool object;
+  };
+
+  [[nodiscard]] Iterator begin() const;
+
+  [[nodiscard]] Iterator end() const;
+
+  /// Copy the value into a `JsonValue` tree allocated from `resource`.
+  [[nodiscard]] JsonValue materialize(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      const;
+
+private:
+  [[nodiscard]] const TapeEntry &entry() const;
+
+  /// The string with its escape sequences undone, allocated from `resource`.
+  [[nodiscard]] JsonString
+  readString(std::pmr::memory_resource *resource) const;
+
+  const JsonTape *tape;
+  uint32_t index;
+};
+
+/// Lazy alternative to `JsonValue`: the text is parsed into a flat tape of
+/// typed entries pointing into it, eg:
+///   crawler::JsonDocument document(body);
+///   double rating = document.root()["rating"]["average"].getNumber();
+/// Invalid text throws the same errors as `JsonParser`.
+class JsonDocument {
+public:
+  /// Parse `json`, which is kept by the document.
+  explicit JsonDocument(std::string json);
+
+  /// Parse `json` without copying it, it has to outlive the document.
+  static JsonDocument view(std::string_view json);
+
+  [[nodiscard]] JsonElement root() const;
+
+  /// Number of tape entries, eg values and keys.
+  [[nodiscard]] size_t tapeSize() const;
+
+private:
+  JsonDocument() = default;
+
+  /// Build the tape of `tape->text`.
+  void parse();
+
+  /// On the heap, so elements stay valid when the document is moved.
+  std::unique_ptr<JsonTape> tape;
+};
+
+/// Serialize json, either whole `JsonValue` trees or value by value:
+///   crawler::JsonWriter writer(fd);
+///   writer.beginObject().key("title").value(title).key("rating");
+///   writer.value(8.9).endObject();
+///   writer.flush();
+/// Text is appended to a buffer which is written to `fd` once it holds
+/// `flushSize` bytes, without a file descriptor it is only kept in memory.
+/// Values at the top level are separated by a newline, eg JSON Lines.
+class JsonWriter {
+public:
+  explicit JsonWriter(int fd = -1, size_t flushSize = FLUSH_SIZE);
+
+  /// Flush the buffer, errors are ignored, call `flush` to see them.
+  ~JsonWriter();
+
+  JsonWriter(const JsonWriter &) = delete;
+
+  JsonWriter &operator=(const JsonWriter &) = delete;
+
+  JsonWriter &beginObject();
+
+  JsonWriter &endObject();
+
+  JsonWriter &beginArray();
+
+  JsonWriter &endArray();
+
+  /// Key of the next member of the current object.
+  JsonWriter &key(std::string_view name);
+
+  JsonWriter &value(std::string_view text);
+
+  JsonWriter &value(const char *text);
+
+  /// Nan and infinity are written as null, json has no literal for them.
+  JsonWriter &value(double number);
+
+  template <typename Integer,
+            std::enable_if_t<std::is_integral_v<Integer> &&
+                                 !std::is_same_v<Integer, bool>,
+                             int> = 0>
+  JsonWriter &value(Integer number) {
+    char digits[24];
+    std::to_chars_result result =
+        std::to_chars(digits, digits + sizeof(digits), number);
+    return writeScalar(std::string_view(digits, result.ptr - digits));
+  }
+
+  JsonWriter &value(bool boolean);
+
+  JsonWriter &value(std::nullptr_t);
+
+  /// Write the whole tree of `json`.
+  JsonWriter &value(const JsonValue &json);
+
+  /// Write the buffer to the file descriptor, throw `std::system_error` if
+  /// it fails.
+  void flush();
+
+  /// Text not flushed yet.
+  [[nodiscard]] std::string_view getBuffer() const;
+
+  /// Drop the text not flushed yet.
+  void clearBuffer();
+
+  /// Serialize `json` to a string.
+  static std::string stringify(const JsonValue &json);
+
+  /// Default size of the buffer before it is flushed.
+  inline static const size_t FLUSH_SIZE = 1 << 18;
+
+private:
+  /// Write the separator in front of a new value.
+  void beginValue();
+
+  /// Write a number or a literal.
+  JsonWriter &writeScalar(std::string_view text);
+
+  /// Write `text` as a quoted, escaped json string.
+  void writeString(std::string_view text);
+
+  /// Flush once the buffer is full.
+  void flushIfFull();
+
+  struct Container {
+    bool object;
+    bool empty;
+  };
+
+  int fd;
+  size_t flushSize;
+  std::string buffer;
+  /// Open arrays and objects.
+  std::vector<Container> containers;
+  /// A key has been written, its value is expected.
+  bool afterKey = false;
+  /// A value has been written at the top level.
+  bool topLevelWritten = false;
 };
 
 } // namespace crawler
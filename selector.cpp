@@ -0,0 +1,889 @@
+///
+/// Css queries compiled once into flat programs, and a cache of them.
+///
+
+#include "selector.hpp"
+#include "strings.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+using Code = crawler::SelectorOp::Code;
+
+/// If `word` is one of the whitespace separated words of `list`.
+bool containsWord(std::string_view word, std::string_view list) {
+  if (word.empty()) {
+    return false;
+  }
+  size_t begin = 0;
+  while ((begin = list.find(word, begin)) != std::string_view::npos) {
+    const size_t end = begin + word.size();
+    if ((begin == 0 || isspace(static_cast<unsigned char>(list[begin - 1]))) &&
+        (end == list.size() ||
+         isspace(static_cast<unsigned char>(list[end])))) {
+      return true;
+    }
+    begin = end;
+  }
+  return false;
+}
+
+/// Strip the quotes of an attribute value, eg 'bar' or "bar".
+std::string unquote(const std::string &value) {
+  if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') &&
+      value.back() == value.front()) {
+    return value.substr(1, value.size() - 2);
+  }
+  return value;
+}
+
+/// Parse the argument of `:nth-child()`, eg "odd", "2n+1", "-n+3" or "5",
+/// into `a` and `b`. Throw `std::runtime_error` if it is malformed.
+void parseNth(const std::string &argument, int32_t &a, int32_t &b) {
+  std::string text;
+  for (char c : crawler::normalize(argument)) {
+    if (!isspace(static_cast<unsigned char>(c))) {
+      text += c;
+    }
+  }
+  if (text == "odd") {
+    a = 2;
+    b = 1;
+    return;
+  }
+  if (text == "even") {
+    a = 2;
+    b = 0;
+    return;
+  }
+  // an integer, with an optional sign, at `pos`.
+  auto parseInteger = [&text](size_t &pos, int32_t &value) {
+    size_t end = pos;
+    if (end < text.size() && (text[end] == '+' || text[end] == '-')) {
+      end++;
+    }
+    const size_t digits = end;
+    while (end < text.size() &&
+           isdigit(static_cast<unsigned char>(text[end]))) {
+      end++;
+    }
+    if (end == digits || end - digits > 9) {
+      return false;
+    }
+    value = std::stoi(text.substr(pos, end - pos));
+    pos = end;
+    return true;
+  };
+  size_t pos = 0;
+  const size_t n = text.find('n');
+  if (n == std::string::npos) {
+    a = 0;
+    if (parseInteger(pos, b) && pos == text.size()) {
+      return;
+    }
+    throw std::runtime_error("Malformed nth argument: " + argument);
+  }
+  const std::string coefficient = text.substr(0, n);
+  if (coefficient.empty() || coefficient == "+") {
+    a = 1;
+  } else if (coefficient == "-") {
+    a = -1;
+  } else if (!parseInteger(pos, a) || pos != n) {
+    throw std::runtime_error("Malformed nth argument: " + argument);
+  }
+  pos = n + 1;
+  b = 0;
+  if (pos < text.size() &&
+      (!(text[pos] == '+' || text[pos] == '-') || !parseInteger(pos, b) ||
+       pos != text.size())) {
+    throw std::runtime_error("Malformed nth argument: " + argument);
+  }
+}
+
+/// If `position`, counted from 1, is `a`n+`b` for some n >= 0.
+bool matchesNth(int32_t a, int32_t b, size_t position) {
+  const int64_t offset = static_cast<int64_t>(position) - b;
+  if (a == 0) {
+    return offset == 0;
+  }
+  return offset % a == 0 && offset / a >= 0;
+}
+
+/// Names of the instructions for `Selector::explain`, in declaration order.
+const char *const OP_NAMES[] = {"Tag",
+                                "Id",
+                                "Class",
+                                "Attribute",
+                                "AttributeKeyPrefix",
+                                "AttributeEquals",
+                                "AttributeNotEquals",
+                                "AttributePrefix",
+                                "AttributeSuffix",
+                                "AttributeContains",
+                                "AttributeWord",
+                                "NthChild",
+                                "NthLastChild",
+                                "NthOfType",
+                                "Not",
+                                "Has",
+                                "Contains",
+                                "Child",
+                                "Descendant",
+                                "Adjacent",
+                                "Sibling"};
+
+/// Text of `node` and its descendants, in document order.
+std::string textOf(const crawler::Node &node) {
+  std::string text;
+  for (const crawler::Node &descendant : node.preorder()) {
+    if (descendant.isText()) {
+      text += descendant.getText();
+    }
+  }
+  return text;
+}
+
+} // namespace
+
+crawler::Selector::Selector(const std::string &cssQuery) : query(cssQuery) {
+  TokenQueue queue(cssQuery);
+  do {
+    compileAlternative(queue);
+  } while (queue.matchesChomp(","));
+}
+
+void crawler::Selector::compileAlternative(TokenQueue &queue) {
+  // compound selectors from left to right, each but the first one is reached
+  // by the combinator in front of it.
+  std::vector<std::vector<SelectorOp>> compounds(1);
+  std::vector<SelectorOp> combinators;
+  // if each compound selector has any simple selector, eg "*" has one.
+  std::vector<bool> found(1, false);
+  queue.consumeWhiteSpace();
+  while (!queue.eof()) {
+    found.back() = compileCompound(queue, compounds.back());
+    const bool seenWhiteSpace = queue.consumeWhiteSpace();
+    if (queue.eof() || queue.matches(",")) {
+      break;
+    }
+    if (queue.matchesChomp(">")) {
+      combinators.push_back({Code::Child, 0, 0});
+    } else if (queue.matchesChomp("+")) {
+      combinators.push_back({Code::Adjacent, 0, 0});
+    } else if (queue.matchesChomp("~")) {
+      combinators.push_back({Code::Sibling, 0, 0});
+    } else if (seenWhiteSpace) {
+      combinators.push_back({Code::Descendant, 0, 0});
+    }
+    queue.consumeWhiteSpace();
+    compounds.emplace_back();
+    found.push_back(false);
+  }
+  for (size_t i = 0; i < compounds.size(); i++) {
+    // a leading combinator, eg "> p", applies to any element.
+    if (!found[i] && !(i == 0 && compounds.size() > 1)) {
+      throw std::runtime_error("Missing selector in query: " + query);
+    }
+  }
+  for (std::vector<SelectorOp> &compound : compounds) {
+    // stable, so selectors of the same cost keep the order of the query.
+    std::stable_sort(compound.begin(), compound.end(),
+                     [](const SelectorOp &a, const SelectorOp &b) {
+                       return SelectorOp::cost(a.code) < SelectorOp::cost(b.code);
+                     });
+  }
+  Alternative alternative;
+  alternative.begin = program.size();
+  for (size_t i = compounds.size(); i > 0; i--) {
+    program.insert(program.end(), compounds[i - 1].begin(),
+                   compounds[i - 1].end());
+    if (i > 1) {
+      program.push_back(combinators[i - 2]);
+    }
+  }
+  alternative.end = program.size();
+  // a compound followed by a child or descendant combinator tests an ancestor
+  // of the element, the other ones test the element or a sibling. An empty id
+  // or class matches the elements without one, which the filter knows nothing
+  // about.
+  for (size_t i = 0; i + 1 < compounds.size(); i++) {
+    const Code combinator = combinators[i].code;
+    if (combinator != Code::Child && combinator != Code::Descendant) {
+      continue;
+    }
+    for (const SelectorOp &op : compounds[i]) {
+      if (op.code > Code::Class || strings[op.key].empty()) {
+        continue;
+      }
+      if (op.code == Code::Tag) {
+        alternative.ancestorHashes.push_back(
+            AncestorFilter::hash(IndexKey::Kind::Tag, strings[op.key]));
+      } else if (op.code == Code::Id) {
+        alternative.ancestorHashes.push_back(
+            AncestorFilter::hash(IndexKey::Kind::Id, strings[op.key]));
+      } else if (op.code == Code::Class) {
+        alternative.ancestorHashes.push_back(
+            AncestorFilter::hash(IndexKey::Kind::Class, strings[op.key]));
+      }
+    }
+  }
+  alternatives.push_back(std::move(alternative));
+}
+
+bool crawler::Selector::compileCompound(TokenQueue &queue,
+                                        std::vector<SelectorOp> &ops) {
+  bool found = false;
+  while (!queue.eof() && !queue.matchesWhitespace() &&
+         !queue.matchesAny(QueryParser::COMBINATORS)) {
+    if (queue.matchesChomp("#")) {
+      ops.push_back({Code::Id, intern(queue.consumeCssIdentifier()), 0});
+    } else if (queue.matchesChomp(".")) {
+      const std::string clazz = queue.consumeCssIdentifier();
+      ops.push_back({Code::Class, intern(clazz), ElementData::classBit(clazz)});
+    } else if (queue.matchesChomp("*")) {
+      // the universal selector tests nothing.
+    } else if (queue.matchesWords()) {
+      ops.push_back(
+          {Code::Tag, intern(normalize(queue.consumeElementSelector())), 0});
+    } else if (queue.matches("[")) {
+      compileAttribute(queue.chompBalanced('[', ']'), ops);
+    } else if (queue.matchesChomp(":")) {
+      const std::string name = normalize(queue.consumeCssIdentifier());
+      const std::string argument =
+          queue.matches("(") ? queue.chompBalanced('(', ')') : "";
+      compilePseudoClass(name, argument, ops);
+    } else {
+      std::string errorMsg("Could parse unexpected token: ");
+      errorMsg += queue.remainder();
+      throw std::runtime_error(errorMsg);
+    }
+    found = true;
+  }
+  return found;
+}
+
+void crawler::Selector::compilePseudoClass(const std::string &name,
+                                           const std::string &argument,
+                                           std::vector<SelectorOp> &ops) {
+  // a and b of "an+b" are stored as the operands.
+  auto nth = [&ops](Code code, int32_t a, int32_t b) {
+    ops.push_back(
+        {code, static_cast<uint32_t>(a), static_cast<uint32_t>(b)});
+  };
+  int32_t a = 0;
+  int32_t b = 0;
+  if (name == "first-child") {
+    nth(Code::NthChild, 0, 1);
+  } else if (name == "last-child") {
+    nth(Code::NthLastChild, 0, 1);
+  } else if (name == "only-child") {
+    nth(Code::NthChild, 0, 1);
+    nth(Code::NthLastChild, 0, 1);
+  } else if (name == "first-of-type") {
+    nth(Code::NthOfType, 0, 1);
+  } else if (name == "nth-child") {
+    parseNth(argument, a, b);
+    nth(Code::NthChild, a, b);
+  } else if (name == "nth-last-child") {
+    parseNth(argument, a, b);
+    nth(Code::NthLastChild, a, b);
+  } else if (name == "nth-of-type") {
+    parseNth(argument, a, b);
+    nth(Code::NthOfType, a, b);
+  } else if (name == "not") {
+    nested.push_back(std::make_unique<const Selector>(argument));
+    ops.push_back({Code::Not, static_cast<uint32_t>(nested.size() - 1), 0});
+  } else if (name == "has") {
+    // only descendants and children are relative to the element, eg
+    // ":has(> img)".
+    TokenQueue relative(trim(argument));
+    const bool child = relative.matchesChomp(">");
+    nested.push_back(std::make_unique<const Selector>(relative.remainder()));
+    ops.push_back({Code::Has, static_cast<uint32_t>(nested.size() - 1),
+                   child ? 1u : 0u});
+  } else if (name == "contains") {
+    ops.push_back({Code::Contains, intern(normalize(unquote(trim(argument)))),
+                   0});
+  } else {
+    throw std::runtime_error("Unsupported pseudo class: " + name);
+  }
+}
+
+void crawler::Selector::compileAttribute(const std::string &attribute,
+                                         std::vector<SelectorOp> &ops) {
+  TokenQueue attributeQueue(attribute);
+  const std::string key =
+      normalize(trim(attributeQueue.consumeToAny(QueryParser::ATTRIBUTES)));
+  attributeQueue.consumeWhiteSpace();
+  if (attributeQueue.eof()) {
+    if (startsWith("^", key)) {
+      ops.push_back({Code::AttributeKeyPrefix, intern(key.substr(1)), 0});
+    } else {
+      ops.push_back({Code::Attribute, intern(key), 0});
+    }
+    return;
+  }
+  Code code = Code::AttributeEquals;
+  if (attributeQueue.matchesChomp("=")) {
+    code = Code::AttributeEquals;
+  } else if (attributeQueue.matchesChomp("!=")) {
+    code = Code::AttributeNotEquals;
+  } else if (attributeQueue.matchesChomp("^=")) {
+    code = Code::AttributePrefix;
+  } else if (attributeQueue.matchesChomp("$=")) {
+    code = Code::AttributeSuffix;
+  } else if (attributeQueue.matchesChomp("*=")) {
+    code = Code::AttributeContains;
+  } else if (attributeQueue.matchesChomp("~=")) {
+    code = Code::AttributeWord;
+  }
+  const std::string value = unquote(trim(attributeQueue.remainder()));
+  ops.push_back({code, intern(key), intern(value)});
+}
+
+uint32_t crawler::Selector::intern(std::string text) {
+  for (size_t i = 0; i < strings.size(); i++) {
+    if (strings[i] == text) {
+      return static_cast<uint32_t>(i);
+    }
+  }
+  strings.emplace_back(std::move(text));
+  return static_cast<uint32_t>(strings.size() - 1);
+}
+
+bool crawler::Selector::matches(const Node &element) const {
+  return matchesAny(element, nullptr);
+}
+
+bool crawler::Selector::matches(const Node &element,
+                                MatchContext &context) const {
+  if (!element.isElement()) {
+    return false;
+  }
+  return std::any_of(alternatives.cbegin(), alternatives.cend(),
+                     [&](const Alternative &alternative) {
+                       return mightMatch(alternative, context.filter) &&
+                              matchesFrom(alternative.begin, alternative.end,
+                                          element, &context);
+                     });
+}
+
+bool crawler::Selector::matchesAny(const Node &element,
+                                   MatchContext *context) const {
+  if (!element.isElement()) {
+    return false;
+  }
+  return std::any_of(alternatives.cbegin(), alternatives.cend(),
+                     [&](const Alternative &alternative) {
+                       return matchesFrom(alternative.begin, alternative.end,
+                                          element, context);
+                     });
+}
+
+bool crawler::Selector::mightMatch(const AncestorFilter &filter) const {
+  return std::any_of(alternatives.cbegin(), alternatives.cend(),
+                     [&](const Alternative &alternative) {
+                       return mightMatch(alternative, filter);
+                     });
+}
+
+bool crawler::Selector::mightMatch(const Alternative &alternative,
+                                   const AncestorFilter &filter) {
+  return std::all_of(alternative.ancestorHashes.cbegin(),
+                     alternative.ancestorHashes.cend(),
+                     [&filter](uint32_t hash) {
+                       return filter.mightContain(hash);
+                     });
+}
+
+bool crawler::Selector::isCompound() const {
+  return std::all_of(program.cbegin(), program.cend(),
+                     [this](const SelectorOp &op) {
+                       if (op.code == Code::Not) {
+                         return nested[op.key]->isCompound();
+                       }
+                       return op.code <= Code::AttributeWord;
+                     });
+}
+
+bool crawler::Selector::mightMatchTag(std::string_view tagName) const {
+  return std::any_of(
+      alternatives.cbegin(), alternatives.cend(),
+      [&](const Alternative &alternative) {
+        return std::all_of(program.cbegin() + alternative.begin,
+                           program.cbegin() + alternative.end,
+                           [&](const SelectorOp &op) {
+                             return op.code != Code::Tag ||
+                                    strings[op.key] == tagName;
+                           });
+      });
+}
+
+bool crawler::Selector::matchesStartTag(std::string_view tagName,
+                                        const AttrMap &attributes) const {
+  return std::any_of(
+      alternatives.cbegin(), alternatives.cend(),
+      [&](const Alternative &alternative) {
+        return std::all_of(program.cbegin() + alternative.begin,
+                           program.cbegin() + alternative.end,
+                           [&](const SelectorOp &op) {
+                             return testStartTag(op, tagName, attributes);
+                           });
+      });
+}
+
+bool crawler::Selector::testStartTag(const SelectorOp &op,
+                                     std::string_view tagName,
+                                     const AttrMap &attributes) const {
+  const std::string &key = strings[op.key];
+  switch (op.code) {
+  case Code::Tag:
+    return tagName == key;
+  case Code::Id: {
+    auto id = attributes.find("id");
+    return id != attributes.end() ? id->second == key : key.empty();
+  }
+  case Code::Class: {
+    auto clazz = attributes.find("class");
+    return clazz != attributes.end() && containsWord(key, clazz->second);
+  }
+  case Code::Not:
+    return !nested[op.key]->matchesStartTag(tagName, attributes);
+  default:
+    return testAttribute(op.code, attributes, key, strings[op.value]);
+  }
+}
+
+/// Nearest sibling element in front of `node`, null if there is none.
+static const crawler::Node *previousElement(const crawler::Node *node) {
+  do {
+    node = node->previousSibling();
+  } while (node != nullptr && !node->isElement());
+  return node;
+}
+
+bool crawler::Selector::matchesFrom(size_t pc, size_t end,
+                                    const Node &element,
+                                    MatchContext *context) const {
+  const Node *node = &element;
+  for (; pc < end; pc++) {
+    const SelectorOp &op = program[pc];
+    switch (op.code) {
+    case Code::Child:
+      node = node->getParent();
+      if (node == nullptr) {
+        return false;
+      }
+      break;
+    case Code::Adjacent:
+      node = previousElement(node);
+      if (node == nullptr) {
+        return false;
+      }
+      break;
+    case Code::Descendant:
+      // backtrack: the rest of the query may match any ancestor.
+      for (const Node *ancestor = node->getParent(); ancestor != nullptr;
+           ancestor = ancestor->getParent()) {
+        if (matchesFrom(pc + 1, end, *ancestor, context)) {
+          return true;
+        }
+      }
+      return false;
+    case Code::Sibling:
+      // backtrack: the rest of the query may match any previous sibling.
+      for (const Node *sibling = previousElement(node); sibling != nullptr;
+           sibling = previousElement(sibling)) {
+        if (matchesFrom(pc + 1, end, *sibling, context)) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      if (!test(op, *node, context)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool crawler::Selector::test(const SelectorOp &op, const Node &element,
+                             MatchContext *context) const {
+  const auto a = static_cast<int32_t>(op.key);
+  const auto b = static_cast<int32_t>(op.value);
+  switch (op.code) {
+  case Code::NthChild:
+    return matchesNth(a, b, element.elementPosition());
+  case Code::NthLastChild:
+    return matchesNth(
+        a, b, element.siblingElementCount() - element.elementPosition() + 1);
+  case Code::NthOfType:
+    return matchesNth(a, b, element.elementPositionOfType());
+  case Code::Not:
+    return !nested[op.key]->matchesAny(element, nullptr);
+  case Code::Has: {
+    const Selector &relative = *nested[op.key];
+    const bool child = op.value != 0;
+    if (context != nullptr) {
+      return context->has(relative, child, element);
+    }
+    if (child) {
+      const std::vector<Node> &children = element.getChildren();
+      return std::any_of(children.cbegin(), children.cend(),
+                         [&relative](const Node &node) {
+                           return relative.matchesAny(node, nullptr);
+                         });
+    }
+    for (const Node &node : element.preorder()) {
+      if (&node != &element && relative.matchesAny(node, nullptr)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  case Code::Contains:
+    return contains(strings[op.key], normalize(textOf(element)));
+  default:
+    break;
+  }
+  const ElementData &data = element.getElementData();
+  const std::string &key = strings[op.key];
+  switch (op.code) {
+  case Code::Tag:
+    return data.getTagName() == key;
+  case Code::Id:
+    return data.id() == key;
+  case Code::Class:
+    return data.hasClass(key, op.value);
+  default:
+    return testAttribute(op.code, data.getAttributes(), key,
+                         strings[op.value]);
+  }
+}
+
+bool crawler::testAttribute(SelectorOp::Code code, const AttrMap &attributes,
+                            std::string_view key, std::string_view value) {
+  if (code == Code::AttributeKeyPrefix) {
+    // keys are sorted, the first one not less than the prefix is the only
+    // candidate.
+    auto candidate = attributes.lower_bound(key);
+    return candidate != attributes.end() &&
+           std::string_view(candidate->first).substr(0, key.size()) == key;
+  }
+  auto attribute = attributes.find(key);
+  if (code == Code::AttributeNotEquals) {
+    return attribute == attributes.end() || attribute->second != value;
+  }
+  if (attribute == attributes.end()) {
+    return false;
+  }
+  const std::string_view actual = attribute->second;
+  switch (code) {
+  case Code::Attribute:
+    return true;
+  case Code::AttributeEquals:
+    return actual == value;
+  case Code::AttributePrefix:
+    return actual.substr(0, value.size()) == value;
+  case Code::AttributeSuffix:
+    return actual.size() >= value.size() &&
+           actual.substr(actual.size() - value.size()) == value;
+  case Code::AttributeContains:
+    return actual.find(value) != std::string_view::npos;
+  case Code::AttributeWord:
+    return containsWord(value, actual);
+  default:
+    return false;
+  }
+}
+
+crawler::IndexKey crawler::Selector::indexKey() const {
+  IndexKey best;
+  for (IndexKey &key : indexKeys()) {
+    // kinds are declared from the most to the least selective.
+    if (best.kind == IndexKey::Kind::None || key.kind < best.kind) {
+      best = std::move(key);
+    }
+  }
+  return best;
+}
+
+std::vector<crawler::IndexKey> crawler::Selector::indexKeys() const {
+  std::vector<IndexKey> keys;
+  if (alternatives.size() != 1) {
+    // the elements of a group are the union of several indexes.
+    return keys;
+  }
+  for (const SelectorOp &op : program) {
+    if (op.code == Code::Id) {
+      keys.push_back({IndexKey::Kind::Id, strings[op.key]});
+    } else if (op.code == Code::Class) {
+      keys.push_back({IndexKey::Kind::Class, strings[op.key]});
+    } else if (op.code == Code::Tag) {
+      keys.push_back({IndexKey::Kind::Tag, strings[op.key]});
+    } else if (op.code >= Code::Child) {
+      // only the rightmost compound selector tests the element itself.
+      break;
+    }
+  }
+  return keys;
+}
+
+std::string crawler::Selector::explain() const {
+  std::string text;
+  for (size_t i = 0; i < alternatives.size(); i++) {
+    const Alternative &alternative = alternatives[i];
+    text += "alternative " + std::to_string(i);
+    if (!alternative.ancestorHashes.empty()) {
+      // the ancestor compounds checked against the filter first.
+      text += ", ancestor filter terms " +
+              std::to_string(alternative.ancestorHashes.size());
+    }
+    text += "\n";
+    for (size_t pc = alternative.begin; pc < alternative.end; pc++) {
+      const SelectorOp &op = program[pc];
+      text += "  " + std::to_string(pc - alternative.begin) + " " +
+              OP_NAMES[static_cast<size_t>(op.code)];
+      switch (op.code) {
+      case Code::NthChild:
+      case Code::NthLastChild:
+      case Code::NthOfType:
+        text += " " + std::to_string(static_cast<int32_t>(op.key)) + "n";
+        text += (static_cast<int32_t>(op.value) < 0 ? "" : "+") +
+                std::to_string(static_cast<int32_t>(op.value));
+        break;
+      case Code::Not:
+      case Code::Has:
+        text += op.value != 0 ? " > " : " ";
+        text += nested[op.key]->getQuery();
+        break;
+      case Code::Child:
+      case Code::Descendant:
+      case Code::Adjacent:
+      case Code::Sibling:
+        break;
+      case Code::Tag:
+      case Code::Id:
+      case Code::Class:
+      case Code::Attribute:
+      case Code::AttributeKeyPrefix:
+      case Code::Contains:
+        text += " " + strings[op.key];
+        break;
+      default:
+        text += " " + strings[op.key] + " \"" + strings[op.value] + "\"";
+      }
+      text += "\n";
+    }
+  }
+  return text;
+}
+
+bool crawler::MatchContext::has(const Selector &relative, bool child,
+                                const Node &element) {
+  // the ancestors of a copy are a snapshot without children, its subtree
+  // starts at the copy.
+  const Node *root = &element;
+  while (root->isChildOfParent()) {
+    root = root->getParent();
+  }
+  HasMatches &matches = hasMatches[{&relative, child}];
+  if (matches.root != root) {
+    matches.root = root;
+    matches.elements.clear();
+    for (const Node &node : root->preorder()) {
+      if (!relative.matchesAny(node, this)) {
+        continue;
+      }
+      if (child) {
+        matches.elements.insert(node.getParent());
+        continue;
+      }
+      // the ancestors of a marked element are marked already.
+      for (const Node *ancestor = node.getParent();
+           ancestor != nullptr && matches.elements.insert(ancestor).second;
+           ancestor = ancestor->getParent()) {
+      }
+    }
+  }
+  return matches.elements.count(&element) != 0;
+}
+
+void crawler::AncestorFilter::push(const Node &element) {
+  levels.push_back(hashes.size());
+  if (!element.isElement()) {
+    return;
+  }
+  const ElementData &data = element.getElementData();
+  insert(hash(IndexKey::Kind::Tag, data.getTagName()));
+  const AttrMap &attributes = data.getAttributes();
+  auto id = attributes.find("id");
+  if (id != attributes.end()) {
+    insert(hash(IndexKey::Kind::Id, id->second));
+  }
+  for (const std::string &token : data.getClasses()) {
+    insert(hash(IndexKey::Kind::Class, token));
+  }
+}
+
+void crawler::AncestorFilter::pop() {
+  for (size_t i = levels.back(); i < hashes.size(); i++) {
+    const uint32_t hash = hashes[i];
+    for (uint32_t index : {hash & (SIZE - 1), (hash >> 12) & (SIZE - 1)}) {
+      // a saturated counter may count more hashes than it knows of.
+      if (counters[index] != UINT8_MAX) {
+        counters[index]--;
+      }
+    }
+  }
+  hashes.resize(levels.back());
+  levels.pop_back();
+}
+
+void crawler::AncestorFilter::insert(uint32_t hash) {
+  hashes.push_back(hash);
+  for (uint32_t index : {hash & (SIZE - 1), (hash >> 12) & (SIZE - 1)}) {
+    if (counters[index] != UINT8_MAX) {
+      counters[index]++;
+    }
+  }
+}
+
+bool crawler::AncestorFilter::mightContain(uint32_t hash) const {
+  return counters[hash & (SIZE - 1)] != 0 &&
+         counters[(hash >> 12) & (SIZE - 1)] != 0;
+}
+
+uint32_t crawler::AncestorFilter::hash(IndexKey::Kind kind,
+                                       std::string_view text) {
+  // 32 bits FNV-1a, seeded by the kind so a tag never collides with the
+  // class of the same name.
+  uint32_t hash = 2166136261u ^ static_cast<uint32_t>(kind);
+  for (char c : text) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+size_t crawler::SelectorSet::add(std::shared_ptr<const Selector> selector) {
+  const size_t index = selectors.size();
+  const IndexKey key = selector->indexKey();
+  if (key.kind == IndexKey::Kind::None || key.value.empty()) {
+    universal.push_back(index);
+  } else {
+    buckets[AncestorFilter::hash(key.kind, key.value)].push_back(index);
+  }
+  selectors.emplace_back(std::move(selector));
+  return index;
+}
+
+size_t crawler::SelectorSet::add(const std::string &cssQuery) {
+  return add(SelectorCache::shared().get(cssQuery));
+}
+
+std::vector<std::vector<const crawler::Node *>>
+crawler::SelectorSet::select(const Node &root) const {
+  std::vector<std::vector<const Node *>> result(selectors.size());
+  MatchContext context;
+  // the tag, id and class buckets of an element may be the same bucket when
+  // their hashes collide, each selector is run once per element.
+  std::vector<size_t> lastRun(selectors.size(), 0);
+  size_t elements = 0;
+  auto run = [&](const std::vector<size_t> &indexes, const Node &node) {
+    for (size_t index : indexes) {
+      if (lastRun[index] == elements) {
+        continue;
+      }
+      lastRun[index] = elements;
+      if (selectors[index]->matches(node, context)) {
+        result[index].push_back(&node);
+      }
+    }
+  };
+  auto runBucket = [&](IndexKey::Kind kind, std::string_view text,
+                       const Node &node) {
+    auto bucket = buckets.find(AncestorFilter::hash(kind, text));
+    if (bucket != buckets.end()) {
+      run(bucket->second, node);
+    }
+  };
+  walkWithAncestors(root, context.filter, [&](const Node &node) {
+    if (!node.isElement()) {
+      return true;
+    }
+    elements++;
+    run(universal, node);
+    if (buckets.empty()) {
+      return true;
+    }
+    const ElementData &data = node.getElementData();
+    runBucket(IndexKey::Kind::Tag, data.getTagName(), node);
+    const AttrMap &attributes = data.getAttributes();
+    auto id = attributes.find("id");
+    if (id != attributes.end()) {
+      runBucket(IndexKey::Kind::Id, id->second, node);
+    }
+    for (const std::string &token : data.getClasses()) {
+      runBucket(IndexKey::Kind::Class, token, node);
+    }
+    return true;
+  });
+  return result;
+}
+
+crawler::SelectorCache::SelectorCache(size_t capacity, size_t shards)
+    : shardCount(std::max<size_t>(shards, 1)),
+      shards(std::make_unique<Shard[]>(shardCount)) {
+  const size_t perShard = (capacity + shardCount - 1) / shardCount;
+  this->capacity = std::max<size_t>(perShard, 1);
+}
+
+std::shared_ptr<const crawler::Selector>
+crawler::SelectorCache::get(const std::string &cssQuery) {
+  Shard &shard = shards[std::hash<std::string>()(cssQuery) % shardCount];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto cached = shard.index.find(cssQuery);
+    if (cached != shard.index.end()) {
+      shard.entries.splice(shard.entries.begin(), shard.entries,
+                           cached->second);
+      return *cached->second;
+    }
+  }
+  // compiled outside the lock, the first one cached wins a race.
+  auto selector = std::make_shared<const Selector>(cssQuery);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto cached = shard.index.find(cssQuery);
+  if (cached != shard.index.end()) {
+    shard.entries.splice(shard.entries.begin(), shard.entries, cached->second);
+    return *cached->second;
+  }
+  shard.entries.push_front(selector);
+  shard.index.emplace(cssQuery, shard.entries.begin());
+  if (shard.entries.size() > capacity) {
+    shard.index.erase(shard.entries.back()->getQuery());
+    shard.entries.pop_back();
+  }
+  return selector;
+}
+
+size_t crawler::SelectorCache::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shardCount; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    total += shards[i].entries.size();
+  }
+  return total;
+}
+
+crawler::SelectorCache &crawler::SelectorCache::shared() {
+  static SelectorCache cache(DEFAULT_CAPACITY, SHARED_SHARDS);
+  return cache;
+}
@@ -0,0 +1,431 @@
+///
+/// Css queries compiled once into flat programs, and a cache of them.
+///
+
+#ifndef DOUBANCRAWLER_SELECTOR_H
+#define DOUBANCRAWLER_SELECTOR_H
+
+#include "dom.hpp"
+#include <array>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace crawler {
+
+/// Counting Bloom filter of the tag names, ids and class tokens of the
+/// ancestors of the element being matched, kept up to date by a top-down walk
+/// of the tree (see `walkWithAncestors`). A selector whose ancestor compounds
+/// need a tag, id or class missing from the filter is rejected without
+/// walking up the tree, the same trick as the selector matching of Servo.
+class AncestorFilter {
+public:
+  /// Add the hashes of `element`, which becomes the innermost ancestor.
+  void push(const Node &element);
+
+  /// Remove the hashes of the innermost ancestor.
+  void pop();
+
+  /// False if no ancestor has the tag, id or class of `hash`, true if one
+  /// may have it.
+  [[nodiscard]] bool mightContain(uint32_t hash) const;
+
+  /// Hash of a tag name, id or class token, depending on `kind`.
+  static uint32_t hash(IndexKey::Kind kind, std::string_view text);
+
+  /// Number of counters, a power of 2.
+  inline static const size_t SIZE = 4096;
+
+private:
+  void insert(uint32_t hash);
+
+  /// Each hash sets the counters of its lowest 12 bits and of the next 12
+  /// bits. Counters stick at 255 rather than wrap around.
+  std::array<uint8_t, SIZE> counters{};
+
+  /// Hashes of the ancestors, outermost first.
+  std::vector<uint32_t> hashes;
+
+  /// Index into `hashes` of the first hash of each ancestor.
+  std::vector<size_t> levels;
+};
+
+/// Instruction of a compiled selector. Simple selectors test the current
+/// element, combinators move to another one.
+struct SelectorOp {
+  enum class Code : uint8_t {
+    /// Tag name equals `key`.
+    Tag,
+    /// Id equals `key`.
+    Id,
+    /// Class attribute has the token `key`, with `value` its
+    /// `ElementData::classBit`.
+    Class,
+    /// Has attribute `key`.
+    Attribute,
+    /// Has an attribute whose name starts with `key`.
+    AttributeKeyPrefix,
+    /// Attribute `key` equals `value`.
+    AttributeEquals,
+    /// Attribute `key` doesn't equal `value`, or is missing.
+    AttributeNotEquals,
+    /// Attribute `key` starts with `value`.
+    AttributePrefix,
+    /// Attribute `key` ends with `value`.
+    AttributeSuffix,
+    /// Attribute `key` contains `value`.
+    AttributeContains,
+    /// Attribute `key` is a whitespace separated list containing `value`.
+    AttributeWord,
+    /// Position among the sibling elements is `a`n+`b` for some n >= 0, with
+    /// `a` in `key` and `b` in `value`, eg `:nth-child(2n+1)`.
+    NthChild,
+    /// Same as `NthChild`, counted from the last sibling.
+    NthLastChild,
+    /// Same as `NthChild`, among the siblings with the same tag name.
+    NthOfType,
+    /// Doesn't match the nested selector `key`, eg `:not(.ad)`.
+    Not,
+    /// Has a descendant matching the nested selector `key`, or a child if
+    /// `value` is 1, eg `:has(> img)`.
+    Has,
+    /// Text, including the one of the descendants, contains `key` ignoring
+    /// case, eg `:contains(douban)`.
+    Contains,
+    // combinators, keep them last.
+    /// Move to the parent, eg `a > b`.
+    Child,
+    /// Try every ancestor in turn, eg `a b`.
+    Descendant,
+    /// Move to the previous sibling element, eg `a + b`.
+    Adjacent,
+    /// Try every previous sibling element in turn, eg `a ~ b`.
+    Sibling
+  };
+
+  Code code;
+  /// Index of the first operand in the string table of the program.
+  uint32_t key;
+  /// Index of the second operand in the string table of the program.
+  uint32_t value;
+
+  /// Estimated cost of the simple selector `code`, where cheap and selective
+  /// tests are lower. The simple selectors of a compound are run cheapest
+  /// first.
+  static constexpr int cost(Code code) {
+    switch (code) {
+    case Code::Id:
+      return 0;
+    case Code::Tag:
+      // compared without parsing the attributes.
+      return 1;
+    case Code::Class:
+      return 2;
+    case Code::NthChild:
+    case Code::NthLastChild:
+    case Code::NthOfType:
+      // cached positions, counted once per parent.
+      return 4;
+    case Code::Not:
+      return 5;
+    case Code::Contains:
+      // concatenates the text of the subtree.
+      return 6;
+    case Code::Has:
+      return 7;
+    default:
+      return 3;
+    }
+  }
+};
+
+/// Result of the attribute selector `code`, from `Attribute` to
+/// `AttributeWord`, with operands `key` and `value` on `attributes`. Shared by
+/// `Selector` and `StaticSelector`, so both give the same results.
+[[nodiscard]] bool testAttribute(SelectorOp::Code code,
+                                 const AttrMap &attributes,
+                                 std::string_view key, std::string_view value);
+
+class Selector;
+
+/// State shared by the matching of the elements met in one walk of a tree.
+class MatchContext {
+public:
+  /// Ancestors of the element being matched, see `walkWithAncestors`.
+  AncestorFilter filter;
+
+  /// If `element` has a descendant, or a child if `child`, matched by
+  /// `relative`. The elements with such a descendant are found bottom-up for
+  /// the whole tree on first use, in one walk, instead of searching the
+  /// subtree of every candidate.
+  bool has(const Selector &relative, bool child, const Node &element);
+
+private:
+  struct HasMatches {
+    /// Root of the tree the elements belong to.
+    const Node *root = nullptr;
+    std::unordered_set<const Node *> elements;
+  };
+
+  /// Keyed by the relative selector and by `child`.
+  std::map<std::pair<const Selector *, bool>, HasMatches> hasMatches;
+};
+
+/// Css query compiled into a flat program. The compound selectors are laid
+/// out from right to left, each followed by the combinator which leads to the
+/// next one, eg "div.list > a[href]" becomes:
+///   Tag a, Attribute href, Child, Tag div, Class list
+/// The simple selectors of a compound are ordered by estimated cost, so an id
+/// or a tag rejects an element before its attributes are looked up, and a
+/// pseudo class walking the tree comes last. The program is run by a single
+/// loop which only recurses to backtrack a descendant or general sibling
+/// combinator. The alternatives of a group, eg "h1, h2", follow each other in
+/// the program and an element matches the group if it matches any of them, so
+/// a walk finds each element once. A selector owns its program and is
+/// immutable, so it can be shared between threads.
+class Selector {
+public:
+  /// Compile `cssQuery`, throw `std::runtime_error` if it is malformed.
+  explicit Selector(const std::string &cssQuery);
+
+  /// If `element` matches the query.
+  [[nodiscard]] bool matches(const Node &element) const;
+
+  /// If `element` matches the query, with the filter of `context` holding the
+  /// ancestors of `element`.
+  [[nodiscard]] bool matches(const Node &element,
+                             MatchContext &context) const;
+
+  /// False if the ancestors in `filter` can't match the query.
+  [[nodiscard]] bool mightMatch(const AncestorFilter &filter) const;
+
+  /// If the query is made of compound selectors only, eg "div.article" or
+  /// "h1, #title": tag, id, class and attribute selectors, and `:not()` of
+  /// them. Such a query can be matched against a start tag, before the element
+  /// has a parent or children.
+  [[nodiscard]] bool isCompound() const;
+
+  /// False if no element named `tagName` can match the compound query.
+  [[nodiscard]] bool mightMatchTag(std::string_view tagName) const;
+
+  /// If a start tag named `tagName` with `attributes` matches the compound
+  /// query.
+  [[nodiscard]] bool matchesStartTag(std::string_view tagName,
+                                     const AttrMap &attributes) const;
+
+  /// Index which narrows down the elements to evaluate, from the rightmost
+  /// compound selector. None for a group.
+  [[nodiscard]] IndexKey indexKey() const;
+
+  /// Every index of the rightmost compound selector, any of them narrows down
+  /// the elements to evaluate, eg the tag and the classes of "li.item.new".
+  /// Empty for a group.
+  [[nodiscard]] std::vector<IndexKey> indexKeys() const;
+
+  /// Program in a readable form, one instruction per line, eg for "div > a":
+  ///   alternative 0, ancestor filter terms 1
+  ///     0 Tag a
+  ///     1 Child
+  ///     2 Tag div
+  [[nodiscard]] std::string explain() const;
+
+  [[nodiscard]] const std::string &getQuery() const { return query; }
+
+  [[nodiscard]] const std::vector<SelectorOp> &getProgram() const {
+    return program;
+  }
+
+private:
+  /// One selector of a group.
+  struct Alternative {
+    /// Range of the program.
+    size_t begin;
+    size_t end;
+    /// `AncestorFilter` hashes of the tags, ids and classes some ancestor of
+    /// a matching element must have.
+    std::vector<uint32_t> ancestorHashes;
+  };
+
+  friend class MatchContext;
+
+  /// If `element` matches any alternative, `context` may be null.
+  [[nodiscard]] bool matchesAny(const Node &element,
+                                MatchContext *context) const;
+
+  /// Run the program from `pc` to `end` against `element`.
+  [[nodiscard]] bool matchesFrom(size_t pc, size_t end, const Node &element,
+                                 MatchContext *context) const;
+
+  /// Run the simple selector `op` of a compound query against a start tag.
+  [[nodiscard]] bool testStartTag(const SelectorOp &op,
+                                  std::string_view tagName,
+                                  const AttrMap &attributes) const;
+
+  /// False if the ancestors in `filter` can't match `alternative`.
+  [[nodiscard]] static bool mightMatch(const Alternative &alternative,
+                                       const AncestorFilter &filter);
+
+  /// Compile one selector of a group, up to the next comma.
+  void compileAlternative(TokenQueue &queue);
+
+  /// Run the simple selector `op` against `element`.
+  [[nodiscard]] bool test(const SelectorOp &op, const Node &element,
+                          MatchContext *context) const;
+
+  /// Compile the pseudo class `name` with the argument in "(...)", if any.
+  void compilePseudoClass(const std::string &name,
+                          const std::string &argument,
+                          std::vector<SelectorOp> &ops);
+
+  /// Compile one compound selector, eg "div.list[href]", into `ops`. Return
+  /// false if there is none.
+  bool compileCompound(TokenQueue &queue, std::vector<SelectorOp> &ops);
+
+  /// Compile the attribute selector in "[...]" into `ops`.
+  void compileAttribute(const std::string &attribute,
+                        std::vector<SelectorOp> &ops);
+
+  /// Add `text` to the string table, return its index.
+  uint32_t intern(std::string text);
+
+  std::string query;
+
+  std::vector<SelectorOp> program;
+
+  /// Operands of the program.
+  std::vector<std::string> strings;
+
+  std::vector<Alternative> alternatives;
+
+  /// Selectors of `:not()` and `:has()`.
+  std::vector<std::unique_ptr<const Selector>> nested;
+};
+
+/// Walk the subtree of `root` in document order and call `visitor(node)` for
+/// each node, with `filter` holding the ancestors of the node, until the
+/// visitor returns false. `filter` must be empty.
+template <class Visitor>
+void walkWithAncestors(const Node &root, AncestorFilter &filter,
+                       Visitor visitor) {
+  // the ancestors of the root take part in the matching too.
+  std::vector<const Node *> ancestors;
+  for (const Node *parent = root.getParent(); parent != nullptr;
+       parent = parent->getParent()) {
+    ancestors.push_back(parent);
+  }
+  for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+    filter.push(**it);
+  }
+  const Node *node = &root;
+  while (node != nullptr) {
+    if (!visitor(*node)) {
+      return;
+    }
+    if (!node->getChildren().empty()) {
+      filter.push(*node);
+      node = &node->getChildren().front();
+      continue;
+    }
+    // climb until a node with a next sibling, without leaving the subtree.
+    while (node != &root && node->nextSibling() == nullptr) {
+      node = node->getParent();
+      filter.pop();
+    }
+    node = node == &root ? nullptr : node->nextSibling();
+  }
+}
+
+/// Selectors run together in a single walk of the tree, eg the 30 rules of an
+/// extraction template:
+///   crawler::SelectorSet rules;
+///   size_t title = rules.add("h1");
+///   size_t links = rules.add("div.list > a[href]");
+///   auto found = rules.select(root); // found[links] are the links
+/// Selectors are bucketed by the tag, id or class their rightmost compound
+/// requires, so each element is only tested against the selectors of its own
+/// tag, id and classes, and the ones without a requirement.
+class SelectorSet {
+public:
+  /// Add a selector, return the index of its matches in the result of
+  /// `select`.
+  size_t add(std::shared_ptr<const Selector> selector);
+
+  /// Add a css query, compiled through `SelectorCache::shared()`. Throw
+  /// `std::runtime_error` if it is malformed.
+  size_t add(const std::string &cssQuery);
+
+  [[nodiscard]] size_t size() const { return selectors.size(); }
+
+  /// Matches of each selector in document order, the result of the `i`th
+  /// added selector at index `i`. The nodes belong to the tree of `root`.
+  [[nodiscard]] std::vector<std::vector<const Node *>>
+  select(const Node &root) const;
+
+private:
+  std::vector<std::shared_ptr<const Selector>> selectors;
+
+  /// Indexes of the selectors by `AncestorFilter::hash` of the tag, id or
+  /// class they require. A hash collision only adds a candidate.
+  std::unordered_map<uint32_t, std::vector<size_t>> buckets;
+
+  /// Indexes of the selectors any element may match.
+  std::vector<size_t> universal;
+};
+
+/// Least recently used cache of compiled selectors keyed by query string, so
+/// a query is only parsed the first time it is run. Selectors are handed out
+/// as shared pointers and outlive their eviction. Safe to use from many
+/// threads: queries are spread over `shards` independent LRU lists by hash,
+/// each behind its own mutex, so threads running different queries rarely
+/// wait for each other.
+class SelectorCache {
+public:
+  /// Hold at most `capacity` selectors, split evenly between `shards`.
+  explicit SelectorCache(size_t capacity = DEFAULT_CAPACITY, size_t shards = 1);
+
+  /// Compiled `cssQuery`, compiled now if it isn't cached. Throw
+  /// `std::runtime_error` if it is malformed.
+  std::shared_ptr<const Selector> get(const std::string &cssQuery);
+
+  [[nodiscard]] size_t size() const;
+
+  /// Cache shared by every thread of the process, used by `Node::select`,
+  /// `Document` and `SelectorSet`.
+  static SelectorCache &shared();
+
+  inline static const size_t DEFAULT_CAPACITY = 512;
+
+  /// Shards of `shared()`.
+  inline static const size_t SHARED_SHARDS = 16;
+
+private:
+  struct Shard {
+    std::mutex mutex;
+
+    /// Most recently used first.
+    std::list<std::shared_ptr<const Selector>> entries;
+
+    std::unordered_map<std::string,
+                       std::list<std::shared_ptr<const Selector>>::iterator>
+        index;
+  };
+
+  /// Capacity of each shard.
+  size_t capacity;
+
+  size_t shardCount;
+
+  std::unique_ptr<Shard[]> shards;
+};
+
+} // namespace crawler
+
+#endif // DOUBANCRAWLER_SELECTOR_H
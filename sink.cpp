@@ -0,0 +1,268 @@
+///
+/// JSON Lines output of crawl results.
+///
+
+#include "sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/// Write all of `buffers` to `fd`, return the number of bytes written.
+size_t writeAll(int fd, std::vector<iovec> &buffers) {
+  size_t total = 0;
+  size_t index = 0;
+  while (index < buffers.size()) {
+    const int count =
+        static_cast<int>(std::min<size_t>(buffers.size() - index, IOV_MAX));
+    ssize_t written = writev(fd, &buffers[index], count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "writev");
+    }
+    total += static_cast<size_t>(written);
+    // skip what has been written, a short write may end inside a buffer.
+    while (written > 0) {
+      iovec &buffer = buffers[index];
+      if (static_cast<size_t>(written) >= buffer.iov_len) {
+        written -= static_cast<ssize_t>(buffer.iov_len);
+        index++;
+      } else {
+        buffer.iov_base = static_cast<char *>(buffer.iov_base) + written;
+        buffer.iov_len -= static_cast<size_t>(written);
+        written = 0;
+      }
+    }
+  }
+  return total;
+}
+
+/// `fsync` the directory holding `path`, so a file just created there
+/// survives a crash.
+void syncDirectory(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  std::string directory = ".";
+  if (slash != std::string::npos) {
+    directory = slash == 0 ? "/" : path.substr(0, slash);
+  }
+  const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), directory);
+  }
+  const int result = fsync(fd);
+  const int code = errno;
+  close(fd);
+  if (result < 0) {
+    throw std::system_error(code, std::generic_category(), "fsync");
+  }
+}
+
+} // namespace
+
+crawler::JsonLinesSink::JsonLinesSink(std::string prefix, SinkOptions options)
+    : prefix(std::move(prefix)), options(options) {
+  openFile();
+  writer = std::thread(&JsonLinesSink::run, this);
+}
+
+crawler::JsonLinesSink::~JsonLinesSink() {
+  try {
+    close();
+  } catch (const std::exception &) {
+  }
+}
+
+void crawler::JsonLinesSink::append(const JsonValue &record) {
+  append(JsonWriter::stringify(record));
+}
+
+void crawler::JsonLinesSink::append(std::string record) {
+  record += '\n';
+  const size_t size = record.size();
+  // counted before it is pushed, so the writer never subtracts it first.
+  const size_t before = stagedBytes.fetch_add(size, std::memory_order_relaxed);
+  auto *node = new Record{std::move(record), nullptr};
+  node->next = staged.load(std::memory_order_relaxed);
+  while (!staged.compare_exchange_weak(node->next, node,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+  }
+  // wake up the writer once, when the batch becomes full.
+  if (before < options.batchBytes && before + size >= options.batchBytes) {
+    {
+      // the writer is either waiting already or sees the new size, so the
+      // notification isn't lost between its check and its wait.
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    wakeUp.notify_one();
+  }
+}
+
+void crawler::JsonLinesSink::sync() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!stopping) {
+    const uint64_t ticket = ++syncRequests;
+    wakeUp.notify_one();
+    synced.wait(lock, [&] { return syncedRequests >= ticket; });
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void crawler::JsonLinesSink::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeUp.notify_one();
+  if (writer.joinable()) {
+    writer.join();
+  }
+  // records appended after `close` are dropped.
+  for (Record *record = staged.exchange(nullptr); record != nullptr;) {
+    std::unique_ptr<Record> dropped(record);
+    record = record->next;
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+std::string crawler::JsonLinesSink::currentPath() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return path;
+}
+
+void crawler::JsonLinesSink::run() {
+  auto lastSync = std::chrono::steady_clock::now();
+  while (true) {
+    uint64_t requests;
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeUp.wait_for(lock, options.flushInterval, [this] {
+        return stopping || syncRequests != syncedRequests ||
+               stagedBytes.load(std::memory_order_relaxed) >=
+                   options.batchBytes;
+      });
+      requests = syncRequests;
+      stop = stopping;
+    }
+    // records staged before a sync request or `close` are taken here.
+    Record *records = staged.exchange(nullptr, std::memory_order_acquire);
+    try {
+      writeRecords(records);
+      const auto now = std::chrono::steady_clock::now();
+      const bool syncDue = stop || requests != syncedRequests ||
+                           options.syncInterval.count() == 0 ||
+                           now - lastSync >= options.syncInterval;
+      if (unsyncedBytes > 0 && syncDue) {
+        if (fdatasync(fd) < 0) {
+          throw std::system_error(errno, std::generic_category(), "fdatasync");
+        }
+        unsyncedBytes = 0;
+        lastSync = now;
+      }
+      const bool full = options.rotateBytes > 0 &&
+                        fileBytes >= options.rotateBytes;
+      const bool old = options.rotateInterval.count() > 0 &&
+                       now - openedAt >= options.rotateInterval;
+      if (!stop && fileBytes > 0 && (full || old)) {
+        rotate();
+      }
+    } catch (const std::exception &) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      syncedRequests = requests;
+    }
+    synced.notify_all();
+    if (stop) {
+      break;
+    }
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+void crawler::JsonLinesSink::writeRecords(Record *records) {
+  // the queue is newest first.
+  std::vector<std::unique_ptr<Record>> batch;
+  for (Record *record = records; record != nullptr; record = record->next) {
+    batch.emplace_back(record);
+  }
+  if (batch.empty()) {
+    return;
+  }
+  std::reverse(batch.begin(), batch.end());
+  std::vector<iovec> buffers;
+  buffers.reserve(batch.size());
+  size_t bytes = 0;
+  for (const auto &record : batch) {
+    buffers.push_back(iovec{record->line.data(), record->line.size()});
+    bytes += record->line.size();
+  }
+  stagedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+  // after an error the records are dropped, `sync` and `close` report it.
+  if (error) {
+    return;
+  }
+  const size_t written = writeAll(fd, buffers);
+  fileBytes += written;
+  unsyncedBytes += written;
+}
+
+void crawler::JsonLinesSink::rotate() {
+  if (unsyncedBytes > 0 && fdatasync(fd) < 0) {
+    throw std::system_error(errno, std::generic_category(), "fdatasync");
+  }
+  unsyncedBytes = 0;
+  ::close(fd);
+  fd = -1;
+  openFile();
+}
+
+void crawler::JsonLinesSink::openFile() {
+  // an existing file is never appended to, eg the one of a previous run.
+  std::string next;
+  do {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%06zu.jsonl", ++fileIndex);
+    next = prefix + suffix;
+    fd = open(next.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  } while (fd < 0 && errno == EEXIST);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), next);
+  }
+  // the directory entry has to be durable before the first group commit.
+  try {
+    syncDirectory(next);
+  } catch (const std::system_error &) {
+    ::close(fd);
+    fd = -1;
+    throw;
+  }
+  fileBytes = 0;
+  openedAt = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  path = std::move(next);
+}
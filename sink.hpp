@@ -0,0 +1,126 @@
+///
+/// JSON Lines output of crawl results.
+///
+
+#ifndef DOUBANCRAWLER_SINK_H
+#define DOUBANCRAWLER_SINK_H
+
+#include "json.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace crawler {
+
+struct SinkOptions {
+  /// Start a new file once the current one holds this many bytes, 0 never.
+  size_t rotateBytes = 256 << 20;
+
+  /// Start a new file once the current one is this old, 0 never.
+  std::chrono::seconds rotateInterval{0};
+
+  /// Longest time a record is staged before it is written.
+  std::chrono::milliseconds flushInterval{100};
+
+  /// Longest time a written record waits for `fdatasync`, records written in
+  /// the meantime are committed together. 0 syncs after every write.
+  std::chrono::milliseconds syncInterval{1000};
+
+  /// Staged bytes which wake up the writer before `flushInterval`.
+  size_t batchBytes = 1 << 20;
+};
+
+/// Append one json record per line to files named
+/// `<prefix>-000001.jsonl`, `<prefix>-000002.jsonl`, ..., eg:
+///   crawler::JsonLinesSink sink("output/movies");
+///   // from any worker thread
+///   sink.append(movie);
+///   sink.sync();
+/// Records are pushed to a lock-free staging queue, a single writer thread
+/// takes them by batches and writes each batch with `writev`. Written files
+/// are `fdatasync`ed every `syncInterval`, as a group commit of the records
+/// written since the last one. The directory is `fsync`ed after each new file
+/// is created, so a rotated file doesn't vanish after a crash.
+class JsonLinesSink {
+public:
+  explicit JsonLinesSink(std::string prefix,
+                         SinkOptions options = SinkOptions());
+
+  /// Close the sink, errors are ignored, call `close` to see them.
+  ~JsonLinesSink();
+
+  JsonLinesSink(const JsonLinesSink &) = delete;
+
+  JsonLinesSink &operator=(const JsonLinesSink &) = delete;
+
+  /// Append `record`, safe to call from many threads.
+  void append(const JsonValue &record);
+
+  /// Append a serialized record without its newline, eg the buffer of a
+  /// `JsonWriter`.
+  void append(std::string record);
+
+  /// Block until the records appended before are written and synced to disk.
+  /// Rethrow the first error of the writer.
+  void sync();
+
+  /// Write and sync the records left, then stop the writer. Records appended
+  /// afterwards are dropped. Rethrow the first error of the writer.
+  void close();
+
+  /// Path of the file being written.
+  [[nodiscard]] std::string currentPath() const;
+
+private:
+  struct Record {
+    std::string line;
+    Record *next;
+  };
+
+  /// Writer thread.
+  void run();
+
+  /// Write `records`, oldest first, with as few `writev` as possible.
+  void writeRecords(Record *records);
+
+  /// Close the current file and open the next one.
+  void rotate();
+
+  void openFile();
+
+  std::string prefix;
+  SinkOptions options;
+
+  /// Staged records, newest first.
+  std::atomic<Record *> staged{nullptr};
+  std::atomic<size_t> stagedBytes{0};
+
+  /// Guards the fields below, the writer sleeps on `wakeUp`.
+  mutable std::mutex mutex;
+  std::condition_variable wakeUp;
+  std::condition_variable synced;
+  bool stopping = false;
+  uint64_t syncRequests = 0;
+  uint64_t syncedRequests = 0;
+  std::exception_ptr error;
+  std::string path;
+
+  /// Used by the writer thread only.
+  int fd = -1;
+  size_t fileIndex = 0;
+  size_t fileBytes = 0;
+  std::chrono::steady_clock::time_point openedAt;
+  /// Bytes written since the last `fdatasync`.
+  size_t unsyncedBytes = 0;
+
+  std::thread writer;
+};
+
+} // namespace crawler
+#endif // DOUBANCRAWLER_SINK_H
@@ -0,0 +1,477 @@
+///
+/// Css queries compiled at compile time into statically dispatched matchers.
+///
+
+#ifndef DOUBANCRAWLER_STATIC_SELECTOR_H
+#define DOUBANCRAWLER_STATIC_SELECTOR_H
+
+#include "dom.hpp"
+#include "selector.hpp"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace crawler {
+
+/// Instruction of a `StaticSelector`, the operands are ranges of its text.
+struct StaticOp {
+  SelectorOp::Code code = SelectorOp::Code::Tag;
+  uint32_t keyBegin = 0;
+  uint32_t keyLength = 0;
+  uint32_t valueBegin = 0;
+  uint32_t valueLength = 0;
+  /// `ElementData::classBit` of the key of a class selector.
+  unsigned bit = 0;
+};
+
+/// Program of a query of `Length` characters, laid out like the one of
+/// `Selector`. An instruction takes at least a character of the query, so
+/// the sizes are known before parsing.
+template <size_t Length> struct StaticProgram {
+  /// The query, with the tag names and attribute names in lower case.
+  std::array<char, Length + 1> text{};
+
+  std::array<StaticOp, Length + 1> ops{};
+
+  size_t size = 0;
+
+  /// The program of alternative `i` runs from `begins[i]` to
+  /// `begins[i + 1]`.
+  std::array<size_t, Length + 2> begins{};
+
+  size_t alternatives = 0;
+};
+
+/// Compile a query at compile time, with the grammar of `Selector`: the
+/// scanning follows `TokenQueue`, eg `consumeCssIdentifier` and
+/// `chompBalanced`. A malformed query, or a pseudo class which isn't
+/// supported here, throws, which fails the compilation.
+template <size_t Length> class StaticCompiler {
+public:
+  using Code = SelectorOp::Code;
+
+  constexpr explicit StaticCompiler(const char *query) {
+    for (size_t i = 0; i < Length; i++) {
+      program.text[i] = query[i];
+    }
+  }
+
+  constexpr StaticProgram<Length> compile() {
+    do {
+      compileAlternative();
+    } while (matchesChomp(','));
+    return program;
+  }
+
+private:
+  [[nodiscard]] constexpr bool eof() const { return pos >= Length; }
+
+  [[nodiscard]] constexpr char peek() const {
+    return eof() ? '\0' : program.text[pos];
+  }
+
+  constexpr bool matchesChomp(char c) {
+    if (peek() != c || eof()) {
+      return false;
+    }
+    pos++;
+    return true;
+  }
+
+  static constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+           c == '\v';
+  }
+
+  static constexpr bool isWord(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9');
+  }
+
+  /// Same as `QueryParser::COMBINATORS`.
+  static constexpr bool isCombinator(char c) {
+    return c == ',' || c == '>' || c == '+' || c == '~' || c == ' ';
+  }
+
+  constexpr bool consumeWhiteSpace() {
+    bool seen = false;
+    while (!eof() && isSpace(peek())) {
+      pos++;
+      seen = true;
+    }
+    return seen;
+  }
+
+  /// Same as `TokenQueue::consumeCssIdentifier`, return where it begins.
+  constexpr size_t consumeCssIdentifier() {
+    const size_t begin = pos;
+    while (!eof() && (isWord(peek()) || peek() == '-' || peek() == '_')) {
+      pos++;
+    }
+    return begin;
+  }
+
+  /// Same as `TokenQueue::consumeElementSelector`, return where it begins.
+  constexpr size_t consumeElementSelector() {
+    const size_t begin = pos;
+    while (!eof()) {
+      const char c = peek();
+      const bool namespaced = c == '*' && pos + 1 < Length &&
+                              program.text[pos + 1] == '|';
+      if (!isWord(c) && c != '|' && c != '_' && c != '-' && !namespaced) {
+        break;
+      }
+      pos++;
+    }
+    return begin;
+  }
+
+  /// Same as `TokenQueue::chompBalanced('[', ']')`, store the range inside
+  /// the brackets in `begin` and `end`.
+  constexpr void chompBrackets(size_t &begin, size_t &end) {
+    int depth = 0;
+    char last = 0;
+    bool isSingleQuote = false;
+    bool isDoubleQuote = false;
+    begin = pos + 1;
+    do {
+      if (eof()) {
+        throw std::runtime_error("Unbalanced attribute selector");
+      }
+      const char c = program.text[pos++];
+      if (last != '\\') {
+        if (c == '\'' && !isDoubleQuote) {
+          isSingleQuote = !isSingleQuote;
+        } else if (c == '"' && !isSingleQuote) {
+          isDoubleQuote = !isDoubleQuote;
+        }
+        if (isSingleQuote || isDoubleQuote) {
+          continue;
+        }
+        if (c == '[') {
+          depth++;
+        } else if (c == ']') {
+          depth--;
+        }
+      }
+      last = c;
+    } while (depth > 0);
+    end = pos - 1;
+  }
+
+  /// Shrink the range from `begin` to `end` to its text without the
+  /// surrounding whitespace, like `trim`.
+  constexpr void trim(size_t &begin, size_t &end) const {
+    while (begin < end && isSpace(program.text[begin])) {
+      begin++;
+    }
+    while (end > begin && isSpace(program.text[end - 1])) {
+      end--;
+    }
+  }
+
+  constexpr void lowerCase(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      if (program.text[i] >= 'A' && program.text[i] <= 'Z') {
+        program.text[i] = static_cast<char>(program.text[i] - 'A' + 'a');
+      }
+    }
+  }
+
+  static constexpr StaticOp makeOp(Code code, size_t keyBegin,
+                                   size_t keyEnd) {
+    StaticOp op;
+    op.code = code;
+    op.keyBegin = static_cast<uint32_t>(keyBegin);
+    op.keyLength = static_cast<uint32_t>(keyEnd - keyBegin);
+    return op;
+  }
+
+  /// Same as `Selector::compileAlternative`.
+  constexpr void compileAlternative() {
+    // compound selectors from left to right, compound `i` is
+    // `ops[compoundBegins[i]]` to `ops[compoundBegins[i + 1]]`, each but the
+    // first one is reached by `combinators[i - 1]`.
+    std::array<StaticOp, Length + 1> ops{};
+    size_t size = 0;
+    std::array<size_t, Length + 2> compoundBegins{};
+    std::array<Code, Length + 1> combinators{};
+    std::array<bool, Length + 1> found{};
+    size_t compounds = 1;
+    consumeWhiteSpace();
+    while (!eof()) {
+      found[compounds - 1] = compileCompound(ops, size);
+      const bool seenWhiteSpace = consumeWhiteSpace();
+      if (eof() || peek() == ',') {
+        break;
+      }
+      if (matchesChomp('>')) {
+        combinators[compounds - 1] = Code::Child;
+      } else if (matchesChomp('+')) {
+        combinators[compounds - 1] = Code::Adjacent;
+      } else if (matchesChomp('~')) {
+        combinators[compounds - 1] = Code::Sibling;
+      } else if (seenWhiteSpace) {
+        combinators[compounds - 1] = Code::Descendant;
+      } else {
+        throw std::runtime_error("Missing combinator in query");
+      }
+      consumeWhiteSpace();
+      compoundBegins[compounds] = size;
+      compounds++;
+    }
+    compoundBegins[compounds] = size;
+    for (size_t i = 0; i < compounds; i++) {
+      // a leading combinator, eg "> p", applies to any element.
+      if (!found[i] && !(i == 0 && compounds > 1)) {
+        throw std::runtime_error("Missing selector in query");
+      }
+    }
+    program.begins[program.alternatives] = program.size;
+    for (size_t i = compounds; i > 0; i--) {
+      const size_t first = program.size;
+      for (size_t op = compoundBegins[i - 1]; op < compoundBegins[i]; op++) {
+        // insertion sort by cost, stable like the one of `Selector`.
+        size_t at = program.size++;
+        while (at > first && SelectorOp::cost(program.ops[at - 1].code) >
+                                 SelectorOp::cost(ops[op].code)) {
+          program.ops[at] = program.ops[at - 1];
+          at--;
+        }
+        program.ops[at] = ops[op];
+      }
+      if (i > 1) {
+        StaticOp combinator;
+        combinator.code = combinators[i - 2];
+        program.ops[program.size++] = combinator;
+      }
+    }
+    program.alternatives++;
+    program.begins[program.alternatives] = program.size;
+  }
+
+  /// Same as `Selector::compileCompound`.
+  constexpr bool compileCompound(std::array<StaticOp, Length + 1> &ops,
+                                 size_t &size) {
+    bool found = false;
+    while (!eof() && !isSpace(peek()) && !isCombinator(peek())) {
+      if (matchesChomp('#')) {
+        const size_t begin = consumeCssIdentifier();
+        ops[size++] = makeOp(Code::Id, begin, pos);
+      } else if (matchesChomp('.')) {
+        const size_t begin = consumeCssIdentifier();
+        StaticOp op = makeOp(Code::Class, begin, pos);
+        op.bit = ElementData::classBit(
+            std::string_view(program.text.data() + begin, pos - begin));
+        ops[size++] = op;
+      } else if (matchesChomp('*')) {
+        // the universal selector tests nothing.
+      } else if (isWord(peek())) {
+        const size_t begin = consumeElementSelector();
+        lowerCase(begin, pos);
+        ops[size++] = makeOp(Code::Tag, begin, pos);
+      } else if (peek() == '[') {
+        size_t begin = 0;
+        size_t end = 0;
+        chompBrackets(begin, end);
+        ops[size++] = compileAttribute(begin, end);
+      } else {
+        throw std::runtime_error("Unsupported token in static query");
+      }
+      found = true;
+    }
+    return found;
+  }
+
+  /// Same as `Selector::compileAttribute`, for the text from `begin` to
+  /// `end` inside "[...]".
+  constexpr StaticOp compileAttribute(size_t begin, size_t end) {
+    // the key ends at the first operator, like `consumeToAny(ATTRIBUTES)`.
+    size_t keyEnd = begin;
+    while (keyEnd < end && program.text[keyEnd] != '=' &&
+           !(keyEnd + 1 < end && program.text[keyEnd + 1] == '=' &&
+             (program.text[keyEnd] == '!' || program.text[keyEnd] == '^' ||
+              program.text[keyEnd] == '$' || program.text[keyEnd] == '*' ||
+              program.text[keyEnd] == '~'))) {
+      keyEnd++;
+    }
+    size_t keyBegin = begin;
+    size_t key = keyEnd;
+    trim(keyBegin, key);
+    lowerCase(keyBegin, key);
+    if (keyEnd == end) {
+      if (keyBegin < key && program.text[keyBegin] == '^') {
+        return makeOp(Code::AttributeKeyPrefix, keyBegin + 1, key);
+      }
+      return makeOp(Code::Attribute, keyBegin, key);
+    }
+    Code code = Code::AttributeEquals;
+    size_t valueBegin = keyEnd + 2;
+    switch (program.text[keyEnd]) {
+    case '=':
+      valueBegin = keyEnd + 1;
+      break;
+    case '!':
+      code = Code::AttributeNotEquals;
+      break;
+    case '^':
+      code = Code::AttributePrefix;
+      break;
+    case '$':
+      code = Code::AttributeSuffix;
+      break;
+    case '*':
+      code = Code::AttributeContains;
+      break;
+    default:
+      code = Code::AttributeWord;
+    }
+    size_t valueEnd = end;
+    trim(valueBegin, valueEnd);
+    // strip the quotes, like `unquote`.
+    if (valueEnd - valueBegin >= 2 &&
+        (program.text[valueBegin] == '"' ||
+         program.text[valueBegin] == '\'') &&
+        program.text[valueEnd - 1] == program.text[valueBegin]) {
+      valueBegin++;
+      valueEnd--;
+    }
+    StaticOp op = makeOp(code, keyBegin, key);
+    op.valueBegin = static_cast<uint32_t>(valueBegin);
+    op.valueLength = static_cast<uint32_t>(valueEnd - valueBegin);
+    return op;
+  }
+
+  StaticProgram<Length> program;
+
+  size_t pos = 0;
+};
+
+/// Css query compiled at compile time into a matcher without a program to
+/// interpret: each instruction is picked by `if constexpr` and every operand
+/// is a constant, so the compiler can inline the whole query. For the fixed
+/// queries of an extractor, eg:
+///   static constexpr char LINKS[] = "div.item > a[href]";
+///   crawler::Nodes links = crawler::StaticSelector<LINKS>::select(root);
+/// The results are the same as the ones of `Selector`. Pseudo classes are not
+/// supported, and neither is the ancestor filter.
+template <const char *Query> class StaticSelector {
+public:
+  /// If `element` matches the query.
+  [[nodiscard]] static bool matches(const Node &element) {
+    return element.isElement() &&
+           matchesAny(element,
+                      std::make_index_sequence<PROGRAM.alternatives>());
+  }
+
+  /// Nodes of the subtree of `root` matched by the query, in document order.
+  [[nodiscard]] static Nodes select(const Node &root) {
+    Nodes result;
+    for (const Node &node : root.preorder()) {
+      if (matches(node)) {
+        result.emplace_back(node);
+      }
+    }
+    return result;
+  }
+
+  /// First node of the subtree of `root` matched by the query, null if there
+  /// is none.
+  [[nodiscard]] static const Node *selectFirst(const Node &root) {
+    for (const Node &node : root.preorder()) {
+      if (matches(node)) {
+        return &node;
+      }
+    }
+    return nullptr;
+  }
+
+  static constexpr size_t LENGTH = std::char_traits<char>::length(Query);
+
+  static constexpr StaticProgram<LENGTH> PROGRAM =
+      StaticCompiler<LENGTH>(Query).compile();
+
+private:
+  using Code = SelectorOp::Code;
+
+  template <size_t... Alternative>
+  static bool matchesAny(const Node &element,
+                         std::index_sequence<Alternative...>) {
+    return (matchesFrom<PROGRAM.begins[Alternative],
+                        PROGRAM.begins[Alternative + 1]>(element) ||
+            ...);
+  }
+
+  /// Run the program from `PC` to `End` against `node`.
+  template <size_t PC, size_t End> static bool matchesFrom(const Node &node) {
+    if constexpr (PC == End) {
+      return true;
+    } else {
+      constexpr Code code = PROGRAM.ops[PC].code;
+      if constexpr (code == Code::Child) {
+        const Node *parent = node.getParent();
+        return parent != nullptr && matchesFrom<PC + 1, End>(*parent);
+      } else if constexpr (code == Code::Adjacent) {
+        const Node *sibling = previousElement(node);
+        return sibling != nullptr && matchesFrom<PC + 1, End>(*sibling);
+      } else if constexpr (code == Code::Descendant) {
+        // backtrack: the rest of the query may match any ancestor.
+        for (const Node *ancestor = node.getParent(); ancestor != nullptr;
+             ancestor = ancestor->getParent()) {
+          if (matchesFrom<PC + 1, End>(*ancestor)) {
+            return true;
+          }
+        }
+        return false;
+      } else if constexpr (code == Code::Sibling) {
+        // backtrack: the rest of the query may match any previous sibling.
+        for (const Node *sibling = previousElement(node); sibling != nullptr;
+             sibling = previousElement(*sibling)) {
+          if (matchesFrom<PC + 1, End>(*sibling)) {
+            return true;
+          }
+        }
+        return false;
+      } else {
+        return test<PC>(node.getElementData()) &&
+               matchesFrom<PC + 1, End>(node);
+      }
+    }
+  }
+
+  /// Run the simple selector at `PC` against `element`.
+  template <size_t PC> static bool test(const ElementData &element) {
+    constexpr StaticOp op = PROGRAM.ops[PC];
+    constexpr std::string_view key(PROGRAM.text.data() + op.keyBegin,
+                                   op.keyLength);
+    if constexpr (op.code == Code::Tag) {
+      return element.getTagName() == key;
+    } else if constexpr (op.code == Code::Id) {
+      const AttrMap &attributes = element.getAttributes();
+      auto id = attributes.find("id");
+      return id == attributes.end() ? key.empty() : id->second == key;
+    } else if constexpr (op.code == Code::Class) {
+      return element.hasClass(key, op.bit);
+    } else {
+      constexpr std::string_view value(PROGRAM.text.data() + op.valueBegin,
+                                       op.valueLength);
+      return testAttribute(op.code, element.getAttributes(), key, value);
+    }
+  }
+
+  /// Nearest sibling element in front of `node`, null if there is none.
+  static const Node *previousElement(const Node &node) {
+    const Node *sibling = node.previousSibling();
+    while (sibling != nullptr && !sibling->isElement()) {
+      sibling = sibling->previousSibling();
+    }
+    return sibling;
+  }
+};
+
+} // namespace crawler
+
+#endif // DOUBANCRAWLER_STATIC_SELECTOR_H
@@ -38,6 +38,17 @@ inline std::string normalize(const std::string &input) {
   return buffer;
 } // namespace crawler
 
+/// Remove the leading and trailing whitespace of `input`.
+inline std::string trim(const std::string &input) {
+  const char *whitespace = " \t\n\r\f\v";
+  const size_t begin = input.find_first_not_of(whitespace);
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  const size_t end = input.find_last_not_of(whitespace);
+  return input.substr(begin, end - begin + 1);
+}
+
 /// Check if `source` starts with `prefix`
 inline bool startsWith(const std::string &prefix, const std::string &source) {
   //  return source.rfind(prefix, 0) == 0;
@@ -69,5 +80,26 @@ inline bool containsIgnoreCase(const std::string &source,
   return contains(normalize(source), normalize(target));
 }
 
+/// Append the UTF-8 encoding of `codePoint` to `output`, a `std::string` or
+/// a string with another allocator.
+template <typename String>
+inline void appendUtf8(String &output, char32_t codePoint) {
+  if (codePoint < 0x80) {
+    output += static_cast<char>(codePoint);
+  } else if (codePoint < 0x800) {
+    output += static_cast<char>(0xC0 | (codePoint >> 6));
+    output += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else if (codePoint < 0x10000) {
+    output += static_cast<char>(0xE0 | (codePoint >> 12));
+    output += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    output += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else {
+    output += static_cast<char>(0xF0 | (codePoint >> 18));
+    output += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    output += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    output += static_cast<char>(0x80 | (codePoint & 0x3F));
+  }
+}
+
 } // namespace crawler
 #endif // DOUBANCRAWLER_STRINGS_H
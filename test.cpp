@@ -2,15 +2,26 @@
 // Created by Ramsay on 2019/9/9.
 //
 #include "test.hpp"
+#include "charset.hpp"
 #include "dom.hpp"
+#include "entities.hpp"
 #include "html.hpp"
 #include "http.hpp"
 #include "json.hpp"
+#include "selector.hpp"
+#include "sink.hpp"
+#include "static_selector.hpp"
 #include "utils.hpp"
 
+#include <cerrno>
 #include <fstream>
+#include <memory>
+#include <memory_resource>
 #include <regex>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
 
 /// Html Start
 void printNode(const crawler::Node &result) {
@@ -22,6 +33,22 @@ void printNode(const crawler::Node &result) {
   }
 }
 
+/// Serialize the tree under `node`, used to compare two trees.
+std::string dumpNode(const crawler::Node &node) {
+  if (node.isText()) {
+    return "\"" + node.getText() + "\"";
+  }
+  std::string result = "<" + node.getElementData().getTagName();
+  for (auto const &keyValuePair : node.getElementData().getAttributes()) {
+    result += " " + keyValuePair.first + "=" + keyValuePair.second;
+  }
+  result += ">";
+  for (auto const &child : node.getChildren()) {
+    result += dumpNode(child);
+  }
+  return result + "</>";
+}
+
 void testEqualMacro() {
   ASSERT_TRUE(true);
   ASSERT_CSTRING_EQ("div", "div");
@@ -200,6 +227,16 @@ void testParserParse() {
   pEval = classParser.parse();
   auto *classEval = dynamic_cast<crawler::Class *>(*pEval);
   ASSERT_TRUE(classEval != nullptr);
+
+  // the evaluators of a query live as long as its result.
+  std::shared_ptr<crawler::Evaluator *> query =
+      crawler::QueryParser::parse("div.list > a[href], h1 + p");
+  std::weak_ptr<crawler::Evaluator *> weakQuery = query;
+  crawler::Node root = crawler::parse(
+      "<div class=\"list\"><a href=\"/\">a</a></div><h1>h</h1><p>p</p>");
+  ASSERT_UNSIGNED_LONG_EQ(root.select(*query).size(), 2ul);
+  query.reset();
+  ASSERT_TRUE(weakQuery.expired());
 }
 
 void testSelect() {
@@ -374,6 +411,1020 @@ void testParseDoctype() {
   printNode(node);
 }
 
+/// Decode `input` chunk by chunk with a `charset` decoder.
+std::string decodeCharset(crawler::Charset charset, const std::string &input,
+                          size_t chunkSize) {
+  std::string output;
+  const crawler::TextSink append = [&output](std::string_view text) {
+    output.append(text);
+  };
+  crawler::CharsetDecoder decoder(charset);
+  for (size_t pos = 0; pos < input.size(); pos += chunkSize) {
+    decoder.decode(input.data() + pos, std::min(chunkSize, input.size() - pos),
+                   append);
+  }
+  decoder.finish(append);
+  return output;
+}
+
+/// If `StaticSelector<Query>` and the runtime `Selector` agree on every node
+/// of `root`, with `count` nodes matched.
+template <const char *Query>
+bool matchesLikeSelector(const crawler::Node &root, size_t count) {
+  const crawler::Selector selector(Query);
+  size_t matched = 0;
+  for (const crawler::Node &node : root.preorder()) {
+    const bool matches = crawler::StaticSelector<Query>::matches(node);
+    if (matches != selector.matches(node)) {
+      return false;
+    }
+    matched += matches ? 1 : 0;
+  }
+  return matched == count &&
+         crawler::StaticSelector<Query>::select(root).size() == count;
+}
+
+void testStaticSelector() {
+  crawler::Node root = crawler::parse(
+      "<div id=\"main\" class=\"list\"><h1>Movies</h1>"
+      "<ul><li class=\"item new\"><a href=\"http://movie/1\">1</a></li>"
+      "<li class=\"item\"><A HREF=\"/2\" rel=\"nofollow noopener\">2</A>"
+      "</li><li class=\"ad\" data-id=\"3\">ad</li></ul><p>end</p></div>");
+  static constexpr char LINKS[] = "div.list li > a[href]";
+  static constexpr char TAG[] = "LI";
+  static constexpr char ID[] = "#main";
+  static constexpr char CLASSES[] = "li.item.new";
+  static constexpr char ANY[] = "ul > *";
+  static constexpr char ADJACENT[] = "h1 + ul";
+  static constexpr char SIBLING[] = "h1 ~ p";
+  static constexpr char GROUP[] = "h1, p,li.ad";
+  static constexpr char PREFIX[] = "[ HREF ^= 'http' ]";
+  static constexpr char WORD[] = "a[rel~=nofollow]";
+  static constexpr char NOT_EQUALS[] = "li[class!=ad]";
+  static constexpr char KEY_PREFIX[] = "[^data-]";
+  static constexpr char SUFFIX[] = "a[href$=\"/2\"]";
+  static constexpr char LEADING[] = "> li";
+  static constexpr char MISSING[] = "table td";
+  ASSERT_TRUE(matchesLikeSelector<LINKS>(root, 2));
+  ASSERT_TRUE(matchesLikeSelector<TAG>(root, 3));
+  ASSERT_TRUE(matchesLikeSelector<ID>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<CLASSES>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<ANY>(root, 3));
+  ASSERT_TRUE(matchesLikeSelector<ADJACENT>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<SIBLING>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<GROUP>(root, 3));
+  ASSERT_TRUE(matchesLikeSelector<PREFIX>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<WORD>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<NOT_EQUALS>(root, 2));
+  ASSERT_TRUE(matchesLikeSelector<KEY_PREFIX>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<SUFFIX>(root, 1));
+  ASSERT_TRUE(matchesLikeSelector<LEADING>(root, 3));
+  ASSERT_TRUE(matchesLikeSelector<MISSING>(root, 0));
+  // a copied subtree keeps its siblings, a copied node only its ancestors.
+  const crawler::Node main = root.select("#main").front();
+  const crawler::Node list = root.select("ul").front();
+  const crawler::Node end = root.select("p").front();
+  ASSERT_TRUE(matchesLikeSelector<ADJACENT>(main, 1));
+  ASSERT_TRUE(matchesLikeSelector<SIBLING>(main, 1));
+  ASSERT_TRUE(matchesLikeSelector<ADJACENT>(list, 0));
+  ASSERT_TRUE(matchesLikeSelector<SIBLING>(end, 0));
+  ASSERT_TRUE(matchesLikeSelector<LINKS>(list, 2));
+
+  // the query is compiled by the compiler.
+  using Links = crawler::StaticSelector<LINKS>;
+  static_assert(Links::PROGRAM.alternatives == 1);
+  static_assert(Links::PROGRAM.size == 7);
+  static_assert(Links::PROGRAM.ops[1].code ==
+                crawler::SelectorOp::Code::Attribute);
+  const crawler::Node *first = Links::selectFirst(root);
+  ASSERT_TRUE(first != nullptr);
+  ASSERT_CSTRING_EQ(first->getElementData().getValueByKey("href").c_str(),
+                    "http://movie/1");
+}
+
+void testClassTokens() {
+  crawler::Node root = crawler::parse(
+      "<ul class=\"list\"><li class=\"item active\">1</li>"
+      "<li class=\"  item\titem new \">2</li><li class=\"items\">3</li>"
+      "<li class=\"\">4</li><li>5</li></ul>");
+  const crawler::Nodes items = root.select("li");
+  const crawler::ElementData &first = items.at(0).getElementData();
+  ASSERT_TRUE(first.hasClass("item"));
+  ASSERT_TRUE(first.hasClass("active"));
+  ASSERT_FALSE(first.hasClass("item active"));
+  ASSERT_FALSE(first.hasClass("act"));
+  ASSERT_FALSE(first.hasClass(""));
+  const crawler::ElementData &second = items.at(1).getElementData();
+  ASSERT_UNSIGNED_LONG_EQ(second.getClasses().size(), 2ul);
+  ASSERT_CSTRING_EQ(second.getClasses().at(0).c_str(), "item");
+  ASSERT_CSTRING_EQ(second.getClasses().at(1).c_str(), "new");
+  ASSERT_TRUE(crawler::ElementData::classBit("item") < 64);
+
+  // a class selector matches a token, not a substring of the attribute.
+  ASSERT_UNSIGNED_LONG_EQ(root.select(".item").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("li.item.new").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select(".list .active").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("li.items").size(), 1ul);
+  ASSERT_TRUE(root.select(".ite").empty());
+  // the legacy evaluators agree.
+  crawler::Class active("active");
+  ASSERT_UNSIGNED_LONG_EQ(root.select(&active).size(), 1ul);
+  crawler::Document document(root);
+  ASSERT_UNSIGNED_LONG_EQ(document.select("li.item.new").size(), 1ul);
+  ASSERT_TRUE(crawler::startsWith("scan class index \"new\", 1 elements\n",
+                                  document.explain("li.item.new")));
+}
+
+void testSelectorPlan() {
+  // cheap and selective tests first, whatever the order of the query.
+  using Code = crawler::SelectorOp::Code;
+  crawler::Selector selector("[href].x:first-child a#y");
+  const std::vector<crawler::SelectorOp> &program = selector.getProgram();
+  ASSERT_UNSIGNED_LONG_EQ(program.size(), 6ul);
+  ASSERT_TRUE(program[0].code == Code::Id);
+  ASSERT_TRUE(program[1].code == Code::Tag);
+  ASSERT_TRUE(program[2].code == Code::Descendant);
+  ASSERT_TRUE(program[3].code == Code::Class);
+  ASSERT_TRUE(program[4].code == Code::Attribute);
+  ASSERT_TRUE(program[5].code == Code::NthChild);
+  ASSERT_UNSIGNED_LONG_EQ(selector.indexKeys().size(), 2ul);
+  ASSERT_TRUE(selector.indexKey().kind == crawler::IndexKey::Kind::Id);
+  ASSERT_CSTRING_EQ(crawler::Selector("div > a").explain().c_str(),
+                    "alternative 0, ancestor filter terms 1\n"
+                    "  0 Tag a\n  1 Child\n  2 Tag div\n");
+
+  crawler::Tag tag("p");
+  crawler::Class clazz("x");
+  crawler::Attribute attribute("href");
+  crawler::ImmediateParent parent(
+      std::make_shared<crawler::Evaluator *>(&tag));
+  crawler::Parent ancestor(std::make_shared<crawler::Evaluator *>(&tag));
+  ASSERT_TRUE(tag.cost() < clazz.cost());
+  ASSERT_TRUE(clazz.cost() < attribute.cost());
+  ASSERT_TRUE(attribute.cost() < parent.cost());
+  ASSERT_TRUE(parent.cost() < ancestor.cost());
+
+  std::string html = "<ul>";
+  for (int i = 0; i < 100; i++) {
+    html += "<li class=\"item\">" + std::to_string(i) + "</li>";
+  }
+  html += "<li class=\"new\">a</li><li class=\"new\">b</li></ul>";
+  crawler::Document document(crawler::parse(html));
+  // the rarest term is scanned rather than the tag.
+  const std::string plan = document.explain("ul li.new");
+  ASSERT_TRUE(
+      crawler::startsWith("scan class index \"new\", 2 elements\n", plan));
+  ASSERT_UNSIGNED_LONG_EQ(document.select("ul li.new").size(), 2ul);
+  ASSERT_TRUE(crawler::startsWith("scan tag index \"li\", 102 elements\n",
+                                  document.explain("ul > li")));
+  ASSERT_TRUE(crawler::startsWith("scan class index \"missing\", 0 elements\n",
+                                  document.explain("li.missing")));
+  ASSERT_TRUE(
+      crawler::startsWith("walk the tree\n", document.explain("h1, li")));
+  ASSERT_UNSIGNED_LONG_EQ(document.select("h1, li").size(), 102ul);
+}
+
+void testPseudoClassSelect() {
+  crawler::Node root = crawler::parse(
+      "<ul><li id=\"1\">Inception</li>text<li id=\"2\">Alien</li>"
+      "<li id=\"3\" class=\"ad\">Sponsored</li><p id=\"4\">x</p>"
+      "<li id=\"5\"><a href=\"/5\"><img src=\"5.jpg\"></a></li></ul>"
+      "<div id=\"6\"><span id=\"7\">only</span></div>");
+  auto ids = [&root](const std::string &query) {
+    std::string result;
+    for (const crawler::Node &node : root.select(query)) {
+      result += node.getElementData().id();
+    }
+    return result;
+  };
+  ASSERT_CSTRING_EQ(ids("li:first-child").c_str(), "1");
+  ASSERT_CSTRING_EQ(ids("li:last-child").c_str(), "5");
+  ASSERT_CSTRING_EQ(ids("ul > :nth-child(odd)").c_str(), "135");
+  ASSERT_CSTRING_EQ(ids("ul > :nth-child(2n)").c_str(), "24");
+  ASSERT_CSTRING_EQ(ids("ul > :nth-child(-n+2)").c_str(), "12");
+  ASSERT_CSTRING_EQ(ids("ul > :nth-last-child(2)").c_str(), "4");
+  ASSERT_CSTRING_EQ(ids("li:nth-of-type(4)").c_str(), "5");
+  ASSERT_CSTRING_EQ(ids(":only-child").c_str(), "7");
+  ASSERT_CSTRING_EQ(ids("li:not(.ad)").c_str(), "125");
+  ASSERT_CSTRING_EQ(ids("li:has(img)").c_str(), "5");
+  ASSERT_CSTRING_EQ(ids("li:has(> img)").c_str(), "");
+  ASSERT_CSTRING_EQ(ids("[id]:has(> span)").c_str(), "6");
+  ASSERT_CSTRING_EQ(ids("li:contains(ALIEN)").c_str(), "2");
+  ASSERT_CSTRING_EQ(ids("li:contains('spon'):nth-child(3)").c_str(), "3");
+  // the node by itself, without the context of a walk.
+  const crawler::Node *item = root.selectFirst("li:has(a > img)");
+  ASSERT_TRUE(item != nullptr);
+  ASSERT_TRUE(crawler::Selector("li:has(img)").matches(*item));
+  ASSERT_FALSE(crawler::Selector("li:first-child").matches(*item));
+  crawler::SelectorSet rules;
+  rules.add("li:has(img)");
+  rules.add("li:not(:has(img))");
+  auto found = rules.select(root);
+  ASSERT_UNSIGNED_LONG_EQ(found[0].size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(found[1].size(), 3ul);
+  // a selected node keeps its positions and its own subtree.
+  crawler::Nodes items = root.select("li");
+  ASSERT_UNSIGNED_LONG_EQ(items.at(1).select("li:nth-child(2)").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(items.at(3).select("li:last-child").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(items.at(3).select("li:has(img)").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(items.at(3).select("li:has(> img)").size(), 0ul);
+  crawler::Node list = root.select("ul").front();
+  ASSERT_UNSIGNED_LONG_EQ(list.select("ul:first-child").size(), 1ul);
+  ASSERT_CSTRING_EQ(ids("li:has(a)").c_str(), "5");
+  ASSERT_UNSIGNED_LONG_EQ(list.select("li:has(a)").size(), 1ul);
+  for (const char *query : {"li:nth-child(n+)", "li:nth-child(x)",
+                            "li:hover", "li:nth-child()"}) {
+    bool thrown = false;
+    try {
+      crawler::Selector selector(query);
+    } catch (const std::runtime_error &e) {
+      thrown = true;
+    }
+    ASSERT_TRUE(thrown);
+  }
+}
+
+void testSelectorSet() {
+  std::string html = "<div id=\"content\"><h1>Movies</h1><ul>";
+  for (int i = 0; i < 50; i++) {
+    const std::string index = std::to_string(i);
+    html += "<li class=\"item\"><span class=\"pl\">" + index +
+            "</span><a href=\"http://movie/" + index + "\">movie</a>" +
+            "<div><a href=\"/" + index + "\"><img src=\"" + index +
+            ".jpg\"></a></div><div id=\"info" + index + "\"></div></li>";
+  }
+  html += "</ul><h2>More</h2></div>";
+  crawler::Node root = crawler::parse(html);
+  const std::vector<std::string> queries = {
+      "a",       "div > a[href]", "#content h1", "span.pl", ".pl + a",
+      "img",     "div ~ div",     "h1, h2",      "*",       "[href^=http]",
+      "missing", "li a",          ".item",       "#info7"};
+  crawler::SelectorSet rules;
+  for (const std::string &query : queries) {
+    rules.add(query);
+  }
+  ASSERT_UNSIGNED_LONG_EQ(rules.size(), queries.size());
+  std::vector<std::vector<const crawler::Node *>> found = rules.select(root);
+  ASSERT_UNSIGNED_LONG_EQ(found.size(), queries.size());
+  // same results as one walk per query.
+  size_t mismatches = 0;
+  for (size_t i = 0; i < queries.size(); i++) {
+    crawler::Nodes nodes = root.select(queries[i]);
+    if (nodes.size() != found[i].size()) {
+      mismatches++;
+      continue;
+    }
+    for (size_t j = 0; j < nodes.size(); j++) {
+      const crawler::ElementData &expected = nodes[j].getElementData();
+      const crawler::ElementData &actual = found[i][j]->getElementData();
+      if (expected.getTagName() != actual.getTagName() ||
+          expected.id() != actual.id()) {
+        mismatches++;
+      }
+    }
+  }
+  ASSERT_UNSIGNED_LONG_EQ(mismatches, 0ul);
+  ASSERT_UNSIGNED_LONG_EQ(found[0].size(), 100ul);
+  ASSERT_UNSIGNED_LONG_EQ(found[4].size(), 50ul);
+  ASSERT_TRUE(found[10].empty());
+  ASSERT_UNSIGNED_LONG_EQ(found[13].size(), 1ul);
+  ASSERT_TRUE(crawler::SelectorSet().select(root).empty());
+
+  // the tag "caaaa" and the id "baaaa" hash like the classes "baaaa" and
+  // "aaaaa", the selectors still match each element once.
+  ASSERT_TRUE(crawler::AncestorFilter::hash(crawler::IndexKey::Kind::Tag,
+                                            "caaaa") ==
+              crawler::AncestorFilter::hash(crawler::IndexKey::Kind::Class,
+                                            "baaaa"));
+  ASSERT_TRUE(crawler::AncestorFilter::hash(crawler::IndexKey::Kind::Id,
+                                            "baaaa") ==
+              crawler::AncestorFilter::hash(crawler::IndexKey::Kind::Class,
+                                            "aaaaa"));
+  crawler::SelectorSet colliding;
+  colliding.add(".baaaa");
+  colliding.add(".aaaaa");
+  colliding.add("caaaa");
+  auto collided = colliding.select(crawler::parse(
+      "<div><caaaa class=\"baaaa\">1</caaaa>"
+      "<p id=\"baaaa\" class=\"aaaaa baaaa\">2</p></div>"));
+  ASSERT_UNSIGNED_LONG_EQ(collided[0].size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(collided[1].size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(collided[2].size(), 1ul);
+}
+
+void testSiblingAndGroupSelect() {
+  crawler::Node root = crawler::parse(
+      "<div><h1 id=\"title\">Title</h1> <p id=\"first\">1</p>\n"
+      "<p id=\"second\">2</p><span id=\"note\"></span><p id=\"third\">3</p>"
+      "</div><h2 id=\"sub\">Sub</h2><p id=\"last\">4</p>");
+  auto ids = [](const crawler::Nodes &nodes) {
+    std::string result;
+    for (const crawler::Node &node : nodes) {
+      result += node.getElementData().id() + " ";
+    }
+    return result;
+  };
+  // text between siblings is skipped.
+  ASSERT_CSTRING_EQ(ids(root.select("h1 + p")).c_str(), "first ");
+  ASSERT_CSTRING_EQ(ids(root.select("p + p")).c_str(), "second ");
+  ASSERT_CSTRING_EQ(ids(root.select("h1 ~ p")).c_str(), "first second third ");
+  ASSERT_CSTRING_EQ(ids(root.select("div > p ~ span + p")).c_str(), "third ");
+  ASSERT_CSTRING_EQ(ids(root.select("div ~ p")).c_str(), "last ");
+  ASSERT_CSTRING_EQ(ids(root.select("h1 ~ p p")).c_str(), "");
+  // a group is matched in one walk, in document order and without
+  // duplicates.
+  ASSERT_CSTRING_EQ(ids(root.select("h2, h1")).c_str(), "title sub ");
+  ASSERT_CSTRING_EQ(ids(root.select("#first, p, div > p")).c_str(),
+                    "first second third last ");
+  ASSERT_CSTRING_EQ(ids(root.select("h1 + p,span,h2 ~ p")).c_str(),
+                    "first note last ");
+  crawler::Document document(
+      crawler::parse("<b id=\"x\"></b><i id=\"y\"></i>"));
+  ASSERT_UNSIGNED_LONG_EQ(document.select("#x, #y").size(), 2ul);
+
+  for (const char *query : {"h1 + p", "p + p", "h1 ~ p", "div ~ p",
+                            "div > p ~ span + p", "h2, h1", "#first, p"}) {
+    ASSERT_CSTRING_EQ(
+        ids(root.select(query)).c_str(),
+        ids(root.select(*crawler::QueryParser::parse(query))).c_str());
+  }
+
+  // a copied subtree keeps its own siblings, a copied node has none.
+  const crawler::Node div = root.select("div").front();
+  const crawler::Node first = root.select("#first").front();
+  for (const char *query : {"h1 + p", "h1 ~ p", "p + p"}) {
+    const std::string compiled = ids(div.select(query));
+    ASSERT_CSTRING_EQ(compiled.c_str(), ids(root.select(query)).c_str());
+    ASSERT_CSTRING_EQ(
+        compiled.c_str(),
+        ids(div.select(*crawler::QueryParser::parse(query))).c_str());
+    ASSERT_TRUE(first.select(query).empty());
+    ASSERT_TRUE(first.select(*crawler::QueryParser::parse(query)).empty());
+  }
+}
+
+void testAncestorFilter() {
+  crawler::AncestorFilter filter;
+  const uint32_t list = crawler::AncestorFilter::hash(
+      crawler::IndexKey::Kind::Class, "list");
+  ASSERT_FALSE(filter.mightContain(list));
+  crawler::Node root = crawler::parse(
+      "<div class=\"list\"><ul id=\"items\"><li>1</li></ul></div>");
+  filter.push(root);
+  ASSERT_TRUE(filter.mightContain(list));
+  ASSERT_TRUE(filter.mightContain(crawler::AncestorFilter::hash(
+      crawler::IndexKey::Kind::Tag, "div")));
+  ASSERT_FALSE(filter.mightContain(crawler::AncestorFilter::hash(
+      crawler::IndexKey::Kind::Class, "div")));
+  filter.pop();
+  ASSERT_FALSE(filter.mightContain(list));
+
+  // deeper than a counter can count.
+  std::string deep;
+  for (int i = 0; i < 300; i++) {
+    deep += "<div class=\"level\">";
+  }
+  deep += "<p>text</p>";
+  for (int i = 0; i < 300; i++) {
+    deep += "</div>";
+  }
+  deep += "<p>outside</p>";
+  crawler::Node deepRoot = crawler::parse(deep);
+  ASSERT_UNSIGNED_LONG_EQ(deepRoot.select("div p").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(deepRoot.select(".level > p").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(deepRoot.select("section p").size(), 0ul);
+  ASSERT_UNSIGNED_LONG_EQ(deepRoot.select("p").size(), 2ul);
+
+  // the ancestors of a subtree take part in the matching.
+  const crawler::Node *items = root.selectFirst("#items");
+  ASSERT_TRUE(items != nullptr);
+  ASSERT_UNSIGNED_LONG_EQ(items->select("div.list li").size(), 1ul);
+  ASSERT_TRUE(items->selectFirst(".list ul > li") != nullptr);
+  ASSERT_TRUE(items->selectFirst("section li") == nullptr);
+}
+
+void testCompiledSelector() {
+  crawler::Node root = crawler::parse(
+      "<div class=\"list\"><a href=\"/1\" rel=\"nofollow noopener\">1</a>"
+      "<p><a data-id=\"2\">2</a></p></div><a href=\"/3\">3</a>");
+  const crawler::Selector selector("div.list > a[href]");
+  using Code = crawler::SelectorOp::Code;
+  const std::vector<crawler::SelectorOp> &program = selector.getProgram();
+  ASSERT_UNSIGNED_LONG_EQ(program.size(), 5ul);
+  ASSERT_TRUE(program[0].code == Code::Tag);
+  ASSERT_TRUE(program[1].code == Code::Attribute);
+  ASSERT_TRUE(program[2].code == Code::Child);
+  ASSERT_TRUE(program[3].code == Code::Tag);
+  ASSERT_TRUE(program[4].code == Code::Class);
+  crawler::Nodes links = root.select(selector);
+  ASSERT_UNSIGNED_LONG_EQ(links.size(), 1ul);
+  ASSERT_CSTRING_EQ(links.at(0).getElementData().getValueByKey("href").c_str(),
+                    "/1");
+
+  // same results as the evaluators of `QueryParser`.
+  for (const char *query :
+       {"a", "div a", "div > p > a", "> a", ".list a", "[^data]", "[href^=/]",
+        "[href$=3]", "[href*=1]", "a[href!=/1]", "div [data-id=\"2\"]"}) {
+    ASSERT_UNSIGNED_LONG_EQ(root.select(crawler::Selector(query)).size(),
+                            root.select(*crawler::QueryParser::parse(query))
+                                .size());
+  }
+  ASSERT_UNSIGNED_LONG_EQ(root.select("div *").size(), 3ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("[rel~=noopener]").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("[rel~=noop]").size(), 0ul);
+  for (const char *query : {"", "div >", "a $", "a,", ", a", "a + , p"}) {
+    try {
+      crawler::Selector malformed(query);
+      ASSERT_TRUE(0);
+    } catch (const std::runtime_error &error) {
+      ASSERT_TRUE(error.what() != nullptr);
+    }
+  }
+
+  crawler::SelectorCache cache(2);
+  std::shared_ptr<const crawler::Selector> first = cache.get("a");
+  ASSERT_TRUE(cache.get("a") == first);
+  cache.get("p");
+  // "a" is used more recently than "p", so "p" is evicted.
+  ASSERT_TRUE(cache.get("a") == first);
+  cache.get("div");
+  ASSERT_UNSIGNED_LONG_EQ(cache.size(), 2ul);
+  ASSERT_TRUE(cache.get("a") == first);
+  cache.get("p");
+  cache.get("div");
+  ASSERT_TRUE(cache.get("a") != first);
+  ASSERT_CSTRING_EQ(first->getQuery().c_str(), "a");
+
+  // threads share the compiled selectors of the process-wide cache.
+  std::shared_ptr<const crawler::Selector> shared =
+      crawler::SelectorCache::shared().get("ul > li.shared");
+  std::vector<std::shared_ptr<const crawler::Selector>> seen(4);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < seen.size(); i++) {
+    threads.emplace_back([&seen, i] {
+      for (int j = 0; j < 1000; j++) {
+        crawler::SelectorCache::shared().get("li:nth-child(" +
+                                             std::to_string(j % 50) + ")");
+      }
+      seen[i] = crawler::SelectorCache::shared().get("ul > li.shared");
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (const auto &selector : seen) {
+    ASSERT_TRUE(selector == shared);
+  }
+}
+
+void testDocumentIndex() {
+  crawler::Document document(crawler::parse(
+      "<div id=\"main\" class=\"parent\"><p class=\"item  first\">1</p>"
+      "<p class=\"item\">2</p><span class=\"item item\">3</span></div>"
+      "<DIV id=\"main\"></DIV>"));
+  document.buildIndexes();
+  const crawler::Node *main = document.getElementById("main");
+  ASSERT_TRUE(main != nullptr);
+  ASSERT_CSTRING_EQ(main->getElementData().clazz().c_str(), "parent");
+  ASSERT_TRUE(document.getElementById("missing") == nullptr);
+  ASSERT_UNSIGNED_LONG_EQ(document.getElementsByTag("P").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.getElementsByTag("div").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.getElementsByClass("item").size(), 3ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.getElementsByClass("first").size(), 1ul);
+  ASSERT_TRUE(document.getElementsByClass("missing").empty());
+
+  // the index only narrows down the candidates, the query still decides.
+  ASSERT_UNSIGNED_LONG_EQ(document.select("p.item").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.select("span.item").size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.select("#main").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.select("div.parent > p").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(document.select("[class]").size(), 4ul);
+  ASSERT_TRUE(document.select("table").empty());
+  const crawler::Node *first = document.selectFirst("#main > p.item");
+  ASSERT_TRUE(first != nullptr);
+  ASSERT_CSTRING_EQ(first->getChildren().at(0).getText().c_str(), "1");
+
+  // nodes keep their address when the document is moved.
+  crawler::Document moved = std::move(document);
+  ASSERT_TRUE(moved.getElementById("main") == main);
+  ASSERT_TRUE(main->getParent() == &moved.getRoot());
+}
+
+void testSelectFirst() {
+  crawler::Node root = crawler::parse(
+      "<html><head><meta property=\"og:title\" content=\"Title\">"
+      "<link rel=\"canonical\" href=\"/movie\"></head><body>"
+      "<h1 id=\"first\">First</h1><h1 id=\"second\">Second</h1>"
+      "<p id=\"first\"></p></body></html>");
+  const crawler::Node *heading = root.selectFirst("h1");
+  ASSERT_TRUE(heading != nullptr);
+  ASSERT_CSTRING_EQ(heading->getElementData().id().c_str(), "first");
+  const crawler::Node *meta = root.selectFirst(R"(meta[property="og:title"])");
+  ASSERT_TRUE(meta != nullptr);
+  ASSERT_CSTRING_EQ(meta->getElementData().getValueByKey("content").c_str(),
+                    "Title");
+  ASSERT_TRUE(root.selectFirst("table") == nullptr);
+
+  crawler::Nodes headings = root.select("h1", 1);
+  ASSERT_UNSIGNED_LONG_EQ(headings.size(), 1ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("h1", 5).size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(root.select("h1", 0).size(), 0ul);
+
+  std::string ids;
+  for (const crawler::Node &node : root.lazySelect("[id]")) {
+    ids += node.getElementData().id() + " ";
+    if (node.getElementData().getTagName() == "h1" &&
+        node.getElementData().id() == "second") {
+      break;
+    }
+  }
+  ASSERT_CSTRING_EQ(ids.c_str(), "first second ");
+  ASSERT_TRUE(root.lazySelect("table").empty());
+
+  // duplicated ids don't fail, the first one wins.
+  crawler::Node first = root.getElementById("first");
+  ASSERT_CSTRING_EQ(first.getElementData().getTagName().c_str(), "h1");
+  ASSERT_TRUE(root.getElementById("missing").isText());
+}
+
+void testTraversal() {
+  crawler::Node root = crawler::parse(
+      "<div id=\"a\"><p id=\"b\"><span id=\"c\"></span></p>"
+      "<ul id=\"d\"><li id=\"e\"></li><li id=\"f\"></li></ul></div>");
+  std::string ids;
+  for (const crawler::Node &node : root.preorder()) {
+    ids += node.getElementData().id();
+  }
+  ASSERT_CSTRING_EQ(ids.c_str(), "abcdef");
+  ids.clear();
+  for (const crawler::Node &node : root.breadthFirst()) {
+    ids += node.getElementData().id();
+  }
+  ASSERT_CSTRING_EQ(ids.c_str(), "abdcef");
+  ids.clear();
+  root.visit([&ids](const crawler::Node &node) {
+    const std::string id = node.getElementData().id();
+    ids += id;
+    if (id == "b") {
+      return crawler::VisitResult::SkipChildren;
+    }
+    return id == "e" ? crawler::VisitResult::Stop
+                     : crawler::VisitResult::Continue;
+  });
+  ASSERT_CSTRING_EQ(ids.c_str(), "abde");
+
+  const crawler::Node &list = root.getChildren().at(1);
+  const crawler::Node &first = list.getChildren().front();
+  ASSERT_TRUE(list.getParent() == &root);
+  ASSERT_TRUE(first.getParent() == &list);
+  ASSERT_TRUE(first.previousSibling() == nullptr);
+  ASSERT_TRUE(first.nextSibling() == &list.getChildren().back());
+  ASSERT_TRUE(list.getChildren().back().nextSibling() == nullptr);
+  ASSERT_UNSIGNED_LONG_EQ(list.getChildren().back().siblingIndex(), 1ul);
+  ids.clear();
+  const crawler::Node &paragraph = root.getChildren().front();
+  for (const crawler::Node &sibling : paragraph.followingSiblings()) {
+    ids += sibling.getElementData().id();
+  }
+  ASSERT_CSTRING_EQ(ids.c_str(), "d");
+
+  // a copied tree points to itself, the original is left as is.
+  crawler::Node copy = root;
+  ASSERT_TRUE(copy.getChildren().at(1).getParent() == &copy);
+  ASSERT_TRUE(list.getParent() == &root);
+  // a subtree can be moved out of its own tree.
+  copy = crawler::Node(copy.getChildren().at(1));
+  ASSERT_CSTRING_EQ(copy.getElementData().id().c_str(), "d");
+  ASSERT_TRUE(copy.getChildren().front().getParent() == &copy);
+
+  // the nodes selected are copies, with a copy of their parent and without
+  // siblings.
+  crawler::Nodes items = root.select("li");
+  ASSERT_UNSIGNED_LONG_EQ(items.size(), 2ul);
+  ASSERT_TRUE(items.at(0).getParent() != &list);
+  ASSERT_CSTRING_EQ(items.at(0).getParent()->getElementData().id().c_str(),
+                    "d");
+  ASSERT_TRUE(items.at(0).getParent()->getParent()->getParent() == nullptr);
+  ASSERT_TRUE(items.at(0).nextSibling() == nullptr);
+  ASSERT_TRUE(items.at(1).previousSibling() == nullptr);
+  ASSERT_UNSIGNED_LONG_EQ(items.at(1).siblingIndex(), 0ul);
+  ASSERT_TRUE(items.at(0).followingSiblings().begin() ==
+              items.at(0).followingSiblings().end());
+  // and outlive the tree they are copied from.
+  crawler::Node section =
+      crawler::parse("<div><section id=x><p>a</p><p>b</p></section></div>")
+          .getElementById("x");
+  ASSERT_UNSIGNED_LONG_EQ(section.select("p").size(), 2ul);
+  ASSERT_UNSIGNED_LONG_EQ(section.select("div p").size(), 2ul);
+  ASSERT_CSTRING_EQ(section.getParent()->getElementData().getTagName().c_str(),
+                    "div");
+  ASSERT_TRUE(section.getChildren().back().previousSibling() ==
+              &section.getChildren().front());
+}
+
+void testCharset() {
+  ASSERT_TRUE(crawler::Charset::Gb18030 ==
+              crawler::charsetFromContentType("text/html; charset=GBK"));
+  ASSERT_TRUE(crawler::Charset::Utf8 ==
+              crawler::charsetFromContentType("text/html;charset=\"utf-8\""));
+  ASSERT_TRUE(crawler::Charset::Unknown ==
+              crawler::charsetFromContentType("text/html"));
+  ASSERT_TRUE(crawler::Charset::Big5 ==
+              crawler::sniffCharset("<html><head><META CHARSET=big5>"));
+  ASSERT_TRUE(crawler::Charset::Unknown ==
+              crawler::charsetFromLabel("big5-hkscs"));
+  ASSERT_TRUE(crawler::Charset::Gb18030 ==
+              crawler::sniffCharset("<meta http-equiv=\"Content-Type\" "
+                                    "content=\"text/html; charset=gb2312\">"));
+
+  const char *invalid[] = {"\xC0\xAF",         "\xE0\x80\xAF", "\xED\xA0\x80",
+                           "\xF4\x90\x80\x80", "\xE4\xB8",      "\x80",
+                           "\xF8\x88\x80\x80\x80"};
+  for (size_t padding = 0; padding < 20; padding++) {
+    const std::string ascii(padding, 'a');
+    const std::string valid = ascii + "豆瓣 \xF0\x9F\x98\x80 é" + ascii;
+    ASSERT_TRUE(crawler::isValidUtf8(valid.data(), valid.size()));
+    for (const char *sequence : invalid) {
+      const std::string text = ascii + sequence + ascii;
+      ASSERT_FALSE(crawler::isValidUtf8(text.data(), text.size()));
+    }
+  }
+  // fed byte by byte, the decoder checks every sequence with its own state
+  // machine and leaves valid UTF-8 untouched, check the validator against it.
+  uint32_t seed = 42;
+  int mismatches = 0;
+  const unsigned char bytes[] = {'a', 0x80, 0xBF, 0xC3, 0xE0, 0xE4,
+                                 0xED, 0xF0, 0xF4, 0xB8, 0x9F, 0xA0};
+  for (int i = 0; i < 2000; i++) {
+    std::string text;
+    for (int j = 0; j < 40; j++) {
+      seed = seed * 1103515245 + 12345;
+      text += static_cast<char>(bytes[(seed >> 16) % sizeof(bytes)]);
+    }
+    const bool valid =
+        decodeCharset(crawler::Charset::Utf8, text, 1) == text;
+    if (valid != crawler::isValidUtf8(text.data(), text.size())) {
+      mismatches++;
+    }
+  }
+  ASSERT_INT_EQ(0, mismatches);
+
+  for (size_t chunkSize : {1UL, 2UL, 3UL, 64UL}) {
+    ASSERT_CSTRING_EQ(
+        "a豆瓣电影",
+        decodeCharset(crawler::Charset::Gb18030,
+                      "a\xB6\xB9\xB0\xEA\xB5\xE7\xD3\xB0", chunkSize)
+            .c_str());
+    ASSERT_CSTRING_EQ("\xF0\x9F\x98\x80\xC2\x80€",
+                      decodeCharset(crawler::Charset::Gb18030,
+                                    "\x94\x39\xFC\x36\x81\x30\x81\x30\x80",
+                                    chunkSize)
+                          .c_str());
+    ASSERT_CSTRING_EQ(
+        "電影",
+        decodeCharset(crawler::Charset::Big5, "\xB9q\xBCv", chunkSize).c_str());
+    ASSERT_CSTRING_EQ("豆\xEF\xBF\xBD"
+                      "a\xEF\xBF\xBD",
+                      decodeCharset(crawler::Charset::Utf8,
+                                    "\xE8\xB1\x86\xE8\xB1"
+                                    "a\xE8",
+                                    chunkSize)
+                          .c_str());
+    ASSERT_CSTRING_EQ(
+        "\xEF\xBF\xBD<",
+        decodeCharset(crawler::Charset::Gb18030, "\xB6<", chunkSize).c_str());
+  }
+
+  const std::string gbk =
+      "<html><head><meta charset=\"gbk\"></head><body>"
+      "<p>\xB6\xB9\xB0\xEA\xB5\xE7\xD3\xB0</p></body></html>";
+  crawler::Node node = crawler::parse(gbk);
+  crawler::Node paragraph = node.select("p").at(0);
+  ASSERT_CSTRING_EQ("豆瓣电影", paragraph.getChildren().at(0).getText().c_str());
+  crawler::StreamParser parser;
+  for (char c : gbk) {
+    parser.feed(&c, 1);
+  }
+  node = parser.finish();
+  paragraph = node.select("p").at(0);
+  ASSERT_CSTRING_EQ("豆瓣电影", paragraph.getChildren().at(0).getText().c_str());
+}
+
+void testParseFile() {
+  std::ifstream file("source/parseTest.html");
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  const std::string expect = dumpNode(crawler::parse(buffer.str()));
+  crawler::ParseOptions options;
+  options.lazyAttributes = true;
+  crawler::Node node = crawler::parseFile("source/parseTest.html", options);
+  ASSERT_CSTRING_EQ(expect.c_str(), dumpNode(node).c_str());
+  crawler::Node main = node.getElementById("main");
+  ASSERT_CSTRING_EQ("test", main.getElementData().clazz().c_str());
+  bool thrown = false;
+  try {
+    crawler::parseFile("source/missing.html");
+  } catch (const std::system_error &e) {
+    thrown = true;
+    ASSERT_INT_EQ(ENOENT, e.code().value());
+  }
+  ASSERT_TRUE(thrown);
+}
+
+void testPrunedParse() {
+  const std::string source =
+      "<html><head><meta charset=\"utf-8\"><style>a{}</style></head>"
+      "<body><div class=\"nav\"><a href=\"/a\">A <b>bold</b></a>"
+      "<div><div>x</div></div><img src=\"x.png\"></div>"
+      "<div id=\"content\"><p>1</p><p>2</p></div>"
+      "<script>var s = '<div>';</script><a href=\"/b\">B</a></body></html>";
+
+  crawler::ParseOptions links;
+  links.allowTags = {"a", "meta"};
+  crawler::Node node = crawler::parse(source, links);
+  ASSERT_UNSIGNED_LONG_EQ(3UL, node.getChildren().size());
+  crawler::Node meta = node.getChildren().at(0);
+  ASSERT_CSTRING_EQ("meta", meta.getElementData().getTagName().c_str());
+  ASSERT_CSTRING_EQ("<a href=/a>\"A \"<b>\"bold\"</></>",
+                    dumpNode(node.getChildren().at(1)).c_str());
+  ASSERT_CSTRING_EQ("<a href=/b>\"B\"</>",
+                    dumpNode(node.getChildren().at(2)).c_str());
+
+  crawler::ParseOptions content;
+  content.rootSelector = "#content";
+  content.lazyAttributes = true;
+  ASSERT_CSTRING_EQ("<div id=content><p>\"1\"</><p>\"2\"</></>",
+                    dumpNode(crawler::parse(source, content)).c_str());
+  content.rootSelector = "div:not(.nav)[id^=cont], p.none";
+  content.lazyAttributes = false;
+  ASSERT_CSTRING_EQ("<div id=content><p>\"1\"</><p>\"2\"</></>",
+                    dumpNode(crawler::parse(source, content)).c_str());
+  for (const char *query : {"div > #content", "body p", "p:nth-child(1)"}) {
+    content.rootSelector = query;
+    bool thrown = false;
+    try {
+      (void)crawler::parse(source, content);
+    } catch (const std::runtime_error &e) {
+      thrown = true;
+    }
+    ASSERT_TRUE(thrown);
+  }
+
+  crawler::ParseOptions noise;
+  noise.denyTags = {"div", "img", "script", "style"};
+  ASSERT_CSTRING_EQ("<html><head><meta charset=utf-8></></><body><a href=/b>"
+                    "\"B\"</></></>",
+                    dumpNode(crawler::parse(source, noise)).c_str());
+}
+
+void testDecodeEntities() {
+  ASSERT_CSTRING_EQ("a < b & c",
+                    crawler::decodeEntities("a &lt; b &amp; c").c_str());
+  ASSERT_CSTRING_EQ("//", crawler::decodeEntities("&#47;&#x2F;").c_str());
+  ASSERT_CSTRING_EQ("© ©2 €",
+                    crawler::decodeEntities("&copy; &copy2 &#128;").c_str());
+  ASSERT_CSTRING_EQ("≂̸", crawler::decodeEntities("&NotEqualTilde;").c_str());
+  ASSERT_CSTRING_EQ("¬it; ∉",
+                    crawler::decodeEntities("&notit; &notin;").c_str());
+  ASSERT_CSTRING_EQ("& &; &# &#x; &unknown;",
+                    crawler::decodeEntities("& &; &# &#x; &unknown;").c_str());
+  ASSERT_CSTRING_EQ("\xEF\xBF\xBD\xEF\xBF\xBD",
+                    crawler::decodeEntities("&#0;&#x110000;").c_str());
+  ASSERT_CSTRING_EQ(
+      "?a=1&copy=2&b=©",
+      crawler::decodeEntities("?a=1&copy=2&b=&copy", true).c_str());
+
+  crawler::Node node = crawler::parse(
+      "<div><a href=\"/s?q=1&amp;p=2\">Tom &amp; Jerry</a>"
+      "<script>a &amp;&amp; b</script></div>");
+  crawler::Node link = node.getChildren().at(0);
+  ASSERT_CSTRING_EQ("/s?q=1&p=2",
+                    link.getElementData().getValueByKey("href").c_str());
+  ASSERT_CSTRING_EQ("Tom & Jerry",
+                    link.getChildren().at(0).getText().c_str());
+  crawler::Node script = node.getChildren().at(1);
+  ASSERT_CSTRING_EQ("a &amp;&amp; b",
+                    script.getChildren().at(0).getText().c_str());
+}
+
+void testLazyAttributes() {
+  std::ifstream file("source/parseTest.html");
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  std::string source = buffer.str();
+  crawler::ParseOptions options;
+  options.lazyAttributes = true;
+  const std::string expect = dumpNode(crawler::parse(source));
+  ASSERT_CSTRING_EQ(expect.c_str(),
+                    dumpNode(crawler::parse(source, options)).c_str());
+  for (size_t chunkSize : {1UL, 5UL, 4096UL}) {
+    crawler::StreamParser parser(options);
+    for (size_t pos = 0; pos < source.size(); pos += chunkSize) {
+      parser.feed(source.data() + pos,
+                  std::min(chunkSize, source.size() - pos));
+    }
+    crawler::Node node = parser.finish();
+    ASSERT_CSTRING_EQ(expect.c_str(), dumpNode(node).c_str());
+  }
+  crawler::Node node = crawler::parse(
+      "<div><input ID=name disabled value='a > b'/><br/><a href=x/>y</a>"
+      "</div>",
+      options);
+  crawler::Node input = node.getChildren().at(0);
+  ASSERT_CSTRING_EQ("name", input.getElementData().id().c_str());
+  ASSERT_TRUE(input.getElementData().containsAttribute("disabled"));
+  ASSERT_CSTRING_EQ("a > b",
+                    input.getElementData().getValueByKey("value").c_str());
+  crawler::Node br = node.getChildren().at(1);
+  ASSERT_TRUE(br.getElementData().getAttributes().empty());
+  crawler::Node link = node.getChildren().at(2);
+  ASSERT_CSTRING_EQ("x/", link.getElementData().getValueByKey("href").c_str());
+  ASSERT_CSTRING_EQ("y", link.getChildren().at(0).getText().c_str());
+  ASSERT_UNSIGNED_LONG_EQ(1UL, node.select("#name").size());
+}
+
+void testStreamParser() {
+  std::ifstream file("source/parseTest.html");
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  std::string source = buffer.str();
+  const std::string expect = dumpNode(crawler::parse(source));
+  for (size_t chunkSize : {1UL, 3UL, 17UL, 4096UL}) {
+    crawler::StreamParser parser;
+    for (size_t pos = 0; pos < source.size(); pos += chunkSize) {
+      parser.feed(source.data() + pos,
+                  std::min(chunkSize, source.size() - pos));
+    }
+    crawler::Node node = parser.finish();
+    ASSERT_CSTRING_EQ(expect.c_str(), dumpNode(node).c_str());
+  }
+  crawler::StreamParser parser;
+  parser.feed("<div id=\"ma");
+  parser.feed("in\"><p>a < b</p><!-- x -");
+  parser.feed("-><script>if (a</b) {}</scr");
+  parser.feed("ipt></div>");
+  crawler::Node node = parser.finish();
+  crawler::Node main = node.getElementById("main");
+  ASSERT_UNSIGNED_LONG_EQ(2UL, main.getChildren().size());
+  crawler::Node paragraph = main.getChildren().at(0);
+  ASSERT_CSTRING_EQ("a < b", paragraph.getChildren().at(0).getText().c_str());
+  crawler::Node script = main.getChildren().at(1);
+  ASSERT_CSTRING_EQ("if (a</b) {}",
+                    script.getChildren().at(0).getText().c_str());
+}
+
+/// Record tokenizer events as a string.
+class RecordingHandler : public crawler::TokenHandler {
+public:
+  void startElement(crawler::StartTag &tag) override {
+    events += "<" + tag.tagName;
+    for (auto const &keyValuePair : tag.attributes) {
+      events += " " + keyValuePair.first + "=" + keyValuePair.second;
+    }
+    events += tag.selfClosing ? "/>" : ">";
+  }
+  void endElement(const std::string &tagName) override {
+    events += "</" + tagName + ">";
+  }
+  void text(std::string_view text) override {
+    events += "[" + std::string(text) + "]";
+  }
+  std::string events;
+};
+
+void testTokenizerEvents() {
+  const std::string source =
+      R"(<!DOCTYPE html><p class=a data-id='1' hidden>Hi <br/>x</p >)";
+  RecordingHandler handler;
+  crawler::Tokenizer tokenizer(handler);
+  for (char c : source) {
+    tokenizer.feed(&c, 1);
+  }
+  tokenizer.finish();
+  ASSERT_CSTRING_EQ(R"(<p class=a data-id=1 hidden=>[Hi ]<br/>[x]</p>)",
+                    handler.events.c_str());
+}
+
+void testResponseReader() {
+  const std::string response = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/html; charset=utf-8\r\n"
+                               "Transfer-Encoding: chunked\r\n\r\n"
+                               "5\r\n<p>He\r\n"
+                               "9;ext=1\r\nllo</p>\r\n\r\n"
+                               "0\r\n\r\n";
+  std::string body;
+  crawler::ResponseReader reader([&body](const char *data, size_t length) {
+    body.append(data, length);
+  });
+  for (char c : response) {
+    reader.feed(&c, 1);
+  }
+  ASSERT_INT_EQ(200, reader.getStatus());
+  ASSERT_CSTRING_EQ("text/html; charset=utf-8",
+                    reader.getHeaders().at("content-type").c_str());
+  ASSERT_CSTRING_EQ("<p>Hello</p>\r\n", body.c_str());
+
+  // bare LF line endings, the body starts in the chunk ending the head.
+  body.clear();
+  crawler::ResponseReader lfReader([&body](const char *data, size_t length) {
+    body.append(data, length);
+  });
+  const std::string lf = "HTTP/1.0 404 Not Found\nServer: x\n\n<p>gone</p>";
+  lfReader.feed(lf.data(), lf.size());
+  ASSERT_INT_EQ(404, lfReader.getStatus());
+  ASSERT_CSTRING_EQ("x", lfReader.getHeaders().at("server").c_str());
+  ASSERT_CSTRING_EQ("<p>gone</p>", body.c_str());
+
+  // a head which never ends isn't buffered without bound.
+  crawler::ResponseReader endless([](const char *, size_t) {});
+  const std::string header = "X-Padding: " + std::string(1000, 'x') + "\r\n";
+  bool thrown = false;
+  try {
+    endless.feed("HTTP/1.1 200 OK\r\n", 17);
+    for (size_t size = 0; size <= crawler::ResponseReader::MAX_HEAD_SIZE;
+         size += header.size()) {
+      endless.feed(header.data(), header.size());
+    }
+  } catch (const std::runtime_error &error) {
+    thrown = true;
+    ASSERT_CSTRING_EQ("HTTP_HEAD_TOO_LARGE", error.what());
+  }
+  ASSERT_TRUE(thrown);
+
+  // the charset of the headers reaches the parser before the body.
+  const std::string gbk = "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/html; charset=GBK\r\n\r\n"
+                          "<p>\xC4\xE3\xBA\xC3</p>";
+  std::unique_ptr<crawler::StreamParser> parser;
+  crawler::ResponseReader gbkReader(
+      [&parser](const char *data, size_t length) {
+        parser->feed(data, length);
+      },
+      [&parser](int status,
+                const std::map<std::string, std::string> &headers) {
+        ASSERT_INT_EQ(200, status);
+        crawler::ParseOptions options;
+        options.charset =
+            crawler::charsetFromContentType(headers.at("content-type"));
+        parser = std::make_unique<crawler::StreamParser>(options);
+      });
+  for (size_t pos = 0; pos < gbk.size(); pos += 7) {
+    gbkReader.feed(gbk.data() + pos, std::min<size_t>(7, gbk.size() - pos));
+  }
+  ASSERT_TRUE(parser != nullptr);
+  ASSERT_CSTRING_EQ("<p>\"你好\"</>", dumpNode(parser->finish()).c_str());
+}
+
+void testImpliedEndTags() {
+  crawler::Node node = crawler::parse(
+      "<UL><li>a<li>b<ul><li>c</ul></ul><p>x<div>y</div><b><i>z</b>w</i>");
+  crawler::Nodes items = node.select("ul > li");
+  ASSERT_UNSIGNED_LONG_EQ(3UL, items.size());
+  ASSERT_UNSIGNED_LONG_EQ(2UL, node.getChildren().at(0).getChildren().size());
+  // <div> closes the open <p>
+  crawler::Nodes paragraphs = node.select("p");
+  ASSERT_UNSIGNED_LONG_EQ(1UL, paragraphs.size());
+  ASSERT_UNSIGNED_LONG_EQ(1UL, paragraphs.front().getChildren().size());
+  // misnested </b> closes <i>, the stray </i> is ignored.
+  crawler::Nodes bold = node.select("b");
+  ASSERT_UNSIGNED_LONG_EQ(1UL, bold.size());
+  ASSERT_UNSIGNED_LONG_EQ(1UL, bold.front().getChildren().size());
+  ASSERT_CSTRING_EQ("w", node.getChildren().back().getText().c_str());
+
+  // </span> can't close the <div> inside it.
+  node = crawler::parse("<span><div>a</span>b</div></span>");
+  crawler::Node div = node.select("div").front();
+  ASSERT_UNSIGNED_LONG_EQ(2UL, div.getChildren().size());
+
+  node = crawler::parse("<table><tr><td>1<td>2<tr><td>3</table>");
+  ASSERT_UNSIGNED_LONG_EQ(2UL, node.select("tr").size());
+  ASSERT_UNSIGNED_LONG_EQ(3UL, node.select("td").size());
+}
+
+void testMalformedHtml() {
+  // unclosed nesting deeper than the limit must neither recurse nor crash.
+  std::string source;
+  for (int i = 0; i < 100000; i++) {
+    source += "<div>";
+  }
+  crawler::Node node = crawler::parse(source);
+  ASSERT_TRUE(node.isElement());
+  node = crawler::parse(source.substr(0, 5 * 1000));
+  size_t depth = 1;
+  crawler::Node current = node;
+  while (!current.getChildren().empty()) {
+    crawler::Node child = current.getChildren().back();
+    current = child;
+    depth++;
+  }
+  ASSERT_TRUE(depth <= crawler::TreeBuilder::MAX_DEPTH);
+
+  node = crawler::parse(R"(<div id=a><p x="1>text</div></b><a href=x)");
+  ASSERT_TRUE(node.isElement());
+  crawler::Parser parser(0, "just text");
+  ASSERT_TRUE(parser.parseElement().isText());
+}
+
 /// Html End
 
 /// JSON Start
@@ -551,9 +1602,340 @@ void testJsonParseObjectError() {
   testJsonParseError("PARSE_MISS_COMMA_OR_CURLY_BRACKET", "{\"a\":1 \"b\"");
   testJsonParseError("PARSE_MISS_COMMA_OR_CURLY_BRACKET", "{\"a\":{}");
 }
+
+void testJsonParseLarge() {
+  std::string json = "{\"items\": [";
+  for (int i = 0; i < 20000; i++) {
+    json += (i == 0 ? "" : ", ");
+    json += "{\"id\": " + std::to_string(i) + ", \"title\": \"item\"}";
+  }
+  json += "], \"total\": 20000}";
+  crawler::JsonValue value = crawler::JsonParser::parse(json);
+  crawler::JsonObject object = value.getObject();
+  ASSERT_DOUBLE_EQ(20000.0, object["total"].getNumber());
+  crawler::JsonArray items = object["items"].getArray();
+  ASSERT_UNSIGNED_LONG_EQ(20000UL, items.size());
+  crawler::JsonObject last = items.back().getObject();
+  ASSERT_DOUBLE_EQ(19999.0, last["id"].getNumber());
+  ASSERT_CSTRING_EQ("item", last["title"].getString().c_str());
+
+  // numbers after the first value of the text.
+  crawler::JsonArray numbers =
+      crawler::JsonParser::parse("[1.5, -2e3, 0]").getArray();
+  ASSERT_DOUBLE_EQ(1.5, numbers[0].getNumber());
+  ASSERT_DOUBLE_EQ(-2e3, numbers[1].getNumber());
+  ASSERT_DOUBLE_EQ(0.0, numbers[2].getNumber());
+
+  crawler::JsonValue unicode =
+      crawler::JsonParser::parse("\"\\u4F60\\u597D \\uD83D\\uDE00\"");
+  ASSERT_CSTRING_EQ("你好 😀", unicode.getString().c_str());
+
+  testJsonParseError("PARSE_MISS_COMMA_OR_SQUARE_BRACKET", "[1 2]");
+  testJsonParseError("PARSE_MISS_COMMA_OR_SQUARE_BRACKET", "[1");
+  testJsonParseError("PARSE_INVALID_UNICODE_HEX", "\"\\u12G4\"");
+  testJsonParseError("PARSE_INVALID_UNICODE_SURROGATE", "\"\\uD800\"");
+  testJsonParseError("PARSE_TOO_DEEP", std::string(1000, '['));
+}
+
+void testJsonStructuralIndex() {
+  std::vector<uint32_t> positions;
+  std::string json = "{\"a\\\"\": [1, true], \"b\" :null}";
+  ASSERT_TRUE(crawler::indexStructurals(json, positions));
+  std::string structurals;
+  for (uint32_t position : positions) {
+    structurals += json[position];
+  }
+  ASSERT_CSTRING_EQ("{\"\":[1,t],\"\":n}", structurals.c_str());
+
+  // an escaped quote and a run of backslashes across 64 bytes blocks.
+  std::string text(62, 'x');
+  json = "[\"" + text + "\\\"\\\\\\\\\", 12]";
+  ASSERT_TRUE(crawler::indexStructurals(json, positions));
+  ASSERT_UNSIGNED_LONG_EQ(6UL, positions.size());
+  ASSERT_UNSIGNED_LONG_EQ(70UL, static_cast<unsigned long>(positions[2]));
+  crawler::JsonArray array = crawler::JsonParser::parse(json).getArray();
+  ASSERT_CSTRING_EQ((text + "\"\\\\").c_str(), array[0].getString().c_str());
+  ASSERT_DOUBLE_EQ(12.0, array[1].getNumber());
+
+  ASSERT_FALSE(crawler::indexStructurals("[\"abc]", positions));
+  ASSERT_FALSE(crawler::indexStructurals("\"a\nb\"", positions));
+
+  // invalid text fails the same way with and without the index.
+  testJsonParseError("PARSE_MISS_COMMA_OR_SQUARE_BRACKET", "[12x]");
+  testJsonParseError("PARSE_ROOT_NOT_SINGULAR", "1 2");
+  testJsonParseError("PARSE_MISS_QUOTATION_MARK", "[\"abc]");
+  testJsonParseError("PARSE_INVALID_STRING_CHAR", "\"a\nb\"");
+}
+
+void testJsonWriter() {
+  crawler::JsonWriter writer;
+  writer.beginObject().key("title").value("a \"b\"\n\x01");
+  writer.key("tags").beginArray().value(1).value(2.5).value(true);
+  writer.value(nullptr).endArray().key("empty").beginObject().endObject();
+  writer.endObject();
+  writer.beginArray().endArray();
+  ASSERT_CSTRING_EQ("{\"title\":\"a \\\"b\\\"\\n\\u0001\",\"tags\":[1,2.5,true,"
+                    "null],\"empty\":{}}\n[]",
+                    std::string(writer.getBuffer()).c_str());
+
+  std::string json = "{\"items\":[{\"id\":1,\"name\":\"你\\\\\"},[]],"
+                     "\"rate\":-1.5e-07}";
+  ASSERT_CSTRING_EQ(
+      json.c_str(),
+      crawler::JsonWriter::stringify(crawler::JsonParser::parse(json))
+          .c_str());
+
+  bool thrown = false;
+  try {
+    crawler::JsonWriter().beginArray().key("a");
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  ASSERT_TRUE(thrown);
+
+  // a full buffer is flushed to the file descriptor.
+  int fds[2];
+  ASSERT_INT_EQ(0, pipe(fds));
+  {
+    crawler::JsonWriter pipeWriter(fds[1], 8);
+    pipeWriter.value("0123456789");
+    ASSERT_UNSIGNED_LONG_EQ(0UL, pipeWriter.getBuffer().size());
+    pipeWriter.value(42);
+  }
+  close(fds[1]);
+  char output[32];
+  ssize_t length = read(fds[0], output, sizeof(output));
+  close(fds[0]);
+  ASSERT_CSTRING_EQ("\"0123456789\"\n42",
+                    std::string(output, length > 0 ? length : 0).c_str());
+}
+
+void testJsonLinesSink() {
+  char directory[] = "/tmp/crawler-sink-XXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != nullptr);
+  const std::string prefix = std::string(directory) + "/movies";
+  crawler::SinkOptions options;
+  options.rotateBytes = 4096;
+  options.batchBytes = 1024;
+  {
+    crawler::JsonLinesSink sink(prefix, options);
+    ASSERT_CSTRING_EQ((prefix + "-000001.jsonl").c_str(),
+                      sink.currentPath().c_str());
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < 4; worker++) {
+      workers.emplace_back([&sink, worker] {
+        for (int i = 0; i < 500; i++) {
+          crawler::JsonWriter record;
+          record.beginObject().key("worker").value(worker).key("id").value(i);
+          record.endObject();
+          sink.append(std::string(record.getBuffer()));
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    sink.append(crawler::JsonParser::parse("{\"last\":true}"));
+    sink.sync();
+    sink.close();
+  }
+
+  // every record is on its own line, in order for each worker.
+  size_t records = 0;
+  size_t files = 0;
+  int next[4] = {0, 0, 0, 0};
+  bool ordered = true;
+  for (size_t index = 1;; index++) {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%06zu.jsonl", index);
+    const std::string path = prefix + suffix;
+    std::ifstream file(path);
+    if (!file) {
+      break;
+    }
+    files++;
+    std::string line;
+    while (std::getline(file, line)) {
+      crawler::JsonObject record = crawler::JsonParser::parse(line).getObject();
+      if (record.count("worker") > 0) {
+        const int worker = static_cast<int>(record["worker"].getNumber());
+        ordered = ordered && record["id"].getNumber() == next[worker]++;
+      }
+      records++;
+    }
+    unlink(path.c_str());
+  }
+  rmdir(directory);
+  ASSERT_UNSIGNED_LONG_EQ(2001UL, records);
+  ASSERT_TRUE(ordered);
+  ASSERT_TRUE(files > 1);
+}
+
+void testJsonDocument() {
+  crawler::JsonDocument document(
+      "{\"count\": 2, \"subjects\": [{\"title\": \"\\u4F60\\\"\", \"rating\": "
+      "{\"average\": 8.5}, \"seen\": true}, {\"title\": \"b\", \"tags\": []}],"
+      " \"next\": null, \"k\\u0065y\": 1}");
+  crawler::JsonElement root = document.root();
+  ASSERT_TRUE(root.getType() == crawler::JsonType::OBJECT);
+  ASSERT_UNSIGNED_LONG_EQ(4UL, root.size());
+  ASSERT_DOUBLE_EQ(2.0, root["count"].getNumber());
+  crawler::JsonElement subjects = root["subjects"];
+  ASSERT_UNSIGNED_LONG_EQ(2UL, subjects.size());
+  // the second subject is reached by skipping the whole first one.
+  ASSERT_CSTRING_EQ("b", subjects[1]["title"].getString().c_str());
+  ASSERT_UNSIGNED_LONG_EQ(0UL, subjects[1]["tags"].size());
+  ASSERT_DOUBLE_EQ(8.5, subjects[0]["rating"]["average"].getNumber());
+  ASSERT_TRUE(subjects[0]["seen"].getBoolean());
+  ASSERT_CSTRING_EQ("\\u4F60\\\"",
+                    std::string(subjects[0]["title"].getRawString()).c_str());
+  ASSERT_CSTRING_EQ("你\"", subjects[0]["title"].getString().c_str());
+  ASSERT_TRUE(root["next"].isNull());
+  ASSERT_DOUBLE_EQ(1.0, root["key"].getNumber());
+  ASSERT_FALSE(root.find("missing").has_value());
+  bool thrown = false;
+  try {
+    subjects[2];
+  } catch (const std::out_of_range &) {
+    thrown = true;
+  }
+  ASSERT_TRUE(thrown);
+
+  std::string keys;
+  for (auto member = root.begin(); member != root.end(); ++member) {
+    keys += member.key() + ",";
+  }
+  ASSERT_CSTRING_EQ("count,subjects,next,key,", keys.c_str());
+  ASSERT_CSTRING_EQ(
+      crawler::JsonWriter::stringify(crawler::JsonParser::parse(
+                                         "[1,{\"a\":[true,\"x\"]},null]"))
+          .c_str(),
+      crawler::JsonWriter::stringify(
+          crawler::JsonDocument::view("[1,{\"a\":[true,\"x\"]},null]")
+              .root()
+              .materialize())
+          .c_str());
+
+  thrown = false;
+  try {
+    crawler::JsonDocument("{\"a\":1 \"b\"");
+  } catch (const std::runtime_error &error) {
+    thrown = true;
+    ASSERT_CSTRING_EQ("PARSE_MISS_COMMA_OR_CURLY_BRACKET", error.what());
+  }
+  ASSERT_TRUE(thrown);
+
+  thrown = false;
+  try {
+    crawler::JsonDocument("[1e-400, -1e400]");
+  } catch (const std::runtime_error &error) {
+    thrown = true;
+    ASSERT_CSTRING_EQ("PARSE_NUMBER_TOO_BIG", error.what());
+  }
+  ASSERT_TRUE(thrown);
+  ASSERT_DOUBLE_EQ(1e300, crawler::JsonDocument::view("[1e300]")
+                              .root()[0]
+                              .getNumber());
+}
+
+/// Memory resource counting the allocations passed to `upstream`.
+class CountingResource : public std::pmr::memory_resource {
+public:
+  size_t allocations = 0;
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *pointer, size_t bytes, size_t alignment) override {
+    std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+  }
+
+  [[nodiscard]] bool
+  do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+void testJsonValueAccessors() {
+  crawler::JsonParser parser("{\"items\": [\"a\", \"b\"], \"title\": \"x\"}");
+  const crawler::JsonValue &value = parser.parse();
+  ASSERT_TRUE(&value == &parser.getJsonValue());
+  // accessors return references into the tree, nothing is copied.
+  const crawler::JsonArray &items = value.getObject().at("items").getArray();
+  ASSERT_TRUE(&items ==
+              &parser.getJsonValue().getObject().at("items").getArray());
+  ASSERT_CSTRING_EQ("b", items[1].getString().c_str());
+
+  crawler::JsonValue root = parser.takeJsonValue();
+  ASSERT_TRUE(parser.getJsonValue().isEmptyValue());
+  root.getObject().at("title").getString() += "yz";
+  crawler::JsonValue &list = root.getObject().at("items");
+  list.getArray().emplace_back(crawler::JsonType::NUMBER, 1.0);
+  ASSERT_UNSIGNED_LONG_EQ(3UL, list.getArray().size());
+  ASSERT_CSTRING_EQ("{\"items\":[\"a\",\"b\",1],\"title\":\"xyz\"}",
+                    crawler::JsonWriter::stringify(root).c_str());
+
+  // the buffer of a moved string is taken over.
+  crawler::JsonString text(100, 'x');
+  const char *buffer = text.data();
+  crawler::JsonValue moved(crawler::JsonType::STRING);
+  moved.setData(std::move(text));
+  moved.setType(crawler::JsonType::STRING);
+  ASSERT_TRUE(buffer == moved.getString().data());
+
+  // every string and container of the document comes from the arena.
+  CountingResource counting;
+  std::pmr::memory_resource *previous =
+      std::pmr::set_default_resource(&counting);
+  {
+    std::pmr::monotonic_buffer_resource arena(std::pmr::new_delete_resource());
+    crawler::JsonValue document = crawler::JsonParser::parse(
+        "{\"subjects\": [{\"title\": \"a long title, not a short string\", "
+        "\"tags\": [\"x\\n\"]}]}",
+        &arena);
+    const crawler::JsonValue &subject =
+        document.getObject().at("subjects").getArray()[0];
+    ASSERT_TRUE(subject.getObject().at("title").getString().get_allocator() ==
+                std::pmr::polymorphic_allocator<char>(&arena));
+    ASSERT_TRUE(subject.getObject().at("tags").getArray().get_allocator() ==
+                crawler::JsonArray::allocator_type(&arena));
+  }
+  std::pmr::set_default_resource(previous);
+  ASSERT_UNSIGNED_LONG_EQ(0UL, counting.allocations);
+}
 /// JSON End
 
 int main() {
+  testJsonValueAccessors();
+  testJsonDocument();
+  testJsonLinesSink();
+  testJsonWriter();
+  testJsonStructuralIndex();
+  testJsonParseLarge();
+  testStaticSelector();
+  testClassTokens();
+  testSelectorPlan();
+  testPseudoClassSelect();
+  testSelectorSet();
+  testSiblingAndGroupSelect();
+  testAncestorFilter();
+  testCompiledSelector();
+  testDocumentIndex();
+  testSelectFirst();
+  testTraversal();
+  testCharset();
+  testParseFile();
+  testPrunedParse();
+  testDecodeEntities();
+  testLazyAttributes();
+  testMalformedHtml();
+  testImpliedEndTags();
+  testResponseReader();
+  testTokenizerEvents();
+  testStreamParser();
   testJsonParseObjectError();
   testJsonParseObject();
   testJsonParseArray();
@@ -0,0 +1,482 @@
+///
+/// Push-style html tokenizer, fed by arbitrary sized chunks.
+///
+
+#include "tokenizer.hpp"
+#include "entities.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+inline bool isWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+inline bool isAsciiAlpha(char c) {
+  const char lower = static_cast<char>(c | 0x20);
+  return lower >= 'a' && lower <= 'z';
+}
+
+inline char toAsciiLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c;
+}
+
+} // namespace
+
+crawler::Tokenizer::Tokenizer(TokenHandler &handler, ParseOptions options)
+    : handler(handler), options(options) {}
+
+void crawler::Tokenizer::feed(std::string_view chunk) {
+  feed(chunk.data(), chunk.size());
+}
+
+void crawler::Tokenizer::feed(const char *data, size_t length,
+                              const std::shared_ptr<const void> &owner) {
+  this->owner = owner;
+  feed(data, length);
+  this->owner = nullptr;
+}
+
+crawler::AttrMap crawler::Tokenizer::parseAttributes(std::string_view raw) {
+  struct AttributeCollector : public TokenHandler {
+    AttrMap attributes;
+    void startElement(StartTag &tag) override {
+      attributes = std::move(tag.attributes);
+    }
+    void endElement(const std::string &) override {}
+    void text(std::string_view) override {}
+  };
+  AttributeCollector collector;
+  Tokenizer tokenizer(collector);
+  tokenizer.state = State::BeforeAttributeName;
+  tokenizer.feed(raw);
+  tokenizer.feed(">", 1);
+  return std::move(collector.attributes);
+}
+
+void crawler::Tokenizer::beginToken(const char *p) {
+  inToken = true;
+  tokenBegin = p;
+  carry.clear();
+}
+
+size_t crawler::Tokenizer::tokenLength(const char *p) const {
+  return carry.size() + (tokenBegin == nullptr ? 0 : p - tokenBegin);
+}
+
+bool crawler::Tokenizer::collectsAttributes() const {
+  return !options.lazyAttributes && skipDepth == 0;
+}
+
+void crawler::Tokenizer::flushText(const char *p) {
+  if (textLength > 0 && skipDepth == 0) {
+    if (carry.empty() && owner != nullptr) {
+      handler.sharedText(std::string_view(tokenBegin, textLength), owner);
+    } else if (carry.empty()) {
+      handler.text(std::string_view(tokenBegin, textLength));
+    } else {
+      if (tokenBegin != nullptr) {
+        carry.append(tokenBegin, p - tokenBegin);
+      }
+      handler.text(std::string_view(carry.data(), textLength));
+    }
+  }
+  inToken = false;
+  tokenBegin = nullptr;
+  textLength = 0;
+  carry.clear();
+}
+
+void crawler::Tokenizer::commitAttribute() {
+  if (!attributeName.empty() && collectsAttributes()) {
+    if (hasEntities(attributeValue)) {
+      attributeValue = decodeEntities(attributeValue, true);
+    }
+    tag.attributes.emplace(std::move(attributeName), std::move(attributeValue));
+  }
+  attributeName.clear();
+  attributeValue.clear();
+}
+
+void crawler::Tokenizer::emitStartTag(const char *p) {
+  commitAttribute();
+  if (inAttributes) {
+    const size_t length = tokenLength(p);
+    if (!carry.empty()) {
+      carry.append(tokenBegin, p - tokenBegin);
+    }
+    const char *raw = carry.empty() ? tokenBegin : carry.data();
+    if (std::any_of(raw, raw + length,
+                    [](char c) { return !isWhitespace(c) && c != '/'; })) {
+      if (carry.empty() && owner != nullptr) {
+        tag.rawAttributes = {owner, std::string_view(raw, length)};
+      } else {
+        auto copy = std::make_shared<const std::string>(raw, length);
+        tag.rawAttributes = {copy, std::string_view(*copy)};
+      }
+    }
+    inAttributes = false;
+    inToken = false;
+    tokenBegin = nullptr;
+    carry.clear();
+  }
+  state = State::Data;
+  if (!tag.selfClosing) {
+    for (auto const &rawTag : RAW_TEXT_TAGS) {
+      if (rawTag == tag.tagName) {
+        rawTextTag = rawTag;
+        state = State::RawText;
+      }
+    }
+  }
+  const bool opensElement =
+      !tag.selfClosing && SELF_CLOSING_TAGS.count(tag.tagName) == 0;
+  if (skipDepth > 0) {
+    if (opensElement && tag.tagName == skipTag) {
+      skipDepth++;
+    }
+  } else if (options.denyTags.count(tag.tagName) > 0) {
+    if (opensElement) {
+      skipTag = tag.tagName;
+      skipDepth = 1;
+    }
+  } else {
+    handler.startElement(tag);
+  }
+  tag = StartTag();
+}
+
+void crawler::Tokenizer::emitEndTag() {
+  if (skipDepth == 0) {
+    handler.endElement(endTagName);
+  } else if (endTagName == skipTag) {
+    skipDepth--;
+  }
+  endTagName.clear();
+  state = State::Data;
+}
+
+void crawler::Tokenizer::feed(const char *data, size_t length) {
+  const char *p = data;
+  const char *const end = data + length;
+  if (inToken) {
+    tokenBegin = p;
+  }
+  while (p < end) {
+    const char c = *p;
+    switch (state) {
+    case State::Data: {
+      if (!inToken) {
+        while (p < end && isWhitespace(*p)) {
+          p++;
+        }
+        if (p == end) {
+          break;
+        }
+        beginToken(p);
+      }
+      const void *lt = memchr(p, '<', end - p);
+      if (lt == nullptr) {
+        p = end;
+        break;
+      }
+      p = static_cast<const char *>(lt);
+      textLength = tokenLength(p);
+      p++;
+      state = State::TagOpen;
+      break;
+    }
+    case State::TagOpen:
+      if (c == '/') {
+        flushText(p);
+        state = State::EndTagOpen;
+        p++;
+      } else if (c == '!') {
+        flushText(p);
+        state = State::MarkupDeclarationOpen;
+        p++;
+      } else if (c == '?') {
+        flushText(p);
+        state = State::BogusComment;
+        p++;
+      } else if (isAsciiAlpha(c)) {
+        flushText(p);
+        state = State::TagName;
+      } else {
+        // not a tag, `<` is part of the text.
+        state = State::Data;
+      }
+      break;
+    case State::TagName:
+      if ((isWhitespace(c) || c == '/') && options.lazyAttributes &&
+          skipDepth == 0) {
+        beginToken(p);
+        inAttributes = true;
+      }
+      if (isWhitespace(c)) {
+        state = State::BeforeAttributeName;
+      } else if (c == '/') {
+        state = State::SelfClosingStartTag;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else {
+        tag.tagName += toAsciiLower(c);
+      }
+      p++;
+      break;
+    case State::BeforeAttributeName:
+      if (c == '/') {
+        state = State::SelfClosingStartTag;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else if (!isWhitespace(c)) {
+        state = State::AttributeName;
+        break;
+      }
+      p++;
+      break;
+    case State::AttributeName:
+      if (isWhitespace(c)) {
+        state = State::AfterAttributeName;
+      } else if (c == '/') {
+        commitAttribute();
+        state = State::SelfClosingStartTag;
+      } else if (c == '=') {
+        state = State::BeforeAttributeValue;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else if (collectsAttributes()) {
+        attributeName += toAsciiLower(c);
+      }
+      p++;
+      break;
+    case State::AfterAttributeName:
+      if (c == '/') {
+        commitAttribute();
+        state = State::SelfClosingStartTag;
+      } else if (c == '=') {
+        state = State::BeforeAttributeValue;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else if (!isWhitespace(c)) {
+        // a new attribute without value, eg <input disabled checked>
+        commitAttribute();
+        state = State::AttributeName;
+        break;
+      }
+      p++;
+      break;
+    case State::BeforeAttributeValue:
+      if (c == '"') {
+        state = State::AttributeValueDoubleQuoted;
+      } else if (c == '\'') {
+        state = State::AttributeValueSingleQuoted;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else if (!isWhitespace(c)) {
+        state = State::AttributeValueUnquoted;
+        break;
+      }
+      p++;
+      break;
+    case State::AttributeValueDoubleQuoted:
+    case State::AttributeValueSingleQuoted: {
+      const char quote =
+          state == State::AttributeValueDoubleQuoted ? '"' : '\'';
+      const void *close = memchr(p, quote, end - p);
+      if (close == nullptr) {
+        if (collectsAttributes()) {
+          attributeValue.append(p, end);
+        }
+        p = end;
+        break;
+      }
+      if (collectsAttributes()) {
+        attributeValue.append(p, static_cast<const char *>(close));
+      }
+      p = static_cast<const char *>(close) + 1;
+      commitAttribute();
+      state = State::AfterAttributeValueQuoted;
+      break;
+    }
+    case State::AttributeValueUnquoted:
+      if (isWhitespace(c)) {
+        commitAttribute();
+        state = State::BeforeAttributeName;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else if (collectsAttributes()) {
+        attributeValue += c;
+      }
+      p++;
+      break;
+    case State::AfterAttributeValueQuoted:
+      if (isWhitespace(c)) {
+        state = State::BeforeAttributeName;
+      } else if (c == '/') {
+        state = State::SelfClosingStartTag;
+      } else if (c == '>') {
+        emitStartTag(p);
+      } else {
+        state = State::BeforeAttributeName;
+        break;
+      }
+      p++;
+      break;
+    case State::SelfClosingStartTag:
+      if (c == '>') {
+        tag.selfClosing = true;
+        emitStartTag(p);
+        p++;
+      } else {
+        state = State::BeforeAttributeName;
+      }
+      break;
+    case State::EndTagOpen:
+      if (isAsciiAlpha(c)) {
+        state = State::EndTagName;
+      } else if (c == '>') {
+        // `</>` is ignored.
+        state = State::Data;
+        p++;
+      } else {
+        state = State::BogusComment;
+      }
+      break;
+    case State::EndTagName:
+      if (isWhitespace(c) || c == '/') {
+        state = State::AfterEndTagName;
+      } else if (c == '>') {
+        emitEndTag();
+      } else {
+        endTagName += toAsciiLower(c);
+      }
+      p++;
+      break;
+    case State::AfterEndTagName: {
+      const void *gt = memchr(p, '>', end - p);
+      if (gt == nullptr) {
+        p = end;
+        break;
+      }
+      p = static_cast<const char *>(gt) + 1;
+      emitEndTag();
+      break;
+    }
+    case State::MarkupDeclarationOpen:
+      if (c == '-') {
+        state = State::CommentStart;
+        p++;
+      } else {
+        // doctype, CDATA or `<!>`, skip to the next `>`.
+        state = State::BogusComment;
+      }
+      break;
+    case State::CommentStart:
+      if (c == '-') {
+        state = State::Comment;
+        p++;
+      } else {
+        state = State::BogusComment;
+      }
+      break;
+    case State::Comment: {
+      const void *dash = memchr(p, '-', end - p);
+      if (dash == nullptr) {
+        p = end;
+        break;
+      }
+      p = static_cast<const char *>(dash) + 1;
+      state = State::CommentEndDash;
+      break;
+    }
+    case State::CommentEndDash:
+      state = c == '-' ? State::CommentEnd : State::Comment;
+      p++;
+      break;
+    case State::CommentEnd:
+      if (c == '>') {
+        state = State::Data;
+      } else if (c != '-') {
+        state = State::Comment;
+      }
+      p++;
+      break;
+    case State::BogusComment: {
+      const void *gt = memchr(p, '>', end - p);
+      if (gt == nullptr) {
+        p = end;
+        break;
+      }
+      p = static_cast<const char *>(gt) + 1;
+      state = State::Data;
+      break;
+    }
+    case State::RawText: {
+      if (!inToken) {
+        beginToken(p);
+      }
+      const void *lt = memchr(p, '<', end - p);
+      if (lt == nullptr) {
+        p = end;
+        break;
+      }
+      p = static_cast<const char *>(lt);
+      textLength = tokenLength(p);
+      p++;
+      state = State::RawTextLessThan;
+      break;
+    }
+    case State::RawTextLessThan:
+      if (c == '/') {
+        rawTextMatched = 0;
+        state = State::RawTextEndTagName;
+        p++;
+      } else {
+        state = State::RawText;
+      }
+      break;
+    case State::RawTextEndTagName:
+      if (rawTextMatched < rawTextTag.size()) {
+        if (toAsciiLower(c) != rawTextTag[rawTextMatched]) {
+          state = State::RawText;
+          break;
+        }
+        rawTextMatched++;
+        p++;
+      } else if (isWhitespace(c) || c == '/' || c == '>') {
+        flushText(p);
+        endTagName = rawTextTag;
+        state = State::AfterEndTagName;
+      } else {
+        state = State::RawText;
+      }
+      break;
+    }
+  }
+  if (inToken) {
+    if (tokenBegin != nullptr) {
+      carry.append(tokenBegin, end - tokenBegin);
+    }
+    tokenBegin = nullptr;
+  }
+}
+
+void crawler::Tokenizer::finish() {
+  if (inToken && !inAttributes) {
+    // the pending `<` never turned into a tag, so it belongs to the text.
+    textLength = tokenLength(nullptr);
+    flushText(nullptr);
+  }
+  state = State::Data;
+  inToken = false;
+  inAttributes = false;
+  skipDepth = 0;
+  carry.clear();
+  tag = StartTag();
+  attributeName.clear();
+  attributeValue.clear();
+  endTagName.clear();
+}
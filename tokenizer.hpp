@@ -0,0 +1,203 @@
+///
+/// Push-style html tokenizer, fed by arbitrary sized chunks.
+///
+
+#ifndef DOUBANCRAWLER_TOKENIZER_H
+#define DOUBANCRAWLER_TOKENIZER_H
+
+#include "charset.hpp"
+#include "dom.hpp"
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+
+namespace crawler {
+
+inline const std::set<std::string> SELF_CLOSING_TAGS = {
+    "area",   "base", "br",       "col",  "embed", "hr",     "img",   "input",
+    "keygen", "link", "menuitem", "meta", "param", "source", "track", "wbr"};
+
+/// Options of html parsing.
+struct ParseOptions {
+  /// Keep the attributes of each element as a raw span of the input and parse
+  /// them on first access, most elements of a crawled page are never asked for
+  /// their attributes.
+  bool lazyAttributes = false;
+
+  /// Skip the subtrees of these elements in the tokenizer, no event is emitted
+  /// until the matching end tag; eg {"script", "style", "svg"}. Meant for
+  /// elements whose end tag is never omitted.
+  std::set<std::string> denyTags;
+
+  /// Only build the subtrees of these elements, eg {"a", "meta"} for a link
+  /// crawler. Everything outside them is dropped.
+  std::set<std::string> allowTags;
+
+  /// Only build the subtrees of the elements matching this compound selector,
+  /// eg "#content" or "div.article". Combines with `allowTags`. Parsing throws
+  /// `std::runtime_error` if it has a combinator or a structural pseudo class.
+  std::string rootSelector;
+
+  /// Charset of the input, eg `charsetFromContentType(contentType)`. Sniffed
+  /// from <meta> if unknown, UTF-8 if there is none. The input is transcoded
+  /// to UTF-8 ahead of the tokenizer.
+  Charset charset = Charset::Unknown;
+};
+
+/// Start tag emitted by the tokenizer; eg <div class="test">, tagName = "div",
+/// attributes = { class = "test" }. Tag and attribute names are lower case.
+struct StartTag {
+  std::string tagName;
+  AttrMap attributes;
+  /// `<br/>` style tag, no matching end tag will follow.
+  bool selfClosing = false;
+  /// Unparsed attributes with lazy attributes enabled, eg ` class="test"`,
+  /// `attributes` is empty then.
+  RawSpan rawAttributes;
+};
+
+/// SAX-style receiver of tokenizer events.
+class TokenHandler {
+public:
+  /// Called for every start tag, the handler is free to move from `tag`.
+  virtual void startElement(StartTag &tag) = 0;
+
+  /// Called for every end tag, eg </div>, `tagName` is lower case.
+  virtual void endElement(const std::string &tagName) = 0;
+
+  /// Called for every text run between two tags, leading whitespace is
+  /// skipped and whitespace-only runs are dropped. `text` is only valid during
+  /// the call, character references are left to `decodeEntities`.
+  virtual void text(std::string_view text) = 0;
+
+  /// Called instead of `text` if `text` lies in a chunk kept alive by `owner`,
+  /// so the handler may keep a view of it.
+  virtual void sharedText(std::string_view text,
+                          const std::shared_ptr<const void> &owner) {
+    (void)owner;
+    this->text(text);
+  }
+
+  virtual ~TokenHandler() = default;
+};
+
+/// Html tokenizer which accepts the input chunk by chunk, eg straight from the
+/// http response reader, and keeps its state across chunk boundaries. Comments
+/// and doctype are skipped, the content of <script> and <style> is emitted as
+/// a single text run.
+class Tokenizer {
+public:
+  explicit Tokenizer(TokenHandler &handler,
+                     ParseOptions options = ParseOptions());
+
+  /// Tokenize the next chunk of input.
+  void feed(const char *data, size_t length);
+
+  /// Tokenize the next chunk of input which is kept alive by `owner`, raw
+  /// attributes point into the chunk instead of being copied.
+  void feed(const char *data, size_t length,
+            const std::shared_ptr<const void> &owner);
+
+  /// Tokenize the next chunk of input.
+  void feed(std::string_view chunk);
+
+  /// Flush the pending text at the end of input, an unfinished tag is dropped.
+  void finish();
+
+  /// Parse the attributes of a start tag, eg ` id="main" disabled`.
+  static AttrMap parseAttributes(std::string_view raw);
+
+private:
+  enum class State {
+    Data,
+    TagOpen,
+    EndTagOpen,
+    TagName,
+    EndTagName,
+    AfterEndTagName,
+    BeforeAttributeName,
+    AttributeName,
+    AfterAttributeName,
+    BeforeAttributeValue,
+    AttributeValueDoubleQuoted,
+    AttributeValueSingleQuoted,
+    AttributeValueUnquoted,
+    AfterAttributeValueQuoted,
+    SelfClosingStartTag,
+    MarkupDeclarationOpen,
+    CommentStart,
+    Comment,
+    CommentEndDash,
+    CommentEnd,
+    BogusComment,
+    RawText,
+    RawTextLessThan,
+    RawTextEndTagName
+  };
+
+  /// Start a text token at `p`.
+  void beginToken(const char *p);
+
+  /// Length of current text token up to `p`.
+  [[nodiscard]] size_t tokenLength(const char *p) const;
+
+  /// Emit the first `textLength` bytes of current text token and drop it.
+  void flushText(const char *p);
+
+  /// Emit the collected start tag, `p` points to its `>`.
+  void emitStartTag(const char *p);
+
+  /// Emit the collected end tag.
+  void emitEndTag();
+
+  /// Move the collected name="value" pair into the start tag.
+  void commitAttribute();
+
+  /// Attribute names and values are collected, eg not lazy nor skipped.
+  [[nodiscard]] bool collectsAttributes() const;
+
+  TokenHandler &handler;
+
+  ParseOptions options;
+
+  State state = State::Data;
+
+  /// A token (text or raw attributes) is in progress.
+  bool inToken = false;
+
+  /// The token in progress is the raw attributes of a start tag.
+  bool inAttributes = false;
+
+  /// Begin of the token in current chunk.
+  const char *tokenBegin = nullptr;
+
+  /// Part of the token carried over from previous chunks.
+  std::string carry;
+
+  /// Owner of current chunk, if any.
+  std::shared_ptr<const void> owner;
+
+  /// Length of the text in front of the `<` being examined.
+  size_t textLength = 0;
+
+  StartTag tag;
+  std::string attributeName;
+  std::string attributeValue;
+  std::string endTagName;
+
+  /// Number of open `skipTag` elements in the denied subtree being skipped.
+  size_t skipDepth = 0;
+  std::string skipTag;
+
+  /// Name of the raw text element (script or style) being consumed.
+  std::string rawTextTag;
+  size_t rawTextMatched = 0;
+
+  inline static const std::array<std::string, 2> RAW_TEXT_TAGS = {"script",
+                                                                  "style"};
+};
+
+} // namespace crawler
+
+#endif // DOUBANCRAWLER_TOKENIZER_H
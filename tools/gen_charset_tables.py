@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Generate charset_tables.cpp, the GB18030 and Big5 to unicode tables.
+
+Usage: python3 tools/gen_charset_tables.py > charset_tables.cpp
+
+Two-byte tables are indexed by (lead - 0x81) * 191 + (trail - 0x40), 0 means
+unmapped. The four-byte GB18030 sequences in the BMP are listed as ranges of
+consecutive code points, keyed by the linear pointer of the sequence.
+"""
+
+
+def two_byte_table(codec):
+    table = []
+    for lead in range(0x81, 0xFF):
+        for trail in range(0x40, 0xFF):
+            try:
+                text = bytes([lead, trail]).decode(codec)
+            except UnicodeDecodeError:
+                text = ""
+            table.append(ord(text) if len(text) == 1 else 0)
+    return table
+
+
+def gb18030_ranges():
+    ranges = []
+    previous = None
+    for pointer in range(39420):
+        b1, rest = divmod(pointer, 12600)
+        b2, rest = divmod(rest, 1260)
+        b3, b4 = divmod(rest, 10)
+        sequence = bytes([0x81 + b1, 0x30 + b2, 0x81 + b3, 0x30 + b4])
+        code_point = ord(sequence.decode("gb18030"))
+        if previous is None or code_point != previous + 1:
+            ranges.append((pointer, code_point))
+        previous = code_point
+    return ranges
+
+
+def print_table(name, table):
+    print("extern const uint16_t %s[%d] = {" % (name, len(table)))
+    for i in range(0, len(table), 9):
+        row = ", ".join("0x%04X" % value for value in table[i:i + 9])
+        print("    %s," % row)
+    print("};")
+    print()
+
+
+print("// Generated by tools/gen_charset_tables.py, do not edit.")
+print()
+print("#include <cstdint>")
+print()
+print("namespace crawler::tables {")
+print()
+print_table("GB18030_TWO_BYTE", two_byte_table("gb18030"))
+print_table("BIG5_TWO_BYTE", two_byte_table("cp950"))
+ranges = gb18030_ranges()
+print("extern const uint32_t GB18030_RANGES[%d][2] = {" % len(ranges))
+for pointer, code_point in ranges:
+    print("    {%d, 0x%04X}," % (pointer, code_point))
+print("};")
+print()
+print("} // namespace crawler::tables")
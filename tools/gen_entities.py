@@ -0,0 +1,13 @@
+#!/usr/bin/env python3
+"""Generate entity_table.inc, the html5 named character references.
+
+Usage: python3 tools/gen_entities.py > entity_table.inc
+"""
+from html.entities import html5
+
+print("// Generated by tools/gen_entities.py, do not edit.")
+print("// {name, first code point, second code point or 0}")
+for name in sorted(html5):
+    value = html5[name]
+    second = "0x%X" % ord(value[1]) if len(value) > 1 else "0"
+    print('{"%s", 0x%X, %s},' % (name, ord(value[0]), second))
@@ -0,0 +1,79 @@
+///
+/// Throughput of the json parser, with and without the structural index or an
+/// arena, of the lazy tape and of the writer.
+///
+/// Usage: json_bench file.json...
+/// Build with cmake -DBUILD_BENCHMARK=on.
+///
+
+#include "../json.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory_resource>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int ROUNDS = 20;
+
+/// Best throughput of `parse` over `ROUNDS` runs, in GB/s.
+template <typename Parse>
+double throughput(const std::string &json, Parse parse) {
+  double best = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    const auto begin = std::chrono::steady_clock::now();
+    parse(json);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    best = std::max(best, json.size() / elapsed.count() / 1e9);
+  }
+  return best;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s file.json...\n", argv[0]);
+    return 1;
+  }
+  std::printf("%-24s %10s %10s %10s %10s %10s %10s %10s\n", "file", "size",
+              "stage 1", "indexed", "arena", "cursor", "tape", "write");
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string json = buffer.str();
+
+    std::vector<uint32_t> positions;
+    const double stage1 = throughput(json, [&](const std::string &text) {
+      crawler::indexStructurals(text, positions);
+    });
+    const double indexed = throughput(json, [](const std::string &text) {
+      crawler::JsonParser::parse(text);
+    });
+    const double arena = throughput(json, [](const std::string &text) {
+      std::pmr::monotonic_buffer_resource resource;
+      crawler::JsonParser::parse(text, &resource);
+    });
+    const double cursor = throughput(json, [](const std::string &text) {
+      crawler::JsonParser::parseWithoutIndex(text);
+    });
+    const double tape = throughput(json, [](const std::string &text) {
+      crawler::JsonDocument::view(text);
+    });
+    const crawler::JsonValue value = crawler::JsonParser::parse(json);
+    const double write = throughput(json, [&](const std::string &) {
+      crawler::JsonWriter::stringify(value);
+    });
+    std::printf("%-24s %10zu %7.2fGB/s %7.2fGB/s %7.2fGB/s %7.2fGB/s "
+                "%7.2fGB/s %7.2fGB/s\n",
+                argv[i], json.size(), stage1, indexed, arena, cursor, tape,
+                write);
+  }
+  return 0;
+}